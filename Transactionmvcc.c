@@ -2,157 +2,8809 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
-#define MAX_KEYS 16
-#define MAX_KEYNAME 16
-#define MAX_TRANSACTIONS 32
+#define MAX_KEYS 65536
+#define MAX_KEYNAME 32
+#define MAX_TRANSACTIONS 1024
 #define MAX_WRITESET 8
+#define MAX_WATCHSET 16
+#define MAX_SCANSET 8
+#define KEY_INDEX_SLOTS (MAX_KEYS*2)
 
-typedef int txid_t;
-typedef int commit_ts_t;
+typedef int64_t txid_t;
+typedef int64_t commit_ts_t;
+
+int trace = 1;                 // 0 = silence per-operation logging
+#define TRACE(...) do { if (trace) printf(__VA_ARGS__); } while (0)
 
 // ===== Versioned Value =====
 typedef struct Version {
     commit_ts_t commit_ts;     // commit timestamp
     char *value;               // stored value
+    int64_t expires_ms;        // wall-clock ms, 0 = never
     struct Version *next;      // newer -> older
 } Version;
 
 // ===== Key =====
+typedef void (*watch_cb)(const char *key, commit_ts_t ts, void *arg);
+
+// One pending watch on a key; fires once, for the first version newer
+// than since_ts.
+typedef struct Waiter {
+    commit_ts_t since_ts;
+    commit_ts_t fired_ts;      // 0 while pending
+    watch_cb cb;               // NULL = a thread blocked in watch()
+    void *arg;
+    pthread_cond_t cond;
+    struct Waiter *next;
+} Waiter;
+
 typedef struct Key {
     char name[MAX_KEYNAME];
     Version *versions;         // head = newest version
-    txid_t lock_owner;         // 0 = no lock
+    txid_t lock_owner;         // 2PL exclusive holder, 0 = no lock
+    struct LockHolder *lock_holders;   // 2PL holders, shared or exclusive
+    struct LockWait *lock_waiters;     // 2PL transactions blocked on the key
+    Waiter *waiters;           // NULL unless someone watches the key
 } Key;
 
 // ===== Transaction =====
-typedef enum {TX_ACTIVE, TX_ABORTED, TX_COMMITTED} tx_state_t;
+typedef enum {TX_ACTIVE, TX_ABORTED, TX_COMMITTED, TX_PREPARED} tx_state_t;
+typedef enum {DL_WAIT_DIE, DL_WOUND_WAIT, DL_DETECT} deadlock_policy_t;
+typedef enum {ISO_SNAPSHOT, ISO_READ_COMMITTED, ISO_SERIALIZABLE} isolation_t;
 
 typedef struct KVPair {
     char key[MAX_KEYNAME];
     char value[128];
+    int64_t expires_ms;        // 0 = never
 } KVPair;
 
 typedef struct Transaction {
     txid_t id;
     commit_ts_t start_ts;
     tx_state_t state;
+    int installing;            // inside tx_install: never expired
+    int reserved;              // 2PC: store slots its writes will create
     KVPair write_set[MAX_WRITESET];
     int write_count;
+    char watch_set[MAX_WATCHSET][MAX_KEYNAME]; // must be unchanged at commit
+    commit_ts_t watch_ts[MAX_WATCHSET];        // ... since this snapshot
+    int watch_count;
+    char scan_set[MAX_SCANSET][MAX_KEYNAME];   // scanned prefixes, checked for phantoms
+    int scan_count;
+    int slot;                  // index in active_tx, -1 once finished
+    commit_ts_t commit_ts;     // set by tx_commit
+    isolation_t isolation;
+    uint64_t gtid;             // 2PC: coordinator's id once prepared
+    commit_ts_t prepare_ts;    // 2PC: this participant's proposal
+    int two_pl;                // strict 2PL: locks instead of snapshot reads
+    deadlock_policy_t deadlock;
+    int wounded;               // an older wound-wait transaction wants our locks
+    txid_t age;                // id of the first attempt, for wait-die/wound-wait
+    uint64_t begin_ns;         // admission control: latency to commit or abort
+    uint64_t snapshot_ns;      // when start_ts was taken, for its age
+    char (*held)[MAX_KEYNAME]; // keys we hold locks on
+    int nheld, held_cap;
+    char waiting_for[MAX_KEYNAME];     // key we are blocked on, "" if none
+    int waiting_exclusive;
+    pthread_cond_t lock_cond;
 } Transaction;
 
+typedef struct LockHolder {
+    Transaction *tx;
+    int exclusive;
+    struct LockHolder *next;
+} LockHolder;
+
+typedef struct LockWait {
+    Transaction *tx;
+    int exclusive;
+    struct LockWait *next;
+} LockWait;
+
 // ===== Global Store =====
 Key store[MAX_KEYS];
 int store_count = 0;
+int free_slots[MAX_KEYS];      // store slots released by the expiry reaper
+int nfree = 0;
+int keys_reserved = 0;         // slots promised to prepared 2PC transactions
 commit_ts_t global_commit_ts = 1;
 txid_t global_tx_seq = 1;
 pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+int key_index[KEY_INDEX_SLOTS];          // open addressing: store slot + 1, 0 = empty
+Transaction *active_tx[MAX_TRANSACTIONS]; // running transactions (pin snapshots)
+long memtable_bytes = 0;
+
+// Transactions prepared under two-phase commit, waiting for the decision.
+// Their writes are still buffered, so they are found by scanning this table;
+// there are few of them and only for the length of a round trip.
+#define MAX_PREPARED 256
+
+Transaction *prepared[MAX_PREPARED];
+int prepared_count = 0;
+pthread_cond_t prepared_cond = PTHREAD_COND_INITIALIZER;
 
 // ===== Helpers =====
+static uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+// Expiry times are wall-clock so that they survive a restart.
+static int64_t wall_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return (int64_t)t.tv_sec*1000 + t.tv_nsec/1000000;
+}
+
+static int read_full(int fd, void *buf, size_t n) {
+    for (size_t got = 0; got < n;) {
+        ssize_t r = read(fd, (char*)buf + got, n - got);
+        if (r <= 0) return -1;
+        got += r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t n) {
+    for (size_t done = 0; done < n;) {
+        ssize_t w = write(fd, (const char*)buf + done, n - done);
+        if (w <= 0) return -1;
+        done += w;
+    }
+    return 0;
+}
+
+static int expired(const Version *v, int64_t now) {
+    return v->expires_ms && v->expires_ms <= now;
+}
+
+static unsigned key_hash(const char *k) {
+    unsigned h = 2166136261u;  // FNV-1a
+    while (*k) { h ^= (unsigned char)*k++; h *= 16777619u; }
+    return h;
+}
+
+// Versions from bulk_load live in arenas carved out of one address range,
+// reserved once, so telling them apart costs version_free one compare.
+// GC only unlinks them; memtable_clear gives the range back whole unless
+// a load is building in it.
+#define BULK_RESERVE (1L<<34)
+
+char *bulk_base = NULL;
+size_t bulk_used = 0;
+int bulk_building = 0;                 // bulk_load calls past their reservation
+pthread_mutex_t bulk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void version_free(Version *v) {
+    if ((char*)v >= bulk_base && (char*)v < bulk_base + BULK_RESERVE) return;
+    free(v->value);
+    free(v);
+}
+
+static void base_log(const char *key, const char *val);
+
+// initial == NULL creates the key without a base version
 Key* create_key(const char *k, const char *initial) {
-    Key *key = &store[store_count++];
+    if (store_count - nfree + keys_reserved >= MAX_KEYS) return NULL;
+    Key *key = nfree ? &store[free_slots[--nfree]] : &store[store_count++];
     strncpy(key->name, k, MAX_KEYNAME-1);
     key->lock_owner = 0;
-    Version *v = malloc(sizeof(Version));
-    v->commit_ts = 0;
-    v->value = strdup(initial);
-    v->next = NULL;
-    key->versions = v;
+    key->lock_holders = NULL;
+    key->lock_waiters = NULL;
+    key->versions = NULL;
+    key->waiters = NULL;
+    if (initial) {
+        Version *v = malloc(sizeof(Version));
+        v->commit_ts = 0;
+        v->value = strdup(initial);
+        v->expires_ms = 0;
+        v->next = NULL;
+        key->versions = v;
+        memtable_bytes += sizeof(Version) + strlen(initial) + 1;
+        base_log(k, initial);
+    }
+    unsigned h = key_hash(key->name) % KEY_INDEX_SLOTS;
+    while (key_index[h]) h = (h+1) % KEY_INDEX_SLOTS;
+    key_index[h] = key - store + 1;
     return key;
 }
 
 Key* get_key(const char *k) {
-    for (int i=0;i<store_count;i++) {
-        if (strcmp(store[i].name, k)==0) return &store[i];
+    unsigned h = key_hash(k) % KEY_INDEX_SLOTS;
+    while (key_index[h]) {
+        Key *key = &store[key_index[h]-1];
+        if (strcmp(key->name, k)==0) return key;
+        h = (h+1) % KEY_INDEX_SLOTS;
     }
     return NULL;
 }
 
-void add_version(Key *k, commit_ts_t ts, const char *val) {
+// Drops k (which must have no versions or waiters) from the index and
+// recycles its slot. Linear probing, so later entries of the cluster are
+// shifted back into the hole.
+static void key_remove(Key *k) {
+    unsigned i = key_hash(k->name) % KEY_INDEX_SLOTS;
+    while (key_index[i] != k - store + 1) i = (i+1) % KEY_INDEX_SLOTS;
+    key_index[i] = 0;
+    for (unsigned j = (i+1) % KEY_INDEX_SLOTS; key_index[j]; j = (j+1) % KEY_INDEX_SLOTS) {
+        unsigned h = key_hash(store[key_index[j]-1].name) % KEY_INDEX_SLOTS;
+        if ((j > i && (h <= i || h > j)) || (j < i && h <= i && h > j)) {
+            key_index[i] = key_index[j];
+            key_index[j] = 0;
+            i = j;
+        }
+    }
+    k->name[0] = 0;
+    free_slots[nfree++] = k - store;
+}
+
+// Hashed timer wheel of versions with a TTL, one bucket per tick. An entry
+// names (store slot, commit_ts) rather than pointing at the Version, so GC
+// may free the version first; the reaper then finds nothing and drops it.
+// Entries whose expiry is more than a revolution away stay in their bucket.
+#define WHEEL_SLOTS 4096
+#define WHEEL_TICK_MS 10
+
+typedef struct TimerEntry {
+    int slot;
+    commit_ts_t ts;
+    int64_t expires_ms;
+    struct TimerEntry *next;
+} TimerEntry;
+
+TimerEntry *wheel[WHEEL_SLOTS];
+int64_t wheel_tick = 0;        // next tick the reaper processes
+long wheel_entries = 0;
+TimerEntry *timer_free_list;
+
+static void timer_add(int slot, commit_ts_t ts, int64_t expires_ms, int64_t tick) {
+    TimerEntry *e = timer_free_list;
+    if (!e) {                  // carve a batch; entries are recycled, never freed
+        TimerEntry *batch = malloc(4096*sizeof(TimerEntry));
+        for (int i=0;i<4096;i++) batch[i].next = i < 4095 ? &batch[i+1] : NULL;
+        e = batch;
+    }
+    timer_free_list = e->next;
+    if (!wheel_tick) wheel_tick = wall_ms()/WHEEL_TICK_MS;
+    if (tick < wheel_tick) tick = wheel_tick;
+    e->slot = slot;
+    e->ts = ts;
+    e->expires_ms = expires_ms;
+    e->next = wheel[tick % WHEEL_SLOTS];
+    wheel[tick % WHEEL_SLOTS] = e;
+    wheel_entries++;
+}
+
+static void timer_release(TimerEntry *e) {
+    e->next = timer_free_list;
+    timer_free_list = e;
+    wheel_entries--;
+}
+
+// Releases the waiters of k satisfied by a new version at ts. Callbacks run
+// here, under global_lock. Caller holds global_lock.
+static void watch_fire(Key *k, commit_ts_t ts) {
+    Waiter **pw = &k->waiters;
+    while (*pw) {
+        Waiter *w = *pw;
+        if (ts <= w->since_ts) { pw = &w->next; continue; }
+        *pw = w->next;
+        w->fired_ts = ts;
+        if (w->cb) {
+            w->cb(k->name, ts, w->arg);
+            free(w);
+        } else pthread_cond_signal(&w->cond);
+    }
+}
+
+// Cooperative GC: with inline_gc, writers and readers prune the chains they
+// touch. Everything behind the newest version at or below the watermark is
+// unreachable, so add_version looks a few steps down the chain for that
+// version and cuts behind it. mvcc_lookup cuts behind the version it
+// returns when that version is at or below the watermark. Both already
+// hold global_lock. They use the watermark of the last gc_watermark(),
+// which tx_install refreshes every INLINE_GC_REFRESH commits. It can lag,
+// but never passes a live snapshot: new snapshots start at the latest
+// commit.
+#define INLINE_GC_STEPS 8
+#define INLINE_GC_REFRESH 64
+
+int inline_gc = 0;
+commit_ts_t inline_gc_wm = 0;
+long inline_gc_freed = 0;
+
+// Frees the versions behind v. Caller holds global_lock.
+static void chain_cut(Version *v) {
+    Version *dead = v->next;
+    v->next = NULL;
+    while (dead) {
+        Version *next = dead->next;
+        memtable_bytes -= sizeof(Version) + strlen(dead->value) + 1;
+        version_free(dead);
+        inline_gc_freed++;
+        dead = next;
+    }
+}
+
+void add_version(Key *k, commit_ts_t ts, const char *val, int64_t expires_ms) {
     Version *v = malloc(sizeof(Version));
     v->commit_ts = ts;
     v->value = strdup(val);
+    v->expires_ms = expires_ms;
+    if (expires_ms) timer_add(k - store, ts, expires_ms, expires_ms/WHEEL_TICK_MS);
     v->next = k->versions;
     k->versions = v;
+    memtable_bytes += sizeof(Version) + strlen(val) + 1;
+    if (k->waiters) watch_fire(k, ts);
+    for (int i=0; inline_gc && v && i<INLINE_GC_STEPS; i++, v = v->next)
+        if (v->commit_ts <= inline_gc_wm) {
+            if (v->next) chain_cut(v);
+            break;
+        }
 }
 
-// ===== Transaction API =====
-Transaction* tx_begin() {
-    Transaction *tx = calloc(1,sizeof(Transaction));
-    pthread_mutex_lock(&global_lock);
-    tx->id = global_tx_seq++;
-    tx->start_ts = global_commit_ts; // snapshot timestamp
-    pthread_mutex_unlock(&global_lock);
-    tx->state = TX_ACTIVE;
-    printf("[TX %d] BEGIN (snapshot=%d)\n", tx->id, tx->start_ts);
-    return tx;
+int64_t snapshot_max_age_ms = 0;       // 0 = never expire, see Snapshot Age
+static void snapshot_expire(void);
+
+// Oldest snapshot still in use; older versions shadowed by a version at or
+// below it can never be read again. Snapshots past snapshot_max_age_ms are
+// expired first. Caller holds global_lock.
+commit_ts_t gc_watermark(void) {
+    if (snapshot_max_age_ms) snapshot_expire();
+    commit_ts_t wm = global_commit_ts;
+    for (int i=0;i<MAX_TRANSACTIONS;i++)
+        if (active_tx[i] && active_tx[i]->start_ts < wm) wm = active_tx[i]->start_ts;
+    inline_gc_wm = wm;
+    return wm;
 }
 
-void tx_read(Transaction *tx, const char *keyname) {
-    Key *k = get_key(keyname);
-    if (!k) { printf("[TX %d] READ %s -> NULL\n", tx->id,keyname); return; }
-    Version *v = k->versions;
-    while (v) {
-        if (v->commit_ts <= tx->start_ts) {
-            printf("[TX %d] READ %s -> %s (as of ts=%d)\n", tx->id, keyname, v->value, v->commit_ts);
+// ===== LSM Storage =====
+// The in-memory store doubles as the memtable. Commits are appended to a WAL
+// and, once the memtable is full, flushed into an L0 SSTable sorted by
+// (key asc, commit_ts desc); the store is then emptied. Each level >= 1 is a
+// single sorted run. Leveled compaction merges a level into the next one and
+// drops versions shadowed below the GC watermark. Reads check the memtable,
+// then L0 newest-first, then L1, L2, ...
+#define LSM_MAX_LEVELS 4
+#define LSM_MAX_L0 64
+#define LSM_L0_TRIGGER 4               // L0 tables that trigger an L0->L1 merge
+#define LSM_LEVEL_BASE (1L<<20)        // L1 target size, x10 per level
+#define LSM_BLOCK_SIZE 4096
+#define SST_LOAD_MIN_BLOCKS 256        // per thread when a table loads in parallel
+
+typedef struct SstBlock {
+    char first[MAX_KEYNAME];
+    char last[MAX_KEYNAME];
+    off_t off;                 // payload offset (after the length header)
+    uint32_t len;
+} SstBlock;
+
+// Bloom filter over 64-bit key hashes; bits == NULL means "may contain".
+typedef struct Bloom {
+    uint32_t nbits;
+    int k;
+    uint8_t *bits;
+} Bloom;
+
+typedef struct SSTable {
+    int id;
+    int fd;
+    off_t size;
+    long nversions;
+    int nblocks;
+    SstBlock *blocks;
+    Bloom filter;              // whole keys, for point reads
+    Bloom prefix_filter;       // first prefix_len bytes, for prefix scans
+    int prefix_len;
+} SSTable;
+
+typedef struct LsmStats {
+    long user_bytes;           // key+value bytes committed
+    long wal_bytes;
+    long flush_bytes;
+    long compact_bytes;
+    long flushes, compactions;
+    long dropped_versions;     // removed by compaction GC
+    long sst_versions;         // versions written to tables
+    long sst_ts_bytes;         // bytes their packed timestamps took
+    long replayed_records;     // WAL records applied by lsm_open
+    uint64_t replay_ns[3];     // WAL replay: read, decode, install
+    uint64_t table_load_ns;    // lsm_open: loading the tables in the manifest
+    long block_reads;          // SSTable blocks read from disk
+    long filter_skips;         // point probes answered by a filter, no I/O
+    long filter_false_pos;     // filter passed but the table lacked the key
+    long prefix_skips;         // tables skipped by a scan's prefix filter
+    long lookups;
+    uint64_t lookup_ns;
+} LsmStats;
+
+char lsm_dir[256];
+int lsm_enabled = 0;
+int lsm_sync = 0;                       // fdatasync the WAL on every commit
+int wal_defer_sync = 0;                 // async commit: the syncer thread syncs
+int lsm_recovery_threads = 1;           // WAL replay and table load threads, see Parallel Recovery
+long lsm_memtable_limit = 1L<<20;
+int lsm_bloom_bits = 10;                // bits per key, 0 disables the filters
+int lsm_prefix_len = 4;                 // key prefix covered by the prefix filter
+FILE *wal = NULL;
+commit_ts_t wal_base_ts = 0;            // every commit after this is in the WAL
+int lsm_next_id = 1;
+SSTable *levels[LSM_MAX_LEVELS][LSM_MAX_L0]; // L0: oldest..newest, L1+: one run
+int level_count[LSM_MAX_LEVELS];
+LsmStats lsm_stats;
+
+// Record: [u8 klen][key][ts delta][u16 vlen][value], and if vlen has
+// REC_TTL set, an [i64 expires_ms] after the value. The ts delta is a
+// zigzag varint against the previous record of the block (0 for the first),
+// so the versions of a key, which sit together, mostly take a byte or two
+// for their timestamps whatever their magnitude.
+#define REC_TTL 0x8000
+#define VARINT_MAX 10
+
+static char* put_varint(char *p, int64_t v) {
+    uint64_t u = (uint64_t)v << 1 ^ (uint64_t)(v >> 63);
+    while (u >= 0x80) { *p++ = (char)(u | 0x80); u >>= 7; }
+    *p++ = (char)u;
+    return p;
+}
+
+// NULL if the varint runs past end or over VARINT_MAX bytes.
+static const char* get_varint(const char *p, const char *end, int64_t *v) {
+    uint64_t u = 0;
+    for (int shift = 0; p < end && shift < 7*VARINT_MAX; shift += 7) {
+        uint8_t b = *p++;
+        u |= (uint64_t)(b & 0x7f) << shift;
+        if (b & 0x80) continue;
+        *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+        return p;
+    }
+    return NULL;
+}
+
+static char* put_rec(char *p, const char *key, commit_ts_t ts, commit_ts_t prev_ts, const char *val,
+                     uint16_t vlen, int64_t expires_ms) {
+    uint8_t kl = strlen(key);
+    uint16_t vf = vlen | (expires_ms ? REC_TTL : 0);
+    *p++ = kl; memcpy(p, key, kl); p += kl;
+    p = put_varint(p, ts - prev_ts);
+    memcpy(p, &vf, 2); p += 2;
+    memcpy(p, val, vlen); p += vlen;
+    if (expires_ms) { memcpy(p, &expires_ms, 8); p += 8; }
+    return p;
+}
+
+// *ts holds the previous record's timestamp on entry (0 at a block start).
+// Returns the next record, or NULL if this one does not fit before end.
+static const char* get_rec(const char *p, const char *end, char *key, commit_ts_t *ts, const char **val,
+                           uint16_t *vlen, int64_t *expires_ms) {
+    if (p >= end) return NULL;
+    uint8_t kl = *p++;
+    int64_t delta;
+    if (kl >= MAX_KEYNAME || end - p < kl) return NULL;
+    memcpy(key, p, kl); key[kl] = 0; p += kl;
+    if (!(p = get_varint(p, end, &delta)) || end - p < 2) return NULL;
+    *ts += delta;
+    memcpy(vlen, p, 2); p += 2;
+    *val = p;
+    *expires_ms = 0;
+    if (*vlen & REC_TTL) {
+        *vlen &= ~REC_TTL;
+        if (end - p < *vlen + 8) return NULL;
+        memcpy(expires_ms, p + *vlen, 8);
+        return p + *vlen + 8;
+    }
+    return end - p < *vlen ? NULL : p + *vlen;
+}
+
+static uint64_t hash64(const char *p, size_t n) {
+    uint64_t h = 14695981039346656037ull;  // FNV-1a
+    while (n--) { h ^= (unsigned char)*p++; h *= 1099511628211ull; }
+    return h ^ (h >> 29);
+}
+
+static void bloom_build(Bloom *f, const uint64_t *h, int n, int bits_per_key) {
+    memset(f, 0, sizeof *f);
+    if (bits_per_key <= 0 || !n) return;
+    f->nbits = n*bits_per_key < 64 ? 64 : n*bits_per_key;
+    f->k = bits_per_key*69/100;            // ~ln 2 * bits per key
+    if (f->k < 1) f->k = 1;
+    if (f->k > 30) f->k = 30;
+    f->bits = calloc((f->nbits+7)/8, 1);
+    for (int i=0;i<n;i++) {
+        uint32_t a = h[i], d = h[i] >> 32 | 1;
+        for (int j=0;j<f->k;j++, a += d) f->bits[(a % f->nbits)/8] |= 1 << (a % f->nbits % 8);
+    }
+}
+
+static int bloom_may_contain(const Bloom *f, uint64_t h) {
+    if (!f->bits) return 1;
+    uint32_t a = h, d = h >> 32 | 1;
+    for (int j=0;j<f->k;j++, a += d)
+        if (!(f->bits[(a % f->nbits)/8] & 1 << (a % f->nbits % 8))) return 0;
+    return 1;
+}
+
+static uint64_t prefix_hash(const char *key, int plen) {
+    size_t n = strlen(key);
+    return hash64(key, n < (size_t)plen ? n : (size_t)plen);
+}
+
+// Collects distinct key and prefix hashes while a table is written or loaded.
+typedef struct FilterBuilder {
+    uint64_t *keys, *prefixes;
+    int nkeys, nprefixes, cap;
+    char last[MAX_KEYNAME];
+} FilterBuilder;
+
+static void fb_add(FilterBuilder *fb, const char *key) {
+    int first = !fb->nkeys;
+    if (!first && strcmp(key, fb->last) == 0) return;
+    if (fb->nkeys == fb->cap) {
+        fb->cap = fb->cap ? fb->cap*2 : 256;
+        fb->keys = realloc(fb->keys, fb->cap*sizeof(uint64_t));
+        fb->prefixes = realloc(fb->prefixes, fb->cap*sizeof(uint64_t));
+    }
+    fb->keys[fb->nkeys++] = hash64(key, strlen(key));
+    if (first || strncmp(key, fb->last, lsm_prefix_len) != 0)
+        fb->prefixes[fb->nprefixes++] = prefix_hash(key, lsm_prefix_len);
+    strcpy(fb->last, key);
+}
+
+// Appends the hashes of more, a builder over later keys, and frees them.
+static void fb_merge(FilterBuilder *fb, FilterBuilder *more) {
+    if (fb->nkeys + more->nkeys > fb->cap) {
+        fb->cap = fb->nkeys + more->nkeys;
+        fb->keys = realloc(fb->keys, fb->cap*sizeof(uint64_t));
+        fb->prefixes = realloc(fb->prefixes, fb->cap*sizeof(uint64_t));
+    }
+    int skip = fb->nprefixes && more->nprefixes && fb->prefixes[fb->nprefixes-1] == more->prefixes[0];
+    if (more->nkeys) memcpy(fb->keys + fb->nkeys, more->keys, more->nkeys*sizeof(uint64_t));
+    if (more->nprefixes > skip)        // a prefix running across the seam counts once
+        memcpy(fb->prefixes + fb->nprefixes, more->prefixes + skip, (more->nprefixes - skip)*sizeof(uint64_t));
+    fb->nkeys += more->nkeys;
+    fb->nprefixes += more->nprefixes - skip;
+    free(more->keys);
+    free(more->prefixes);
+}
+
+static void fb_finish(FilterBuilder *fb, SSTable *t) {
+    bloom_build(&t->filter, fb->keys, fb->nkeys, lsm_bloom_bits);
+    bloom_build(&t->prefix_filter, fb->prefixes, fb->nprefixes, lsm_bloom_bits);
+    t->prefix_len = lsm_prefix_len;
+    free(fb->keys);
+    free(fb->prefixes);
+}
+
+// A table starts with SST_MAGIC and the LSM_FORMAT it was written in; the
+// MANIFEST starts with "manifest <LSM_FORMAT>". lsm_open refuses either
+// from another version rather than misread it. Format 2 packs the record
+// timestamps.
+#define LSM_FORMAT 2
+#define SST_MAGIC "mvccsst"
+#define SST_HDR_LEN (sizeof SST_MAGIC + 4)
+
+static void sst_path(char *buf, size_t n, int id) {
+    snprintf(buf, n, "%s/%06d.sst", lsm_dir, id);
+}
+
+// ===== Block Cache =====
+// Sharded S3-FIFO cache of SSTable blocks with a byte budget. New blocks
+// enter a small FIFO (10% of the shard); only blocks hit again while there
+// are promoted to the main FIFO, so a one-pass scan washes through the small
+// queue without displacing the hot set. Blocks evicted from the small queue
+// leave a ghost key behind; a miss on a ghost goes straight to main. Main
+// gives blocks with a nonzero access count another lap before evicting them.
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 4096
+
+typedef enum {CACHE_S3FIFO, CACHE_FIFO} cache_policy_t;
+
+typedef struct CacheEntry {
+    uint64_t key;              // table id << 32 | block number
+    char *data;                // NULL for a ghost
+    uint32_t len;
+    int freq;                  // accesses since insertion, capped at 3
+    struct CacheEntry *hnext;  // hash chain
+    struct CacheEntry *qnext;  // FIFO order
+} CacheEntry;
+
+typedef struct CacheQueue {
+    CacheEntry *head, *tail;   // pop at head, push at tail
+    long bytes;
+    long count;
+} CacheQueue;
+
+typedef struct CacheShard {
+    pthread_mutex_t lock;
+    CacheEntry *buckets[CACHE_BUCKETS];
+    CacheEntry *ghosts[CACHE_BUCKETS];
+    CacheQueue small, main, ghost;
+    long capacity;
+    long hits, misses, evictions;
+} CacheShard;
+
+CacheShard cache_shards[CACHE_SHARDS];
+long block_cache_capacity = 0;           // bytes, 0 = disabled
+cache_policy_t block_cache_policy = CACHE_S3FIFO;
+
+static void cq_push(CacheQueue *q, CacheEntry *e) {
+    e->qnext = NULL;
+    if (q->tail) q->tail->qnext = e; else q->head = e;
+    q->tail = e;
+    q->bytes += e->len;
+    q->count++;
+}
+
+static CacheEntry* cq_pop(CacheQueue *q) {
+    CacheEntry *e = q->head;
+    if (!e) return NULL;
+    q->head = e->qnext;
+    if (!q->head) q->tail = NULL;
+    q->bytes -= e->len;
+    q->count--;
+    return e;
+}
+
+static CacheEntry** cache_find(CacheEntry **buckets, uint64_t key) {
+    CacheEntry **p = &buckets[(key ^ key >> 29) * 0x9E3779B97F4A7C15ull >> 52];
+    while (*p && (*p)->key != key) p = &(*p)->hnext;
+    return p;
+}
+
+static void cache_evict_one(CacheShard *s) {
+    int from_small = block_cache_policy == CACHE_S3FIFO &&
+                     (s->small.bytes >= s->capacity/10 || !s->main.head);
+    if (from_small) {
+        CacheEntry *e = cq_pop(&s->small);
+        if (e->freq > 0) {                  // re-referenced: promote
+            e->freq = 0;
+            cq_push(&s->main, e);
             return;
         }
-        v = v->next;
+        *cache_find(s->buckets, e->key) = e->hnext;
+        free(e->data);
+        e->data = NULL;
+        e->len = 0;
+        e->hnext = NULL;
+        *cache_find(s->ghosts, e->key) = e;  // keep the key as a ghost
+        cq_push(&s->ghost, e);
+        while (s->ghost.count > s->main.count + s->small.count) {
+            CacheEntry *g = cq_pop(&s->ghost);
+            CacheEntry **gp = cache_find(s->ghosts, g->key);
+            if (*gp == g) *gp = g->hnext;
+            free(g);
+        }
+        s->evictions++;
+        return;
     }
-    printf("[TX %d] READ %s -> NULL\n", tx->id,keyname);
+    CacheEntry *e = cq_pop(&s->main);
+    if (block_cache_policy == CACHE_S3FIFO && e->freq > 0) {
+        e->freq--;
+        cq_push(&s->main, e);
+        return;
+    }
+    *cache_find(s->buckets, e->key) = e->hnext;
+    free(e->data);
+    free(e);
+    s->evictions++;
 }
 
-// Explicit versioned read
-void tx_read_versioned(const char *keyname, commit_ts_t ts) {
-    Key *k = get_key(keyname);
-    if (!k) { printf("[Versioned] %s at ts=%d -> NULL\n", keyname, ts); return; }
-    Version *v = k->versions;
-    while (v) {
-        if (v->commit_ts <= ts) {
-            printf("[Versioned] %s at ts=%d -> %s (commit_ts=%d)\n", keyname, ts, v->value, v->commit_ts);
-            return;
+static CacheShard* cache_shard(uint64_t key) {
+    return &cache_shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+}
+
+void block_cache_init(long capacity) {
+    block_cache_capacity = capacity;
+    for (int i=0;i<CACHE_SHARDS;i++) {
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+        cache_shards[i].capacity = capacity / CACHE_SHARDS;
+    }
+}
+
+static int block_cache_get(uint64_t key, char *buf) {
+    CacheShard *s = cache_shard(key);
+    pthread_mutex_lock(&s->lock);
+    CacheEntry *e = *cache_find(s->buckets, key);
+    if (e) {
+        if (e->freq < 3) e->freq++;
+        memcpy(buf, e->data, e->len);
+        s->hits++;
+    } else {
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return e != NULL;
+}
+
+static void block_cache_put(uint64_t key, const char *buf, uint32_t len) {
+    CacheShard *s = cache_shard(key);
+    if (len > s->capacity) return;
+    pthread_mutex_lock(&s->lock);
+    if (*cache_find(s->buckets, key)) {     // raced with another reader
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    CacheEntry **gp = cache_find(s->ghosts, key), *e;
+    int was_ghost = *gp != NULL;
+    if (was_ghost) {
+        CacheEntry *g = *gp;
+        *gp = g->hnext;
+        g->key = ~0ull;                    // reaped when it reaches the ghost head
+    }
+    e = calloc(1, sizeof(CacheEntry));
+    e->key = key;
+    e->len = len;
+    e->data = malloc(len);
+    memcpy(e->data, buf, len);
+    e->hnext = *cache_find(s->buckets, key);
+    *cache_find(s->buckets, key) = e;
+    if (was_ghost || block_cache_policy == CACHE_FIFO) cq_push(&s->main, e);
+    else cq_push(&s->small, e);
+    while (s->small.bytes + s->main.bytes > s->capacity) cache_evict_one(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void block_cache_clear(void) {
+    for (int i=0;i<CACHE_SHARDS;i++) {
+        CacheShard *s = &cache_shards[i];
+        CacheEntry *e;
+        pthread_mutex_lock(&s->lock);
+        while ((e = cq_pop(&s->small)) || (e = cq_pop(&s->main)) || (e = cq_pop(&s->ghost))) {
+            free(e->data);
+            free(e);
         }
-        v = v->next;
+        memset(s->buckets, 0, sizeof s->buckets);
+        memset(s->ghosts, 0, sizeof s->ghosts);
+        s->hits = s->misses = s->evictions = 0;
+        pthread_mutex_unlock(&s->lock);
     }
-    printf("[Versioned] %s at ts=%d -> NULL\n", keyname, ts);
 }
 
-void tx_write(Transaction *tx, const char *key, const char *val) {
-    strncpy(tx->write_set[tx->write_count].key,key,MAX_KEYNAME-1);
-    strncpy(tx->write_set[tx->write_count].value,val,127);
-    tx->write_count++;
-    printf("[TX %d] WRITE buffered %s=%s\n", tx->id, key,val);
+void block_cache_report(void) {
+    long hits = 0, misses = 0, ev = 0, bytes = 0;
+    for (int i=0;i<CACHE_SHARDS;i++) {
+        hits += cache_shards[i].hits;
+        misses += cache_shards[i].misses;
+        ev += cache_shards[i].evictions;
+        bytes += cache_shards[i].small.bytes + cache_shards[i].main.bytes;
+    }
+    printf("  block cache: %ld/%ld bytes, hits=%ld misses=%ld (%.1f%% hit), evictions=%ld\n",
+           bytes, block_cache_capacity, hits, misses,
+           hits+misses ? 100.0*hits/(hits+misses) : 0.0, ev);
 }
 
-void tx_commit(Transaction *tx) {
-    pthread_mutex_lock(&global_lock);
-    commit_ts_t new_ts = ++global_commit_ts;
-    for (int i=0;i<tx->write_count;i++) {
-        Key *k = get_key(tx->write_set[i].key);
-        if (!k) k = create_key(tx->write_set[i].key,"");
-        add_version(k,new_ts,tx->write_set[i].value);
-        printf("[TX %d] COMMIT %s=%s (ts=%d)\n", tx->id,
-               tx->write_set[i].key, tx->write_set[i].value,new_ts);
+// Compaction reads bypass the cache so merges do not churn it.
+static int sst_read_block_raw(SSTable *t, int b, char *buf) {
+    lsm_stats.block_reads++;
+    return pread(t->fd, buf, t->blocks[b].len, t->blocks[b].off) == (ssize_t)t->blocks[b].len;
+}
+
+static int sst_read_block(SSTable *t, int b, char *buf) {
+    uint64_t key = (uint64_t)t->id << 32 | (uint32_t)b;
+    if (block_cache_capacity && block_cache_get(key, buf)) return 1;
+    if (!sst_read_block_raw(t, b, buf)) return 0;
+    if (block_cache_capacity) block_cache_put(key, buf, t->blocks[b].len);
+    return 1;
+}
+
+typedef struct SstWriter {
+    FILE *f;
+    SSTable *t;
+    char *buf;
+    size_t len, cap;
+    int cap_blocks;
+    char first[MAX_KEYNAME];
+    char last[MAX_KEYNAME];
+    commit_ts_t prev_ts;       // of the block's last record
+    FilterBuilder fb;
+} SstWriter;
+
+static void sst_writer_open(SstWriter *w) {
+    char path[300];
+    memset(w, 0, sizeof *w);
+    w->t = calloc(1, sizeof(SSTable));
+    w->t->id = lsm_next_id++;
+    sst_path(path, sizeof path, w->t->id);
+    w->f = fopen(path, "wb");
+    uint32_t format = LSM_FORMAT;
+    fwrite(SST_MAGIC, sizeof SST_MAGIC, 1, w->f);
+    fwrite(&format, 4, 1, w->f);
+    w->t->size = SST_HDR_LEN;
+}
+
+static void sst_cut_block(SstWriter *w) {
+    if (!w->len) return;
+    SSTable *t = w->t;
+    if (t->nblocks == w->cap_blocks) {
+        w->cap_blocks = w->cap_blocks ? w->cap_blocks*2 : 16;
+        t->blocks = realloc(t->blocks, w->cap_blocks*sizeof(SstBlock));
     }
-    tx->state = TX_COMMITTED;
-    pthread_mutex_unlock(&global_lock);
+    uint32_t len = w->len;
+    fwrite(&len, 4, 1, w->f);
+    fwrite(w->buf, 1, len, w->f);
+    SstBlock *b = &t->blocks[t->nblocks++];
+    strcpy(b->first, w->first);
+    strcpy(b->last, w->last);
+    b->off = t->size + 4;
+    b->len = len;
+    t->size += 4 + len;
+    w->len = 0;
+    w->prev_ts = 0;
 }
 
-// Print all versions of a key
-void print_versions(const char *keyname) {
-    Key *k = get_key(keyname);
-    if (!k) return;
-    printf("Versions of %s:\n", keyname);
-    Version *v = k->versions;
-    while(v) {
-        printf("  ts=%d -> %s\n", v->commit_ts, v->value);
-        v = v->next;
+// Versions of one key never straddle a block boundary.
+static void sst_add(SstWriter *w, const char *key, commit_ts_t ts, const char *val, uint16_t vlen,
+                    int64_t expires_ms) {
+    if (w->len >= LSM_BLOCK_SIZE && strcmp(key, w->last) != 0) sst_cut_block(w);
+    size_t need = 1 + MAX_KEYNAME + VARINT_MAX + 2 + vlen + 8;
+    if (w->len + need > w->cap) {
+        w->cap = (w->len + need)*2;
+        w->buf = realloc(w->buf, w->cap);
+    }
+    if (!w->len) strcpy(w->first, key);
+    strcpy(w->last, key);
+    fb_add(&w->fb, key);
+    char *rec = w->buf + w->len;
+    w->len = put_rec(rec, key, ts, w->prev_ts, val, vlen, expires_ms) - w->buf;
+    lsm_stats.sst_ts_bytes += w->buf + w->len - rec - (1 + strlen(key) + 2 + vlen + (expires_ms ? 8 : 0));
+    lsm_stats.sst_versions++;
+    w->prev_ts = ts;
+    w->t->nversions++;
+}
+
+static SSTable* sst_finish(SstWriter *w) {
+    char path[300];
+    sst_cut_block(w);
+    fflush(w->f);
+    fdatasync(fileno(w->f));
+    fclose(w->f);
+    free(w->buf);
+    fb_finish(&w->fb, w->t);
+    sst_path(path, sizeof path, w->t->id);
+    if (!w->t->nversions) {
+        free(w->t->filter.bits);
+        free(w->t->prefix_filter.bits);
+        unlink(path);
+        free(w->t);
+        return NULL;
+    }
+    w->t->fd = open(path, O_RDONLY);
+    return w->t;
+}
+
+static void sst_free(SSTable *t, int remove);
+
+// One thread's share of sst_load: a run of blocks, decoded into its own
+// filter builder.
+typedef struct SstLoad {
+    SSTable *t;
+    const char *data;          // the whole file
+    int from, to;
+    FilterBuilder fb;
+    long nversions;
+    int bad;
+} SstLoad;
+
+static void* sst_load_blocks(void *arg) {
+    SstLoad *l = arg;
+    for (int i=l->from;i<l->to && !l->bad;i++) {
+        SstBlock *b = &l->t->blocks[i];
+        const char *p = l->data + b->off, *end = p + b->len, *val;
+        commit_ts_t ts = 0;
+        uint16_t vlen;
+        int64_t exp;
+        if (!get_rec(p, end, b->first, &ts, &val, &vlen, &exp)) l->bad = 1;
+        ts = 0;
+        while (!l->bad && p < end) {
+            if (!(p = get_rec(p, end, b->last, &ts, &val, &vlen, &exp))) l->bad = 1;
+            else fb_add(&l->fb, b->last), l->nversions++;
+        }
+    }
+    return NULL;
+}
+
+// Rebuilds the block index and filters of an existing table by scanning it.
+// NULL if the table is missing, from another format or damaged: every
+// record must decode within its block and the blocks must fill the file.
+// The file is read whole and its blocks found by hopping the length
+// headers; with nthreads > 1 large tables are then decoded by up to
+// nthreads threads, each taking a run of blocks. A key's versions never
+// straddle blocks, so the runs' filter hashes just concatenate.
+static SSTable* sst_load(int id, int nthreads) {
+    char path[300], hdr[SST_HDR_LEN], *data = NULL;
+    uint32_t format = 0, len;
+    struct stat st;
+    sst_path(path, sizeof path, id);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    int ok = fstat(fd, &st) == 0 && pread(fd, hdr, sizeof hdr, 0) == sizeof hdr &&
+             memcmp(hdr, SST_MAGIC, sizeof SST_MAGIC) == 0;
+    if (ok) memcpy(&format, hdr + sizeof SST_MAGIC, 4);
+    if (ok && format == LSM_FORMAT) {
+        data = malloc(st.st_size);
+        ok = pread(fd, data, st.st_size, 0) == st.st_size;
+    }
+    if (!ok || format != LSM_FORMAT) {
+        free(data);
+        close(fd);
+        return NULL;
+    }
+    SSTable *t = calloc(1, sizeof(SSTable));
+    t->id = id;
+    t->fd = fd;
+    t->size = SST_HDR_LEN;
+    int cap = 0, bad = 0;
+    while (t->size < st.st_size) {
+        if (st.st_size - t->size < 4) { bad = 1; break; }
+        memcpy(&len, data + t->size, 4);
+        if (!len || len > st.st_size - t->size - 4) { bad = 1; break; }
+        if (t->nblocks == cap) {
+            cap = cap ? cap*2 : 16;
+            t->blocks = realloc(t->blocks, cap*sizeof(SstBlock));
+        }
+        SstBlock *b = &t->blocks[t->nblocks++];
+        b->off = t->size + 4;
+        b->len = len;
+        t->size += 4 + len;
+    }
+    int n = t->nblocks/SST_LOAD_MIN_BLOCKS;
+    if (n > nthreads) n = nthreads;
+    if (n < 1) n = 1;
+    SstLoad *part = calloc(n, sizeof(SstLoad));
+    pthread_t *th = malloc(n*sizeof(pthread_t));
+    for (int i=0;i<n;i++) {
+        part[i] = (SstLoad){.t = t, .data = data, .from = (long)t->nblocks*i/n, .to = (long)t->nblocks*(i+1)/n};
+        if (i) pthread_create(&th[i], NULL, sst_load_blocks, &part[i]);
+    }
+    sst_load_blocks(&part[0]);
+    for (int i=1;i<n;i++) pthread_join(th[i], NULL);
+    for (int i=0;i<n;i++) {
+        if (i) fb_merge(&part[0].fb, &part[i].fb);
+        bad |= part[i].bad;
+        t->nversions += part[i].nversions;
+    }
+    fb_finish(&part[0].fb, t);
+    free(part);
+    free(th);
+    free(data);
+    if (bad) {
+        sst_free(t, 0);
+        return NULL;
+    }
+    return t;
+}
+
+static void sst_free(SSTable *t, int remove) {
+    char path[300];
+    close(t->fd);
+    if (remove) {
+        sst_path(path, sizeof path, t->id);
+        unlink(path);
+    }
+    free(t->blocks);
+    free(t->filter.bits);
+    free(t->prefix_filter.bits);
+    free(t);
+}
+
+// Newest version of key with commit_ts <= ts in this table. Expired versions
+// are returned too (with their expiry); they hide older ones.
+static int sst_get(SSTable *t, const char *key, commit_ts_t ts, char *out, size_t outlen,
+                   commit_ts_t *found_ts, int64_t *expires_ms) {
+    int lo = 0, hi = t->nblocks-1, b = -1;
+    while (lo <= hi) {
+        int mid = (lo+hi)/2;
+        if (strcmp(t->blocks[mid].first, key) <= 0) { b = mid; lo = mid+1; }
+        else hi = mid-1;
+    }
+    if (b < 0 || strcmp(key, t->blocks[b].last) > 0) return 0;
+    if (!bloom_may_contain(&t->filter, hash64(key, strlen(key)))) {
+        lsm_stats.filter_skips++;
+        return 0;
+    }
+    char *buf = malloc(t->blocks[b].len);
+    int found = 0, seen = 0;
+    if (sst_read_block(t, b, buf)) {
+        const char *p = buf, *end = buf + t->blocks[b].len, *val;
+        char rk[MAX_KEYNAME];
+        commit_ts_t rts = 0;
+        uint16_t vlen;
+        int64_t exp;
+        while (p < end && (p = get_rec(p, end, rk, &rts, &val, &vlen, &exp))) {
+            int c = strcmp(rk, key);
+            if (c > 0) break;
+            if (c == 0) seen = 1;
+            if (c == 0 && rts <= ts) {
+                size_t n = vlen < outlen-1 ? vlen : outlen-1;
+                memcpy(out, val, n);
+                out[n] = 0;
+                if (found_ts) *found_ts = rts;
+                if (expires_ms) *expires_ms = exp;
+                found = 1;
+                break;
+            }
+        }
+    }
+    free(buf);
+    if (!seen && t->filter.bits) lsm_stats.filter_false_pos++;
+    return found;
+}
+
+// Sequential cursor over all versions of a table, used by compaction.
+typedef struct SstIter {
+    SSTable *t;
+    int b;
+    char *buf;
+    const char *p, *end;
+    char key[MAX_KEYNAME];
+    commit_ts_t ts;
+    const char *val;
+    uint16_t vlen;
+    int64_t expires_ms;
+    int valid;
+    int corrupt;               // stopped at a block it could not read or decode
+} SstIter;
+
+static void sst_iter_next(SstIter *it) {
+    while (it->p == it->end) {
+        if (++it->b >= it->t->nblocks) { it->valid = 0; return; }
+        it->buf = realloc(it->buf, it->t->blocks[it->b].len);
+        if (!sst_read_block_raw(it->t, it->b, it->buf)) break;
+        it->p = it->buf;
+        it->end = it->buf + it->t->blocks[it->b].len;
+        it->ts = 0;
+    }
+    if (it->p == it->end || !(it->p = get_rec(it->p, it->end, it->key, &it->ts, &it->val, &it->vlen,
+                                              &it->expires_ms))) {
+        it->valid = 0;
+        it->corrupt = 1;
+        return;
+    }
+    it->valid = 1;
+}
+
+static void lsm_write_manifest(void) {
+    char path[300], tmp[310];
+    snprintf(path, sizeof path, "%s/MANIFEST", lsm_dir);
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    fprintf(f, "manifest %d\n%d %" PRId64 "\n", LSM_FORMAT, lsm_next_id, global_commit_ts);
+    for (int l=0;l<LSM_MAX_LEVELS;l++)
+        for (int i=0;i<level_count[l];i++)
+            fprintf(f, "%d %d\n", l, levels[l][i]->id);
+    fflush(f);
+    fdatasync(fileno(f));
+    fclose(f);
+    rename(tmp, path);
+}
+
+static long level_target(int l) {
+    long t = LSM_LEVEL_BASE;
+    while (--l > 0) t *= 10;
+    return t;
+}
+
+// Merges every table of `level` with the run in level+1. For each key all
+// versions newer than the watermark are kept, plus the single newest version
+// at or below it (the one the oldest snapshot reads); the rest are dropped.
+// If that version has expired and nothing older lies in deeper levels, it
+// is dropped as well.
+static void lsm_compact(int level) {
+    SSTable *in[LSM_MAX_L0+1];
+    int n = 0;
+    for (int i=0;i<level_count[level];i++) in[n++] = levels[level][i];
+    if (level_count[level+1]) in[n++] = levels[level+1][0];
+    SstIter it[LSM_MAX_L0+1];
+    memset(it, 0, sizeof it);
+    for (int i=0;i<n;i++) {
+        it[i].t = in[i];
+        it[i].b = -1;
+        sst_iter_next(&it[i]);
+    }
+
+    commit_ts_t wm = gc_watermark();
+    int64_t now = wall_ms();
+    int bottom = 1;
+    for (int l=level+2;l<LSM_MAX_LEVELS;l++) if (level_count[l]) bottom = 0;
+    SstWriter w;
+    sst_writer_open(&w);
+    char cur[MAX_KEYNAME] = "";
+    int kept_below = 0;
+    for (;;) {
+        int m = -1;
+        for (int i=0;i<n;i++) {
+            if (!it[i].valid) continue;
+            if (m < 0) { m = i; continue; }
+            int c = strcmp(it[i].key, it[m].key);
+            if (c < 0 || (c == 0 && it[i].ts > it[m].ts)) m = i;
+        }
+        if (m < 0) break;
+        if (strcmp(cur, it[m].key) != 0) {
+            strcpy(cur, it[m].key);
+            kept_below = 0;
+        }
+        int gone = bottom && it[m].expires_ms && it[m].expires_ms <= now;
+        if (it[m].ts > wm || (!kept_below && !gone)) {
+            if (it[m].ts <= wm) kept_below = 1;
+            sst_add(&w, it[m].key, it[m].ts, it[m].val, it[m].vlen, it[m].expires_ms);
+        } else {
+            if (it[m].ts <= wm) kept_below = 1;
+            lsm_stats.dropped_versions++;
+        }
+        sst_iter_next(&it[m]);
+    }
+    SSTable *out = sst_finish(&w);
+    for (int i=0;i<n;i++) {
+        free(it[i].buf);
+        if (!it[i].corrupt) continue;
+        // Going on would drop what follows the bad block; stop with the
+        // inputs still in the manifest, for lsm_open to refuse.
+        if (out) sst_free(out, 1);
+        printf("lsm: table %d is unreadable, stopping\n", in[i]->id);
+        exit(1);
+    }
+
+    level_count[level] = 0;
+    level_count[level+1] = 0;
+    if (out) {
+        levels[level+1][level_count[level+1]++] = out;
+        lsm_stats.compact_bytes += out->size;
+    }
+    lsm_stats.compactions++;
+    lsm_write_manifest();
+    for (int i=0;i<n;i++) sst_free(in[i], 1);
+
+    if (out && level+2 < LSM_MAX_LEVELS && out->size > level_target(level+1))
+        lsm_compact(level+1);
+}
+
+static void wal_open(const char *mode) {
+    char path[300];
+    snprintf(path, sizeof path, "%s/wal.log", lsm_dir);
+    wal = fopen(path, mode);
+}
+
+static void memtable_clear(void) {
+    Key *watched = NULL;       // keep watched and locked keys, versionless
+    int nwatched = 0;
+    for (int i=0;i<store_count;i++) {
+        if (store[i].waiters || store[i].lock_holders || store[i].lock_waiters) {
+            watched = realloc(watched, (nwatched+1)*sizeof(Key));
+            watched[nwatched++] = store[i];
+        }
+        Version *v = store[i].versions;
+        while (v) {
+            Version *next = v->next;
+            version_free(v);
+            v = next;
+        }
+    }
+    pthread_mutex_lock(&bulk_lock);
+    if (!bulk_building && bulk_used) {
+        madvise(bulk_base, bulk_used, MADV_DONTNEED);
+        bulk_used = 0;
     }
+    pthread_mutex_unlock(&bulk_lock);
+    memset(store, 0, store_count*sizeof(Key));
+    memset(key_index, 0, sizeof key_index);
+    store_count = 0;
+    nfree = 0;
+    memtable_bytes = 0;
+    for (int i=0;i<WHEEL_SLOTS;i++) {
+        while (wheel[i]) {
+            TimerEntry *e = wheel[i];
+            wheel[i] = e->next;
+            timer_release(e);
+        }
+    }
+    for (int i=0;i<nwatched;i++) {
+        Key *k = create_key(watched[i].name, NULL);
+        k->waiters = watched[i].waiters;
+        k->lock_owner = watched[i].lock_owner;
+        k->lock_holders = watched[i].lock_holders;
+        k->lock_waiters = watched[i].lock_waiters;
+    }
+    free(watched);
+}
+
+static int cmp_slot_name(const void *a, const void *b) {
+    return strcmp(store[*(const int*)a].name, store[*(const int*)b].name);
+}
+
+static void prepared_relog(void);
+
+// Writes the whole memtable to a new L0 table and empties the store.
+// Caller holds global_lock.
+void lsm_flush(void) {
+    if (!memtable_bytes) return;
+    int *order = malloc(store_count*sizeof(int));
+    for (int i=0;i<store_count;i++) order[i] = i;
+    qsort(order, store_count, sizeof(int), cmp_slot_name);
+    SstWriter w;
+    sst_writer_open(&w);
+    for (int i=0;i<store_count;i++) {
+        Key *k = &store[order[i]];
+        for (Version *v = k->versions; v; v = v->next)
+            sst_add(&w, k->name, v->commit_ts, v->value, strlen(v->value), v->expires_ms);
+    }
+    SSTable *t = sst_finish(&w);
+    free(order);
+    if (t) {
+        levels[0][level_count[0]++] = t;
+        lsm_stats.flush_bytes += t->size;
+    }
+    lsm_stats.flushes++;
+    lsm_write_manifest();
+
+    // The table is durable: the WAL and the memtable can go.
+    fclose(wal);
+    wal_open("wb");
+    wal_base_ts = global_commit_ts;
+    prepared_relog();
+    memtable_clear();
+
+    if (level_count[0] >= LSM_L0_TRIGGER) lsm_compact(0);
+}
+
+// Flushes the memtable if it is full or cannot take nkeys more keys.
+// Caller holds global_lock.
+static void lsm_make_room(int nkeys) {
+    if (lsm_enabled && (memtable_bytes >= lsm_memtable_limit || store_count - nfree + nkeys > MAX_KEYS))
+        lsm_flush();
+}
+
+// WAL record: [u32 body len][ts][u16 n] then n x [u8 klen][key][u16 vlen][value],
+// each followed by [i64 expires_ms] when vlen has REC_TTL set. A 2PC flag
+// in n puts a [u64 gtid] after it: WAL_PREPARED parks the writes (at the
+// proposal ts) until the decision, a WAL_DECIDED record that carries the
+// writes at the commit ts, or none for an abort.
+#define WAL_PREPARED 0x8000
+#define WAL_DECIDED 0x4000
+#define WAL_COUNT 0x3fff
+#define WAL_MAX_BODY (sizeof(commit_ts_t) + 2 + 8 + MAX_WRITESET*(1 + MAX_KEYNAME + 2 + 128 + 8))
+#define WAL_MAX_RECORD (4 + WAL_MAX_BODY)
+
+static size_t wal_encode_kv(const KVPair *w, int count, commit_ts_t ts, uint16_t flags, uint64_t gtid,
+                            char *buf) {
+    char *p = buf + 4;
+    uint16_t n = count | flags;
+    memcpy(p, &ts, sizeof ts); p += sizeof ts;
+    memcpy(p, &n, 2); p += 2;
+    if (flags) { memcpy(p, &gtid, 8); p += 8; }
+    for (int i=0;i<count;i++) {
+        uint8_t kl = strlen(w[i].key);
+        uint16_t vl = strlen(w[i].value);
+        int64_t exp = w[i].expires_ms;
+        uint16_t vf = vl | (exp ? REC_TTL : 0);
+        *p++ = kl; memcpy(p, w[i].key, kl); p += kl;
+        memcpy(p, &vf, 2); p += 2;
+        memcpy(p, w[i].value, vl); p += vl;
+        if (exp) { memcpy(p, &exp, 8); p += 8; }
+    }
+    uint32_t len = p - buf - 4;
+    memcpy(buf, &len, 4);
+    return p - buf;
+}
+
+static size_t wal_encode(Transaction *tx, commit_ts_t ts, char *buf) {
+    for (int i=0;i<tx->write_count;i++)
+        lsm_stats.user_bytes += strlen(tx->write_set[i].key) + strlen(tx->write_set[i].value);
+    return wal_encode_kv(tx->write_set, tx->write_count, ts, tx->state == TX_PREPARED ? WAL_DECIDED : 0,
+                         tx->gtid, buf);
+}
+
+static void wal_append(const char *rec, size_t n) {
+    fwrite(rec, 1, n, wal);
+    fflush(wal);
+    if (lsm_sync && !wal_defer_sync) fdatasync(fileno(wal));
+    lsm_stats.wal_bytes += n;
+}
+
+// Logs the prepare of tx (WAL_PREPARED) or its abort (WAL_DECIDED).
+static void wal_log_prepared(Transaction *tx, uint16_t flag) {
+    char rec[WAL_MAX_RECORD];
+    int n = flag == WAL_PREPARED ? tx->write_count : 0;
+    wal_append(rec, wal_encode_kv(tx->write_set, n, tx->prepare_ts, flag, tx->gtid, rec));
+}
+
+// A flush starts a new WAL: transactions still prepared are logged again.
+static void prepared_relog(void) {
+    for (int i=0;i<prepared_count;i++) wal_log_prepared(prepared[i], WAL_PREPARED);
+}
+
+// Recovery: parks the writes of a transaction prepared before the restart
+// until its decision is replayed or resent by the coordinator.
+static commit_ts_t prepared_restore(uint64_t gtid, commit_ts_t ts, const KVPair *w, int n) {
+    for (int i=0;i<prepared_count;i++)
+        if (prepared[i]->gtid == gtid) return ts;
+    if (prepared_count == MAX_PREPARED) return -1;
+    Transaction *tx = calloc(1, sizeof(Transaction));
+    tx->id = global_tx_seq++;
+    tx->slot = -1;
+    tx->state = TX_PREPARED;
+    tx->gtid = gtid;
+    tx->prepare_ts = ts;
+    memcpy(tx->write_set, w, n*sizeof(KVPair));
+    tx->write_count = n;
+    for (int i=0;i<n;i++) tx->reserved += !get_key(w[i].key);
+    keys_reserved += tx->reserved;
+    prepared[prepared_count++] = tx;
+    return ts;
 }
 
-int main() {
+// Recovery: the decision for gtid is in the log.
+static void prepared_forget(uint64_t gtid) {
+    for (int i=0;i<prepared_count;i++) {
+        if (prepared[i]->gtid != gtid) continue;
+        keys_reserved -= prepared[i]->reserved;
+        free(prepared[i]);
+        prepared[i] = prepared[--prepared_count];
+        return;
+    }
+}
+
+static int index_count;
+static void index_write(Key *k, const char *val, commit_ts_t ts, commit_ts_t wm);
+void ts_observe(commit_ts_t ts);
+
+// Installs the versions of one record body; returns its commit ts, or -1
+// with nothing installed if the store has no room for its new keys.
+// Caller holds global_lock (or is single-threaded recovery).
+// One write of a WAL body: [u8 klen][key][u16 vlen][value][i64 expires_ms].
+// Returns the byte after it, or NULL if it runs past end or a length is out
+// of range.
+static const char* wal_next_write(const char *p, const char *end) {
+    uint16_t vl;
+    if (p >= end) return NULL;
+    uint8_t kl = *p;
+    if (kl >= MAX_KEYNAME || end - p < 1 + kl + 2) return NULL;
+    memcpy(&vl, p + 1 + kl, 2);
+    size_t rest = (vl & ~REC_TTL) + (vl & REC_TTL ? 8 : 0);
+    p += 1 + kl + 2;
+    if ((vl & ~REC_TTL) >= 128 || (size_t)(end - p) < rest) return NULL;
+    return p + rest;
+}
+
+// Checks that a body of len bytes holds exactly the header and writes it
+// claims.
+static int wal_check(const char *body, uint32_t len) {
+    const char *p = body + sizeof(commit_ts_t) + 2, *end = body + len;
+    uint16_t n;
+    if (len < sizeof(commit_ts_t) + 2) return -1;
+    memcpy(&n, body + sizeof(commit_ts_t), 2);
+    if (n & ~WAL_COUNT) p += 8;
+    if ((n & WAL_COUNT) > MAX_WRITESET || p > end) return -1;
+    for (int i=0;i<(n & WAL_COUNT);i++)
+        if (!(p = wal_next_write(p, end))) return -1;
+    return p == end ? 0 : -1;
+}
+
+// Returns the commit ts, -1 if the writes do not fit the store, or -2 if
+// the body is malformed (nothing applied).
+static commit_ts_t wal_apply(const char *body, uint32_t len) {
+    const char *p = body;
+    commit_ts_t ts;
+    uint16_t n, flags;
+    uint64_t gtid = 0;
+    KVPair w[MAX_WRITESET];
+    int fresh = 0;
+    if (wal_check(body, len) < 0) return -2;
+    memcpy(&ts, p, sizeof ts); p += sizeof ts;
+    memcpy(&n, p, 2); p += 2;
+    flags = n & ~WAL_COUNT;
+    n &= WAL_COUNT;
+    if (flags) { memcpy(&gtid, p, 8); p += 8; }
+    ts_observe(ts);
+    for (int i=0;i<n;i++) {
+        uint8_t kl = *p++;
+        memcpy(w[i].key, p, kl); w[i].key[kl] = 0; p += kl;
+        uint16_t vl;
+        w[i].expires_ms = 0;
+        memcpy(&vl, p, 2); p += 2;
+        if (vl & REC_TTL) { vl &= ~REC_TTL; memcpy(&w[i].expires_ms, p + vl, 8); }
+        memcpy(w[i].value, p, vl); w[i].value[vl] = 0; p += vl + (w[i].expires_ms ? 8 : 0);
+    }
+    if (flags & WAL_PREPARED) return prepared_restore(gtid, ts, w, n);
+    if (flags & WAL_DECIDED) prepared_forget(gtid);
+    if (!n) return ts;
+    lsm_make_room(n);
+    for (int i=0;i<n;i++) fresh += !get_key(w[i].key);
+    if (store_count - nfree + keys_reserved + fresh > MAX_KEYS) return -1;
+    commit_ts_t wm = index_count ? gc_watermark() : 0;
+    for (int i=0;i<n;i++) {
+        Key *k = get_key(w[i].key);
+        if (k && !ts) continue;            // a base version only starts a chain; re-seeds resend it
+        if (!k) k = create_key(w[i].key, NULL);
+        if (index_count) index_write(k, w[i].value, ts, wm);
+        add_version(k, ts, w[i].value, w[i].expires_ms);
+    }
+    if (ts > global_commit_ts) global_commit_ts = ts;
+    return ts;
+}
+
+// ===== Parallel Recovery =====
+// With lsm_recovery_threads > 1 the WAL is replayed in three phases, each
+// run by every thread:
+//   1. read: thread i pread()s the i-th byte range of the log; the record
+//      boundaries are then found by hopping the length headers;
+//   2. decode: the records are cut into one run per thread, in log order;
+//      each thread decodes its run and buckets every write by key hash into
+//      one of nthreads shards;
+//   3. install: thread s builds the chains of shard s from the buckets of
+//      run 0, 1, ... in turn. A key lives in one shard only and the runs
+//      follow the log, so each chain gets its versions in commit order,
+//      exactly as serial replay would.
+// Keys are created without global_lock: store slots come from an atomic
+// bump of store_count and key_index entries are claimed with a CAS. Only
+// the shard owning a name ever inserts it, so a lookup miss can't race
+// another insert of the same key.
+typedef struct RecEntry {
+    const char *p;             // the write: [u8 klen][key][u16 vlen][value]...
+    commit_ts_t ts;
+    unsigned h;
+    long rec;                  // index of its record
+} RecEntry;
+
+typedef struct RecBucket {
+    RecEntry *e;
+    long n, cap;
+} RecBucket;
+
+typedef struct Recovery {
+    int fd, n;
+    char *buf;
+    off_t size;
+    long *rec;                 // body offsets, log order
+    long nrec;
+    RecBucket *buckets;        // [run*n + shard]
+} Recovery;
+
+typedef struct RecWorker {
+    Recovery *r;
+    int id;
+    commit_ts_t max_ts;
+    long bytes;                // memtable bytes installed
+    TimerEntry *ttl;           // expiring versions, for the wheel afterwards
+    long nttl, ttl_cap;
+    int bad;
+    int full;                  // a key found no store slot
+    long bad_rec;              // first malformed record in the run, or nrec
+} RecWorker;
+
+static void* rec_read(void *arg) {
+    RecWorker *w = arg;
+    Recovery *r = w->r;
+    off_t chunk = r->size / r->n, off = w->id*chunk;
+    off_t end = w->id == r->n-1 ? r->size : off + chunk;
+    while (off < end) {
+        ssize_t got = pread(r->fd, r->buf + off, end - off, off);
+        if (got <= 0) { w->bad = 1; break; }
+        off += got;
+    }
+    return NULL;
+}
+
+// Stops at the first malformed record; entries of that record and later
+// ones are not installed.
+static void* rec_decode(void *arg) {
+    RecWorker *w = arg;
+    Recovery *r = w->r;
+    char key[MAX_KEYNAME];
+    w->bad_rec = r->nrec;
+    for (long i = r->nrec*w->id/r->n; i < r->nrec*(w->id+1)/r->n; i++) {
+        const char *p = r->buf + r->rec[i];
+        uint32_t len;
+        commit_ts_t ts;
+        uint16_t cnt;
+        memcpy(&len, p - 4, 4);
+        if (wal_check(p, len) < 0) {
+            w->bad_rec = i;
+            break;
+        }
+        memcpy(&ts, p, sizeof ts); p += sizeof ts;
+        memcpy(&cnt, p, 2); p += 2;
+        for (int j=0;j<cnt;j++) {
+            uint8_t kl = *p;
+            memcpy(key, p+1, kl); key[kl] = 0;
+            unsigned h = key_hash(key);
+            RecBucket *b = &r->buckets[w->id*r->n + h % r->n];
+            if (b->n == b->cap) {
+                b->cap = b->cap ? 2*b->cap : 1024;
+                b->e = realloc(b->e, b->cap*sizeof(RecEntry));
+            }
+            b->e[b->n++] = (RecEntry){p, ts, h, i};
+            p = wal_next_write(p, r->buf + r->rec[i] + len);
+        }
+    }
+    return NULL;
+}
+
+// Finds or creates name without global_lock. Only the thread owning the
+// shard of h calls this for name.
+static Key* rec_key(const char *name, unsigned h) {
+    unsigned i = h % KEY_INDEX_SLOTS;
+    int s;
+    while ((s = __atomic_load_n(&key_index[i], __ATOMIC_ACQUIRE))) {
+        if (strcmp(store[s-1].name, name) == 0) return &store[s-1];
+        i = (i+1) % KEY_INDEX_SLOTS;
+    }
+    int slot = __atomic_fetch_add(&store_count, 1, __ATOMIC_RELAXED);
+    if (slot >= MAX_KEYS) return NULL;
+    Key *k = &store[slot];
+    memset(k, 0, sizeof *k);
+    snprintf(k->name, MAX_KEYNAME, "%s", name);
+    for (;; i = (i+1) % KEY_INDEX_SLOTS) {
+        int empty = 0;
+        if (__atomic_compare_exchange_n(&key_index[i], &empty, slot+1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return k;
+    }
+}
+
+// Every entry below r->nrec comes from a record rec_decode has checked.
+static void* rec_install(void *arg) {
+    RecWorker *w = arg;
+    Recovery *r = w->r;
+    char key[MAX_KEYNAME];
+    for (int run=0;run<r->n;run++) {
+        RecBucket *b = &r->buckets[run*r->n + w->id];
+        for (long i=0;i<b->n && b->e[i].rec < r->nrec;i++) {
+            const char *p = b->e[i].p;
+            uint8_t kl = *p++;
+            uint16_t vl;
+            int64_t exp = 0;
+            memcpy(key, p, kl); key[kl] = 0; p += kl;
+            memcpy(&vl, p, 2); p += 2;
+            if (vl & REC_TTL) { vl &= ~REC_TTL; memcpy(&exp, p + vl, 8); }
+            Key *k = rec_key(key, b->e[i].h);
+            if (!k) {
+                w->full = 1;
+                return NULL;
+            }
+            Version *v = malloc(sizeof(Version));
+            v->commit_ts = b->e[i].ts;
+            v->value = malloc(vl + 1);
+            memcpy(v->value, p, vl); v->value[vl] = 0;
+            v->expires_ms = exp;
+            v->next = k->versions;
+            k->versions = v;
+            w->bytes += sizeof(Version) + vl + 1;
+            if (v->commit_ts > w->max_ts) w->max_ts = v->commit_ts;
+            if (exp) {
+                if (w->nttl == w->ttl_cap) {
+                    w->ttl_cap = w->ttl_cap ? 2*w->ttl_cap : 256;
+                    w->ttl = realloc(w->ttl, w->ttl_cap*sizeof(TimerEntry));
+                }
+                w->ttl[w->nttl++] = (TimerEntry){k - store, v->commit_ts, exp, NULL};
+            }
+        }
+    }
+    return NULL;
+}
+
+static void rec_phase(RecWorker *w, int n, void *(*fn)(void*)) {
+    pthread_t th[n];
+    for (int i=1;i<n;i++) pthread_create(&th[i], NULL, fn, &w[i]);
+    fn(&w[0]);
+    for (int i=1;i<n;i++) pthread_join(th[i], NULL);
+}
+
+// Same result as the serial replay, including stopping at a torn tail and
+// failing when the store cannot hold every key (-2; anything else it cannot
+// do returns -1 before touching the store, for the serial replay to take
+// over). Secondary indexes span shards, recycled slots would need the free
+// list, and 2PC records need the prepared table, so those cases stay
+// serial. Single-threaded: nothing else runs during lsm_open.
+static int wal_replay_parallel(int n) {
+    Recovery r = {.fd = fileno(wal), .n = n};
+    struct stat st;
+    if (fstat(r.fd, &st) < 0) return -1;
+    r.size = st.st_size;
+    if (!r.size) return 0;
+    // Not malloc: a large request can first walk every chunk a previous
+    // memtable freed.
+    r.buf = mmap(NULL, r.size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (r.buf == MAP_FAILED) return -1;
+    RecWorker *w = calloc(n, sizeof(RecWorker));
+    for (int i=0;i<n;i++) w[i].r = &r, w[i].id = i;
+    uint64_t t0 = now_ns();
+    rec_phase(w, n, rec_read);
+    for (int i=0;i<n;i++) if (w[i].bad) { free(w); munmap(r.buf, r.size); return -1; }
+    long cap = 0;
+    int twopc = 0;
+    for (off_t off = 0; off + 4 <= r.size;) {
+        uint32_t len;
+        uint16_t cnt;
+        memcpy(&len, r.buf + off, 4);
+        if (len < sizeof(commit_ts_t) + 2 || len > WAL_MAX_BODY || off + 4 + len > r.size) break;
+        memcpy(&cnt, r.buf + off + 4 + sizeof(commit_ts_t), 2);
+        twopc |= cnt & ~WAL_COUNT;
+        if (r.nrec == cap) r.rec = realloc(r.rec, (cap = cap ? 2*cap : 4096)*sizeof(long));
+        r.rec[r.nrec++] = off + 4;
+        off += 4 + len;
+    }
+    if (twopc) {
+        free(r.rec);
+        free(w);
+        munmap(r.buf, r.size);
+        return -1;
+    }
+    uint64_t t1 = now_ns();
+    r.buckets = calloc(n*n, sizeof(RecBucket));
+    rec_phase(w, n, rec_decode);
+    for (int i=0;i<n;i++) if (w[i].bad_rec < r.nrec) r.nrec = w[i].bad_rec;
+    uint64_t t2 = now_ns();
+    rec_phase(w, n, rec_install);
+    if (store_count > MAX_KEYS) store_count = MAX_KEYS;
+    int full = 0;
+    for (int i=0;i<n;i++) {
+        full |= w[i].full;
+        if (w[i].max_ts > global_commit_ts) global_commit_ts = w[i].max_ts;
+        memtable_bytes += w[i].bytes;
+        for (long j=0;j<w[i].nttl;j++)
+            timer_add(w[i].ttl[j].slot, w[i].ttl[j].ts, w[i].ttl[j].expires_ms,
+                      w[i].ttl[j].expires_ms/WHEEL_TICK_MS);
+        free(w[i].ttl);
+    }
+    uint64_t t3 = now_ns();
+    lsm_stats.replay_ns[0] += t1 - t0;
+    lsm_stats.replay_ns[1] += t2 - t1;
+    lsm_stats.replay_ns[2] += t3 - t2;
+    lsm_stats.replayed_records += r.nrec;
+    for (int i=0;i<n*n;i++) free(r.buckets[i].e);
+    free(r.buckets);
+    free(r.rec);
+    munmap(r.buf, r.size);
+    free(w);
+    return full ? -2 : 0;
+}
+
+// Re-applies committed transactions logged since the last flush. A torn
+// record at the tail (crash mid-append) or a malformed one ends the replay. Returns -1 if a
+// committed write does not fit the store: the memtable cannot be flushed
+// while the WAL is still being read, and dropping the write would lose it.
+static int wal_replay(void) {
+    uint32_t len;
+    char body[WAL_MAX_BODY];
+    int rc = lsm_recovery_threads > 1 && !index_count && !nfree ? wal_replay_parallel(lsm_recovery_threads) : -1;
+    if (rc == 0) return 0;
+    if (rc == -2) {
+        printf("lsm: the WAL holds more than %d keys, recovery stopped\n", MAX_KEYS);
+        return -1;
+    }
+    uint64_t t0 = now_ns();
+    while (fread(&len, 4, 1, wal) == 1) {
+        if (len > sizeof body || fread(body, 1, len, wal) != len) break;
+        commit_ts_t rc = wal_apply(body, len);
+        if (rc == -2) break;               // damaged: stop here, like a torn tail
+        if (rc < 0) {
+            commit_ts_t ts;
+            memcpy(&ts, body, sizeof ts);
+            printf("lsm: no room for ts=%" PRId64 " (store or prepared table full), recovery stopped\n", ts);
+            return -1;
+        }
+        lsm_stats.replayed_records++;
+    }
+    lsm_stats.replay_ns[2] += now_ns() - t0;
+    return 0;
+}
+
+// Opens (or creates) a persistent engine in dir: loads the tables listed in
+// the manifest and replays the WAL into the memtable.
+int lsm_open(const char *dir) {
+    char path[300];
+    mkdir(dir, 0755);
+    memset(&lsm_stats, 0, sizeof lsm_stats);
+    snprintf(lsm_dir, sizeof lsm_dir, "%s", dir);
+    snprintf(path, sizeof path, "%s/MANIFEST", dir);
+    FILE *m = fopen(path, "r");
+    if (m) {
+        int l, id, format;
+        if (fscanf(m, "manifest %d", &format) != 1 || format != LSM_FORMAT) {
+            printf("lsm: %s is not format %d\n", path, LSM_FORMAT);
+            fclose(m);
+            return -1;
+        }
+        if (fscanf(m, "%d %" SCNd64, &lsm_next_id, &global_commit_ts) != 2) lsm_next_id = 1;
+        uint64_t t0 = now_ns();
+        while (fscanf(m, "%d %d", &l, &id) == 2) {
+            SSTable *t = l >= 0 && l < LSM_MAX_LEVELS && level_count[l] < LSM_MAX_L0 ?
+                         sst_load(id, lsm_recovery_threads) : NULL;
+            if (!t) {
+                printf("lsm: table %d is missing, damaged or not format %d\n", id, LSM_FORMAT);
+                fclose(m);
+                return -1;
+            }
+            levels[l][level_count[l]++] = t;
+        }
+        lsm_stats.table_load_ns = now_ns() - t0;
+        fclose(m);
+    }
+    wal_base_ts = global_commit_ts;
+    wal_open("rb");
+    if (wal) {
+        int rc = wal_replay();
+        fclose(wal);
+        wal = NULL;
+        if (rc < 0) return -1;
+    }
+    wal_open("ab");
+    if (!wal) return -1;
+    lsm_enabled = 1;
+    return 0;
+}
+
+// The memtable is dropped too: it is recoverable from the WAL.
+void lsm_close(void) {
+    if (!lsm_enabled) return;
+    fclose(wal);
+    wal = NULL;
+    memtable_clear();
+    block_cache_clear();        // table ids restart with the next directory
+    for (int l=0;l<LSM_MAX_LEVELS;l++) {
+        for (int i=0;i<level_count[l];i++) sst_free(levels[l][i], 0);
+        level_count[l] = 0;
+    }
+    lsm_enabled = 0;
+}
+
+// Tables from newest to oldest. Caller holds global_lock.
+static int lsm_get(const char *key, commit_ts_t ts, char *out, size_t outlen, commit_ts_t *found_ts,
+                   int64_t *expires_ms) {
+    for (int i=level_count[0]-1;i>=0;i--)
+        if (sst_get(levels[0][i], key, ts, out, outlen, found_ts, expires_ms)) return 1;
+    for (int l=1;l<LSM_MAX_LEVELS;l++)
+        if (level_count[l] && sst_get(levels[l][0], key, ts, out, outlen, found_ts, expires_ms)) return 1;
+    return 0;
+}
+
+void lsm_report(void) {
+    long disk = 0, nv = 0;
+    printf("=== LSM Stats ===\n");
+    for (int l=0;l<LSM_MAX_LEVELS;l++) {
+        long sz = 0;
+        for (int i=0;i<level_count[l];i++) {
+            sz += levels[l][i]->size;
+            nv += levels[l][i]->nversions;
+        }
+        printf("  L%d: %d tables, %ld bytes\n", l, level_count[l], sz);
+        disk += sz;
+    }
+    long written = lsm_stats.wal_bytes + lsm_stats.flush_bytes + lsm_stats.compact_bytes;
+    printf("  user bytes=%ld wal=%ld flush=%ld compaction=%ld\n", lsm_stats.user_bytes,
+           lsm_stats.wal_bytes, lsm_stats.flush_bytes, lsm_stats.compact_bytes);
+    printf("  write amplification: %.2f\n",
+           lsm_stats.user_bytes ? (double)written/lsm_stats.user_bytes : 0.0);
+    printf("  space: %ld bytes on disk, %ld versions, %ld dropped by GC, memtable %ld bytes\n",
+           disk, nv, lsm_stats.dropped_versions, memtable_bytes);
+    printf("  flushes=%ld compactions=%ld\n", lsm_stats.flushes, lsm_stats.compactions);
+    if (lsm_stats.lookups)
+        printf("  reads: %ld, avg %.2f us, %.2f block reads/lookup\n", lsm_stats.lookups,
+               lsm_stats.lookup_ns/1e3/lsm_stats.lookups,
+               (double)lsm_stats.block_reads/lsm_stats.lookups);
+    printf("  filters (%d bits/key): %ld probes skipped, %ld false positives, %ld scan skips\n",
+           lsm_bloom_bits, lsm_stats.filter_skips, lsm_stats.filter_false_pos,
+           lsm_stats.prefix_skips);
+    if (block_cache_capacity) block_cache_report();
+}
+
+// A prepared transaction other than self writing key (with prefix, any key
+// under it) whose commit a snapshot at ts could see. Caller holds
+// global_lock.
+static Transaction* prepared_writer(const char *key, int prefix, commit_ts_t ts, Transaction *self) {
+    size_t plen = strlen(key);
+    for (int i=0;i<prepared_count;i++) {
+        Transaction *p = prepared[i];
+        if (p == self || p->prepare_ts > ts) continue;
+        for (int j=0;j<p->write_count;j++)
+            if (prefix ? strncmp(p->write_set[j].key, key, plen) == 0 : strcmp(p->write_set[j].key, key) == 0)
+                return p;
+    }
+    return NULL;
+}
+
+int prepared_wait_ms = 5000;   // a read gives up on a 2PC decision after this
+
+// Waits until no prepared transaction writing key (prefix) is visible at
+// ts. Returns -1 with errno EBUSY once prepared_wait_ms passes. Caller holds
+// global_lock, which is dropped while waiting.
+static int prepared_wait(const char *key, int prefix, commit_ts_t ts) {
+    struct timespec until = {0, 0};
+    while (prepared_count && prepared_writer(key, prefix, ts, NULL)) {
+        if (!until.tv_sec) {
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += prepared_wait_ms/1000;
+            until.tv_nsec += prepared_wait_ms%1000*1000000L;
+            if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+        }
+        if (pthread_cond_timedwait(&prepared_cond, &global_lock, &until) == ETIMEDOUT &&
+            prepared_count && prepared_writer(key, prefix, ts, NULL)) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Waits until no prepared transaction is left, so that a local commit never
+// takes a ts at or past a proposal whose decision may still land there.
+// wait == 0 (event loop) fails at once. Returns -1 with errno EBUSY if one
+// is still undecided after prepared_wait_ms. Caller holds global_lock,
+// which is dropped while waiting.
+static int prepared_drain(int wait) {
+    struct timespec until = {0, 0};
+    while (prepared_count) {
+        if (!wait) { errno = EBUSY; return -1; }
+        if (!until.tv_sec) {
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += prepared_wait_ms/1000;
+            until.tv_nsec += prepared_wait_ms%1000*1000000L;
+            if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+        }
+        if (pthread_cond_timedwait(&prepared_cond, &global_lock, &until) == ETIMEDOUT && prepared_count) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Whether a read of key at ts would have to wait for a 2PC decision.
+int prepared_pending(const char *key, commit_ts_t ts) {
+    pthread_mutex_lock(&global_lock);
+    int pending = prepared_count && prepared_writer(key, 0, ts, NULL);
+    pthread_mutex_unlock(&global_lock);
+    return pending;
+}
+
+// Newest version of keyname visible at ts, from memory or disk: 1 found,
+// 0 absent, -1 (EBUSY) if a prepared transaction holds keyname too long.
+// An expired version reads as absent (expiry is judged by the clock, not
+// the snapshot). Caller holds global_lock, which is dropped while a
+// prepared transaction holds keyname.
+static int mvcc_lookup_locked(const char *keyname, commit_ts_t ts, char *out, size_t outlen,
+                              commit_ts_t *found_ts) {
+    int found = 0;
+    int64_t exp = 0;
+    uint64_t t0 = now_ns();
+    if (prepared_wait(keyname, 0, ts) < 0) return -1;
+    Key *k = get_key(keyname);
+    for (Version *v = k ? k->versions : NULL; v; v = v->next) {
+        if (v->commit_ts <= ts) {
+            snprintf(out, outlen, "%s", v->value);
+            *found_ts = v->commit_ts;
+            exp = v->expires_ms;
+            found = 1;
+            if (inline_gc && v->next && v->commit_ts <= inline_gc_wm) chain_cut(v);
+            break;
+        }
+    }
+    if (!found && lsm_enabled) found = lsm_get(keyname, ts, out, outlen, found_ts, &exp);
+    if (found && exp && exp <= wall_ms()) found = 0;
+    lsm_stats.lookups++;
+    lsm_stats.lookup_ns += now_ns() - t0;
+    return found;
+}
+
+int mvcc_lookup(const char *keyname, commit_ts_t ts, char *out, size_t outlen, commit_ts_t *found_ts) {
+    pthread_mutex_lock(&global_lock);
+    int found = mvcc_lookup_locked(keyname, ts, out, outlen, found_ts);
+    pthread_mutex_unlock(&global_lock);
+    return found;
+}
+
+typedef struct ScanHit {
+    char key[MAX_KEYNAME];
+    commit_ts_t ts;
+    char value[128];
+    int expired;               // hides older versions, then dropped
+} ScanHit;
+
+typedef struct ScanResult {
+    ScanHit *hits;
+    int n, cap;
+} ScanResult;
+
+static void scan_push(ScanResult *r, const char *key, commit_ts_t ts, const char *val, size_t vlen,
+                      int expired) {
+    if (r->n == r->cap) {
+        r->cap = r->cap ? r->cap*2 : 64;
+        r->hits = realloc(r->hits, r->cap*sizeof(ScanHit));
+    }
+    ScanHit *h = &r->hits[r->n++];
+    strcpy(h->key, key);
+    h->ts = ts;
+    if (vlen > 127) vlen = 127;
+    memcpy(h->value, val, vlen);
+    h->value[vlen] = 0;
+    h->expired = expired;
+}
+
+static int cmp_scan_hit(const void *a, const void *b) {
+    const ScanHit *x = a, *y = b;
+    int c = strcmp(x->key, y->key);
+    return c ? c : (x->ts < y->ts) - (x->ts > y->ts);
+}
+
+// Collects the candidate versions of a prefix scan; scan_finish picks the
+// winner per key. Caller holds global_lock.
+static void scan_collect(const char *prefix, commit_ts_t ts, ScanResult *r) {
+    size_t plen = strlen(prefix);
+    int64_t now = wall_ms();
+    for (int i=0;i<store_count;i++) {
+        if (strncmp(store[i].name, prefix, plen) != 0) continue;
+        for (Version *v = store[i].versions; v; v = v->next) {
+            if (v->commit_ts <= ts) {
+                scan_push(r, store[i].name, v->commit_ts, v->value, strlen(v->value), expired(v, now));
+                break;
+            }
+        }
+    }
+    for (int l=0;lsm_enabled && l<LSM_MAX_LEVELS;l++) {
+        for (int i=0;i<level_count[l];i++) {
+            SSTable *t = levels[l][i];
+            if (plen >= (size_t)t->prefix_len &&
+                !bloom_may_contain(&t->prefix_filter, prefix_hash(prefix, t->prefix_len))) {
+                lsm_stats.prefix_skips++;
+                continue;
+            }
+            char *buf = NULL, last[MAX_KEYNAME] = "";
+            for (int b=0;b<t->nblocks;b++) {
+                if (strncmp(t->blocks[b].last, prefix, plen) < 0) continue;
+                if (strncmp(t->blocks[b].first, prefix, plen) > 0) break;
+                buf = realloc(buf, t->blocks[b].len);
+                if (!sst_read_block(t, b, buf)) break;
+                const char *p = buf, *end = buf + t->blocks[b].len, *val;
+                char rk[MAX_KEYNAME];
+                commit_ts_t rts = 0;
+                uint16_t vlen;
+                int64_t exp;
+                while (p < end && (p = get_rec(p, end, rk, &rts, &val, &vlen, &exp))) {
+                    if (rts > ts || strncmp(rk, prefix, plen) != 0 || strcmp(rk, last) == 0) continue;
+                    scan_push(r, rk, rts, val, vlen, exp && exp <= now);
+                    strcpy(last, rk);
+                }
+            }
+            free(buf);
+        }
+    }
+}
+
+static int scan_finish(ScanResult *r) {
+    if (r->n) qsort(r->hits, r->n, sizeof(ScanHit), cmp_scan_hit);
+    int out = 0;
+    for (int i=0;i<r->n;i++) {
+        if (i && strcmp(r->hits[i-1].key, r->hits[i].key) == 0) continue;
+        if (!r->hits[i].expired) r->hits[out++] = r->hits[i];
+    }
+    r->n = out;
+    return out;
+}
+
+// Newest visible version of every key starting with prefix, in key order.
+// Tables whose prefix filter rules the prefix out are skipped without I/O.
+// -1 (EBUSY) with no hits if a prepared transaction holds the prefix too
+// long.
+int mvcc_scan(const char *prefix, commit_ts_t ts, ScanResult *r) {
+    memset(r, 0, sizeof *r);
+    pthread_mutex_lock(&global_lock);
+    if (prepared_wait(prefix, 1, ts) < 0) {
+        pthread_mutex_unlock(&global_lock);
+        return -1;
+    }
+    scan_collect(prefix, ts, r);
+    pthread_mutex_unlock(&global_lock);
+    return scan_finish(r);
+}
+
+// ===== Secondary Indexes =====
+// An index maps every value, through a user extractor, to zero or more index
+// keys. Each (index key, primary key) pair carries a chain of present/absent
+// markers stamped with the commit_ts of the write that added or removed it,
+// so a lookup at a snapshot agrees with base reads at that snapshot. Commits,
+// WAL replay and follower apply maintain the indexes under global_lock.
+// A posting's older markers are pruned against the GC watermark whenever it
+// is maintained again; postings that ended in an absence are dropped once
+// their index key's array fills.
+#define MAX_INDEXES 8
+#define MAX_INDEX_KEYS 8               // index keys a single value may map to
+#define INDEX_BUCKETS 16384
+
+// Fills out with NUL-terminated index keys for value; returns how many.
+typedef int (*index_extract_fn)(const char *value, char out[][MAX_KEYNAME], int max);
+
+typedef struct IndexVersion {
+    commit_ts_t commit_ts;
+    int present;               // 0 = the primary key left this index key
+    struct IndexVersion *next; // newer -> older
+} IndexVersion;
+
+// The newest marker is kept inline so that lookups scan a contiguous array
+// and only follow `older` for snapshots behind it.
+typedef struct IndexPosting {
+    char pkey[MAX_KEYNAME];
+    commit_ts_t ts;
+    int present;
+    IndexVersion *older;
+} IndexPosting;
+
+typedef struct IndexKey {
+    char ikey[MAX_KEYNAME];
+    IndexPosting *postings;    // unordered
+    int n, cap;
+    int *slot;                 // 2*cap, linear probing on pkey: posting + 1, 0 = empty
+    struct IndexKey *next;     // hash chain
+} IndexKey;
+
+typedef struct SecIndex {
+    char name[MAX_KEYNAME];
+    index_extract_fn extract;
+    IndexKey *buckets[INDEX_BUCKETS];
+    long entries;              // primary keys currently present
+} SecIndex;
+
+static int index_count = 0;
+SecIndex *indexes[MAX_INDEXES];
+
+static IndexKey* ix_key(SecIndex *ix, const char *ikey, int create) {
+    IndexKey **p = &ix->buckets[key_hash(ikey) % INDEX_BUCKETS];
+    while (*p && strcmp((*p)->ikey, ikey) != 0) p = &(*p)->next;
+    if (!*p && create) {
+        *p = calloc(1, sizeof(IndexKey));
+        snprintf((*p)->ikey, MAX_KEYNAME, "%s", ikey);
+    }
+    return *p;
+}
+
+static void ix_versions_free(IndexVersion *v) {
+    while (v) {
+        IndexVersion *next = v->next;
+        free(v);
+        v = next;
+    }
+}
+
+// Where pkey's posting is in ik->slot, or the empty slot it would take.
+static unsigned ix_slot(const IndexKey *ik, const char *pkey) {
+    unsigned m = 2*ik->cap - 1, i = key_hash(pkey) & m;
+    while (ik->slot[i] && strcmp(ik->postings[ik->slot[i]-1].pkey, pkey) != 0) i = (i+1) & m;
+    return i;
+}
+
+static int ix_find(const IndexKey *ik, const char *pkey) {
+    return ik->cap ? ik->slot[ix_slot(ik, pkey)] - 1 : -1;
+}
+
+// Drops posting i; the last posting moves into its place. Linear probing,
+// so later entries of the cluster are shifted back into the hole.
+static void ix_remove(IndexKey *ik, int i) {
+    unsigned m = 2*ik->cap - 1, h = ix_slot(ik, ik->postings[i].pkey);
+    ik->slot[h] = 0;
+    for (unsigned j = (h+1) & m; ik->slot[j]; j = (j+1) & m) {
+        unsigned k = key_hash(ik->postings[ik->slot[j]-1].pkey) & m;
+        if ((j > h && (k <= h || k > j)) || (j < h && k <= h && k > j)) {
+            ik->slot[h] = ik->slot[j];
+            ik->slot[j] = 0;
+            h = j;
+        }
+    }
+    ix_versions_free(ik->postings[i].older);
+    if (i != --ik->n) {
+        ik->slot[ix_slot(ik, ik->postings[ik->n].pkey)] = i + 1;
+        ik->postings[i] = ik->postings[ik->n];
+    }
+}
+
+// Makes room for one more posting. Postings whose newest marker is an
+// absence at or below wm go first; the array doubles only if that frees
+// less than half, so each sweep is paid for by as many inserts.
+static void ix_reserve(IndexKey *ik, commit_ts_t wm) {
+    if (ik->n < ik->cap) return;
+    for (int i=0;i<ik->n;) {
+        IndexPosting *q = &ik->postings[i];
+        if (!q->present && q->ts <= wm) ix_remove(ik, i);
+        else i++;
+    }
+    if (ik->n && ik->n <= ik->cap/2) return;
+    ik->cap = ik->cap ? ik->cap*2 : 8;
+    ik->postings = realloc(ik->postings, ik->cap*sizeof(IndexPosting));
+    free(ik->slot);
+    ik->slot = calloc(2*ik->cap, sizeof(int));
+    for (int i=0;i<ik->n;i++) ik->slot[ix_slot(ik, ik->postings[i].pkey)] = i + 1;
+}
+
+// Records that pkey entered (present) or left ikey at ts.
+static void ix_mark(SecIndex *ix, const char *ikey, const char *pkey, commit_ts_t ts, int present,
+                    commit_ts_t wm) {
+    IndexKey *ik = ix_key(ix, ikey, present);
+    if (!ik) return;
+    int found = ix_find(ik, pkey);
+    if (found < 0) {
+        if (!present) return;
+        ix_reserve(ik, wm);
+        ik->slot[ix_slot(ik, pkey)] = ik->n + 1;
+        IndexPosting *p = &ik->postings[ik->n++];
+        snprintf(p->pkey, MAX_KEYNAME, "%s", pkey);
+        p->ts = ts;
+        p->present = 1;
+        p->older = NULL;
+        ix->entries++;
+        return;
+    }
+    IndexPosting *p = &ik->postings[found];
+    IndexVersion *v = malloc(sizeof(IndexVersion));
+    v->commit_ts = p->ts;
+    v->present = p->present;
+    v->next = p->older;
+    p->older = v;
+    p->ts = ts;
+    p->present = present;
+    ix->entries += present ? 1 : -1;
+    while (v && v->commit_ts > wm) v = v->next;  // keep the newest at or below wm
+    if (v) {
+        ix_versions_free(v->next);
+        v->next = NULL;
+    }
+}
+
+static int ix_has(char keys[][MAX_KEYNAME], int n, const char *k) {
+    for (int i=0;i<n;i++) if (strcmp(keys[i], k) == 0) return 1;
+    return 0;
+}
+
+// Moves pkey from the index keys of old (NULL = absent) to those of val.
+static void ix_update(SecIndex *ix, const char *pkey, const char *old, const char *val, commit_ts_t ts,
+                      commit_ts_t wm) {
+    char o[MAX_INDEX_KEYS][MAX_KEYNAME], n[MAX_INDEX_KEYS][MAX_KEYNAME];
+    int no = old ? ix->extract(old, o, MAX_INDEX_KEYS) : 0;
+    int nn = val ? ix->extract(val, n, MAX_INDEX_KEYS) : 0;
+    for (int i=0;i<no;i++)
+        if (!ix_has(n, nn, o[i]) && !ix_has(o, i, o[i])) ix_mark(ix, o[i], pkey, ts, 0, wm);
+    for (int i=0;i<nn;i++)
+        if (!ix_has(o, no, n[i]) && !ix_has(n, i, n[i])) ix_mark(ix, n[i], pkey, ts, 1, wm);
+}
+
+// Indexes the write of val to k at ts, before it is installed: the value it
+// replaces is the newest one in memory or on disk, expired or not.
+// Caller holds global_lock.
+static void index_write(Key *k, const char *val, commit_ts_t ts, commit_ts_t wm) {
+    char old[128];
+    const char *prev = NULL;
+    if (k->versions) prev = k->versions->value;
+    else if (lsm_enabled && lsm_get(k->name, global_commit_ts, old, sizeof old, NULL, NULL)) prev = old;
+    for (int i=0;i<index_count;i++) ix_update(indexes[i], k->name, prev, val, ts, wm);
+}
+
+// The reaper removed pkey, whose last version (val) had expired, from the
+// store: no snapshot can read it any more, so its postings go entirely.
+// Caller holds global_lock.
+static void index_purge(const char *pkey, const char *val) {
+    char keys[MAX_INDEX_KEYS][MAX_KEYNAME];
+    for (int i=0;i<index_count;i++) {
+        SecIndex *ix = indexes[i];
+        int n = ix->extract(val, keys, MAX_INDEX_KEYS);
+        for (int j=0;j<n;j++) {
+            IndexKey *ik = ix_key(ix, keys[j], 0);
+            int k = ik ? ix_find(ik, pkey) : -1;
+            if (k < 0) continue;
+            if (ik->postings[k].present) ix->entries--;
+            ix_remove(ik, k);
+        }
+    }
+}
+
+// Creates an index over every committed key. Existing keys are indexed from
+// their newest version only, so lookups at older snapshots miss history from
+// before the index existed. Returns NULL once MAX_INDEXES exist.
+SecIndex* index_create(const char *name, index_extract_fn extract) {
+    ScanResult r;
+    memset(&r, 0, sizeof r);
+    pthread_mutex_lock(&global_lock);
+    if (index_count == MAX_INDEXES) {
+        pthread_mutex_unlock(&global_lock);
+        return NULL;
+    }
+    SecIndex *ix = calloc(1, sizeof(SecIndex));
+    snprintf(ix->name, sizeof ix->name, "%s", name);
+    ix->extract = extract;
+    scan_collect("", global_commit_ts, &r);
+    scan_finish(&r);
+    commit_ts_t wm = gc_watermark();
+    for (int i=0;i<r.n;i++) ix_update(ix, r.hits[i].key, NULL, r.hits[i].value, r.hits[i].ts, wm);
+    indexes[index_count++] = ix;
+    pthread_mutex_unlock(&global_lock);
+    free(r.hits);
+    return ix;
+}
+
+// Whether pkey's version at ts has not expired by now. Markers don't carry
+// TTLs (a rewrite that keeps the index keys files nothing), so this asks the
+// version itself. Caller holds global_lock.
+static int ix_live(const char *pkey, commit_ts_t ts, int64_t now) {
+    Key *k = get_key(pkey);
+    for (Version *v = k ? k->versions : NULL; v; v = v->next)
+        if (v->commit_ts <= ts) return !expired(v, now);
+    char val[128];
+    commit_ts_t found_ts;
+    int64_t exp = 0;
+    if (lsm_enabled && !lsm_get(pkey, ts, val, sizeof val, &found_ts, &exp)) return 0;
+    return !exp || exp > now;
+}
+
+// Primary keys filed under ikey at snapshot ts, in key order, less those
+// whose version at ts has expired; each hit's ts is the commit that filed it.
+int index_lookup(SecIndex *ix, const char *ikey, commit_ts_t ts, ScanResult *r) {
+    memset(r, 0, sizeof *r);
+    pthread_mutex_lock(&global_lock);
+    int64_t now = wall_ms();
+    IndexKey *ik = ix_key(ix, ikey, 0);
+    for (int i=0;ik && i<ik->n;i++) {
+        IndexPosting *p = &ik->postings[i];
+        commit_ts_t at = p->ts;
+        int present = p->present;
+        if (at > ts) {
+            IndexVersion *v = p->older;
+            while (v && v->commit_ts > ts) v = v->next;
+            if (!v) continue;
+            at = v->commit_ts;
+            present = v->present;
+        }
+        if (present && ix_live(p->pkey, ts, now)) scan_push(r, p->pkey, at, "", 0, 0);
+    }
+    pthread_mutex_unlock(&global_lock);
+    if (r->n) qsort(r->hits, r->n, sizeof(ScanHit), cmp_scan_hit);
+    return r->n;
+}
+
+// ===== Replication Log =====
+// Every commit is appended to an in-memory copy of the WAL stream, prefixed
+// with its commit time, from which sender threads ship to followers. Only
+// the window that some connected follower has not acknowledged yet is
+// kept: repl_base is the stream offset of repl_log[0]. A follower that
+// joins, or one cut off for falling REPL_MAX_BACKLOG behind, is seeded
+// from a fresh snapshot instead and then follows the log from its end.
+// Stream entry: [u64 commit time, CLOCK_MONOTONIC ns][WAL record]
+#define REPL_MAX_FOLLOWERS 16
+#define REPL_MAX_BACKLOG (64u<<20)     // unacknowledged bytes before a follower is cut off
+
+typedef struct ReplFollower {
+    int used;
+    int cut;                   // too far behind: the sender drops the connection
+    size_t acked;              // stream offset the follower has applied up to
+} ReplFollower;
+
+int repl_enabled = 0;
+char *repl_log;
+size_t repl_base, repl_len, repl_cap;
+ReplFollower repl_followers[REPL_MAX_FOLLOWERS];
+pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t repl_cond = PTHREAD_COND_INITIALIZER;
+_Atomic uint64_t repl_last_lag_ns;     // follower: commit-to-apply delay of the last entry
+
+// Drops the prefix every connected follower has applied, once it is at
+// least half the log so the copy is amortized. Caller holds repl_lock.
+static void repl_trim(void) {
+    size_t end = repl_base + repl_len, keep = end;
+    for (int i=0;i<REPL_MAX_FOLLOWERS;i++) {
+        ReplFollower *f = &repl_followers[i];
+        if (!f->used || f->cut) continue;
+        if (end - f->acked > REPL_MAX_BACKLOG) {
+            f->cut = 1;
+            pthread_cond_broadcast(&repl_cond);
+            continue;
+        }
+        if (f->acked < keep) keep = f->acked;
+    }
+    size_t drop = keep - repl_base;
+    if (!drop || drop < repl_len/2) return;
+    memmove(repl_log, repl_log + drop, repl_len - drop);
+    repl_len -= drop;
+    repl_base = keep;
+    if (repl_cap > (1u<<20) && repl_cap > 4*repl_len) {
+        repl_cap = 2*repl_len > (1u<<20) ? 2*repl_len : (1u<<20);
+        repl_log = realloc(repl_log, repl_cap);
+    }
+}
+
+static void repl_put(char **log, size_t *len, size_t *cap, const char *rec, size_t n) {
+    uint64_t t = now_ns();
+    if (*len + 8 + n > *cap) {
+        *cap = (*len + 8 + n)*2;
+        *log = realloc(*log, *cap);
+    }
+    memcpy(*log + *len, &t, 8);
+    memcpy(*log + *len + 8, rec, n);
+    *len += 8 + n;
+}
+
+// Called from tx_commit under global_lock, so entries are in commit_ts order.
+static void repl_append(const char *rec, size_t n) {
+    pthread_mutex_lock(&repl_lock);
+    repl_put(&repl_log, &repl_len, &repl_cap, rec, n);
+    repl_trim();
+    pthread_cond_broadcast(&repl_cond);
+    pthread_mutex_unlock(&repl_lock);
+}
+
+// Logs the base version create_key gives a new key, at ts 0, so that it
+// survives a restart and reaches followers.
+static void base_log(const char *key, const char *val) {
+    if (!lsm_enabled && !repl_enabled) return;
+    KVPair w = {.expires_ms = 0};
+    char rec[WAL_MAX_RECORD];
+    snprintf(w.key, sizeof w.key, "%s", key);
+    snprintf(w.value, sizeof w.value, "%s", val);
+    size_t n = wal_encode_kv(&w, 1, 0, 0, 0, rec);
+    if (lsm_enabled) wal_append(rec, n);
+    if (repl_enabled) repl_append(rec, n);
+}
+
+// ===== Change Data Capture =====
+// Subscribers receive every committed (key, value, commit_ts) in timestamp
+// order. tx_commit publishes into a bounded single-producer single-consumer
+// ring per subscriber while it still holds global_lock, which both fixes the
+// order and makes the committer the only producer. Backpressure happens
+// before that: tx_commit waits, without global_lock, while a ring is more
+// than three quarters full, so a slow subscriber slows the committers down
+// rather than losing events. Waiting under the lock would stall every
+// reader too, and deadlock a subscriber that calls into the engine, so the
+// wait is bounded by cdc_wait_ms. A subscriber that still has not drained
+// by then (or whose ring is too small for a commit, or is filled by commits
+// that do not wait: the event loop's and 2PC decisions) is overrun and
+// dropped when a commit cannot fit, and cdc_poll reports that once the ring
+// is drained. It can resubscribe from the last commit_ts it saw, since
+// commits are delivered whole. Subscribing from an older timestamp replays
+// the WAL tail first; it is copied at subscribe time so a flush cannot
+// truncate it under the reader.
+#define MAX_SUBSCRIBERS 16
+
+typedef struct CdcEvent {
+    char key[MAX_KEYNAME];
+    char value[128];
+    commit_ts_t commit_ts;
+} CdcEvent;
+
+typedef struct CdcSub {
+    CdcEvent *ring;
+    unsigned mask;             // capacity - 1, capacity a power of two
+    atomic_uint head;          // next slot to read (consumer)
+    atomic_uint tail;          // next slot to write (producer)
+    CdcEvent *backlog;         // WAL replay, drained before the ring
+    int nbacklog, backlog_pos;
+    atomic_int overrun;        // dropped by a commit it had no room for
+} CdcSub;
+
+#define CDC_WAIT_US 50        // poll interval of a commit waiting for room
+
+CdcSub *cdc_subs[MAX_SUBSCRIBERS];
+atomic_int cdc_count = 0;      // written under global_lock
+long cdc_overruns = 0;
+int cdc_wait_ms = 100;         // longest a commit waits for a subscriber
+long cdc_stalls = 0;           // commits that waited
+uint64_t cdc_stall_ns = 0;
+
+// Backpressure for a commit of n writes: waits while some subscriber's ring
+// is more than three quarters full or cannot take n more events, up to
+// cdc_wait_ms. Takes global_lock only while it looks at the rings.
+static void cdc_throttle(int n) {
+    uint64_t t0 = 0;
+    if (!atomic_load_explicit(&cdc_count, memory_order_relaxed)) return;
+    for (;;) {
+        int busy = 0;
+        pthread_mutex_lock(&global_lock);
+        for (int i=0;i<MAX_SUBSCRIBERS && !busy;i++) {
+            CdcSub *s = cdc_subs[i];
+            if (!s) continue;
+            unsigned used = atomic_load_explicit(&s->tail, memory_order_relaxed) -
+                            atomic_load_explicit(&s->head, memory_order_acquire);
+            busy = s->mask + 1 - used < n + (s->mask + 1)/4;
+        }
+        uint64_t now = busy || t0 ? now_ns() : 0;
+        int done = !busy || (t0 && now - t0 >= cdc_wait_ms*1000000ull);
+        if (done && t0) {
+            cdc_stalls++;
+            cdc_stall_ns += now - t0;
+        }
+        pthread_mutex_unlock(&global_lock);
+        if (done) return;
+        if (!t0) t0 = now;
+        usleep(CDC_WAIT_US);
+    }
+}
+
+// Drops the subscribers whose ring cannot take n more events, so that a
+// commit of n writes reaches each subscriber whole. cdc_throttle makes this
+// the exception. Caller holds global_lock.
+static void cdc_reserve(int n) {
+    for (int i=0;i<MAX_SUBSCRIBERS;i++) {
+        CdcSub *s = cdc_subs[i];
+        if (!s) continue;
+        unsigned t = atomic_load_explicit(&s->tail, memory_order_relaxed);
+        if (t - atomic_load_explicit(&s->head, memory_order_acquire) + n <= s->mask + 1) continue;
+        cdc_subs[i] = NULL;
+        cdc_count--;
+        cdc_overruns++;
+        atomic_store(&s->overrun, 1);
+    }
+}
+
+// After cdc_reserve. Caller holds global_lock.
+static void cdc_publish(const char *key, const char *val, commit_ts_t ts) {
+    for (int i=0;i<MAX_SUBSCRIBERS;i++) {
+        CdcSub *s = cdc_subs[i];
+        if (!s) continue;
+        unsigned t = atomic_load_explicit(&s->tail, memory_order_relaxed);
+        CdcEvent *e = &s->ring[t & s->mask];
+        snprintf(e->key, sizeof e->key, "%s", key);
+        snprintf(e->value, sizeof e->value, "%s", val);
+        e->commit_ts = ts;
+        atomic_store_explicit(&s->tail, t+1, memory_order_release);
+    }
+}
+
+// Delivers commits with commit_ts > from_ts. Returns NULL if that history is
+// no longer in the WAL (or there is no WAL) or all subscriber slots are taken.
+CdcSub* cdc_subscribe(commit_ts_t from_ts, unsigned capacity) {
+    unsigned cap = 64;
+    while (cap < capacity) cap <<= 1;
+    CdcSub *s = calloc(1, sizeof(CdcSub));
+    s->ring = malloc(cap*sizeof(CdcEvent));
+    s->mask = cap - 1;
+    pthread_mutex_lock(&global_lock);
+    int slot = -1;
+    for (int i=0;i<MAX_SUBSCRIBERS && slot < 0;i++) if (!cdc_subs[i]) slot = i;
+    int ok = slot >= 0 && (from_ts >= global_commit_ts || (lsm_enabled && from_ts >= wal_base_ts));
+    if (ok && from_ts < global_commit_ts) {
+        char path[300], body[WAL_MAX_BODY];
+        uint32_t len;
+        int cap_events = 0;
+        fflush(wal);
+        snprintf(path, sizeof path, "%s/wal.log", lsm_dir);
+        FILE *f = fopen(path, "rb");
+        while (f && fread(&len, 4, 1, f) == 1 && len <= sizeof body && fread(body, 1, len, f) == len) {
+            const char *p = body;
+            commit_ts_t ts;
+            uint16_t n;
+            memcpy(&ts, p, sizeof ts); p += sizeof ts;
+            memcpy(&n, p, 2); p += 2;
+            if (n & WAL_PREPARED) continue;        // not committed (yet)
+            if (n & WAL_DECIDED) p += 8;
+            n &= WAL_COUNT;
+            for (int i=0;i<n;i++) {
+                uint8_t kl = *p++;
+                const char *k = p;
+                p += kl;
+                uint16_t vl;
+                memcpy(&vl, p, 2); p += 2;
+                int ttl = vl & REC_TTL;
+                vl &= ~REC_TTL;
+                if (ts > from_ts) {
+                    if (s->nbacklog == cap_events) {
+                        cap_events = cap_events ? cap_events*2 : 256;
+                        s->backlog = realloc(s->backlog, cap_events*sizeof(CdcEvent));
+                    }
+                    CdcEvent *e = &s->backlog[s->nbacklog++];
+                    snprintf(e->key, sizeof e->key, "%.*s", kl, k);
+                    snprintf(e->value, sizeof e->value, "%.*s", vl, p);
+                    e->commit_ts = ts;
+                }
+                p += vl + (ttl ? 8 : 0);
+            }
+        }
+        if (f) fclose(f);
+    }
+    if (ok) {
+        cdc_subs[slot] = s;
+        cdc_count++;
+    }
+    pthread_mutex_unlock(&global_lock);
+    if (!ok) {
+        free(s->ring);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+// Non-blocking: 1 with the next event in ev, 0 if none is pending, -1 once
+// the subscriber was overrun and everything before that is delivered.
+int cdc_poll(CdcSub *s, CdcEvent *ev) {
+    if (s->backlog_pos < s->nbacklog) {
+        *ev = s->backlog[s->backlog_pos++];
+        return 1;
+    }
+    unsigned h = atomic_load_explicit(&s->head, memory_order_relaxed);
+    int overrun = atomic_load(&s->overrun);   // before tail: no event after it is lost
+    if (h == atomic_load_explicit(&s->tail, memory_order_acquire)) return overrun ? -1 : 0;
+    *ev = s->ring[h & s->mask];
+    atomic_store_explicit(&s->head, h+1, memory_order_release);
+    return 1;
+}
+
+void cdc_unsubscribe(CdcSub *s) {
+    pthread_mutex_lock(&global_lock);
+    for (int i=0;i<MAX_SUBSCRIBERS;i++) {
+        if (cdc_subs[i] == s) {
+            cdc_subs[i] = NULL;
+            cdc_count--;
+        }
+    }
+    pthread_mutex_unlock(&global_lock);
+    free(s->ring);
+    free(s->backlog);
+    free(s);
+}
+
+// ===== Expiry Reaper =====
+// Readers stop seeing a version the moment it expires; the reaper frees it.
+// Each due wheel entry garbage-collects its key's chain against the snapshot
+// watermark, so reaping also prunes the versions that piled up behind it.
+// Without LSM a key left empty leaves the store. With LSM the expired
+// version has to stay (flushed with its expiry) to hide older data on disk
+// until compaction reaches the bottom level.
+#define REAPER_BATCH 1024      // entries per global_lock hold
+#define REAPER_RETRY_TICKS 100 // recheck of an entry pinned by a snapshot
+
+typedef struct ReaperStats {
+    long entries;              // due wheel entries handled
+    long requeued;             // an older snapshot still needed it
+    long versions_freed, keys_removed;
+    uint64_t busy_ns, max_hold_ns;
+} ReaperStats;
+
+ReaperStats reaper_stats;
+atomic_int reaper_running = 0;
+pthread_t reaper_thread;
+
+// Keeps the versions newer than wm plus the newest at or below it, and drops
+// that one too if it has expired and nothing on disk can be behind it.
+// Returns whether the version at ts survived. Caller holds global_lock.
+static int key_gc(Key *k, commit_ts_t wm, int64_t now, commit_ts_t ts) {
+    Version **pv = &k->versions;
+    while (*pv && (*pv)->commit_ts > wm) pv = &(*pv)->next;
+    Version *v = NULL;
+    if (*pv) {
+        v = (*pv)->next;
+        (*pv)->next = NULL;
+        if (!lsm_enabled && expired(*pv, now)) {
+            if (index_count && pv == &k->versions) index_purge(k->name, (*pv)->value);
+            (*pv)->next = v;
+            v = *pv;
+            *pv = NULL;
+        }
+    }
+    while (v) {
+        Version *next = v->next;
+        memtable_bytes -= sizeof(Version) + strlen(v->value) + 1;
+        version_free(v);
+        reaper_stats.versions_freed++;
+        v = next;
+    }
+    if (!k->versions && !k->waiters && !k->lock_holders && !k->lock_waiters && !lsm_enabled) {
+        key_remove(k);
+        reaper_stats.keys_removed++;
+        return 0;
+    }
+    for (v = k->versions; v; v = v->next)
+        if (v->commit_ts == ts) return 1;
+    return 0;
+}
+
+// Handles due entries of the buckets of past ticks (a bucket is only
+// complete once its tick is over), at most budget of them. Returns how many.
+// Caller holds global_lock.
+static long reaper_tick(long budget) {
+    int64_t now = wall_ms(), now_tick = now/WHEEL_TICK_MS;
+    commit_ts_t wm = gc_watermark();
+    TimerEntry *retry = NULL;
+    long done = 0;
+    if (!wheel_tick) return 0;
+    if (now_tick - wheel_tick > WHEEL_SLOTS) wheel_tick = now_tick - WHEEL_SLOTS;
+    while (wheel_tick < now_tick && done < budget) {
+        TimerEntry **pe = &wheel[wheel_tick % WHEEL_SLOTS];
+        while (*pe && done < budget) {
+            TimerEntry *e = *pe;
+            if (e->expires_ms > now) { pe = &e->next; continue; }  // a later revolution
+            *pe = e->next;
+            done++;
+            Key *k = &store[e->slot];
+            int live = e->slot < store_count && k->name[0] && key_gc(k, wm, now, e->ts);
+            if (live && e->ts > wm) {
+                e->next = retry;
+                retry = e;
+                reaper_stats.requeued++;
+            } else {
+                timer_release(e);
+            }
+        }
+        if (*pe) break;
+        wheel_tick++;
+    }
+    while (retry) {            // recycled straight back into a later bucket
+        TimerEntry *e = retry;
+        retry = e->next;
+        timer_release(e);
+        timer_add(e->slot, e->ts, e->expires_ms, now_tick + REAPER_RETRY_TICKS);
+    }
+    reaper_stats.entries += done;
+    return done;
+}
+
+static void* reaper_main(void *arg) {
+    (void)arg;
+    while (atomic_load(&reaper_running)) {
+        pthread_mutex_lock(&global_lock);
+        uint64_t t0 = now_ns();
+        long n = reaper_tick(REAPER_BATCH);
+        uint64_t dt = now_ns() - t0;
+        reaper_stats.busy_ns += dt;
+        if (dt > reaper_stats.max_hold_ns) reaper_stats.max_hold_ns = dt;
+        pthread_mutex_unlock(&global_lock);
+        if (n < REAPER_BATCH) usleep(WHEEL_TICK_MS*1000);
+    }
+    return NULL;
+}
+
+void reaper_start(void) {
+    if (atomic_exchange(&reaper_running, 1)) return;
+    pthread_create(&reaper_thread, NULL, reaper_main, NULL);
+}
+
+void reaper_stop(void) {
+    if (!atomic_exchange(&reaper_running, 0)) return;
+    pthread_join(reaper_thread, NULL);
+}
+
+// ===== Predicate Validation =====
+// A scan reads a whole prefix, so a key committed into it after the snapshot
+// is a phantom that the point checks cannot see. Committed writes are
+// recorded in a ring; a writing transaction that scanned is validated by
+// matching the keys committed after its snapshot against its prefixes.
+// If the ring no longer reaches back to the snapshot, it aborts.
+#define PRED_LOG 65536                 // committed writes kept for validation
+
+typedef struct PredEntry {
+    commit_ts_t ts;
+    char key[MAX_KEYNAME];
+} PredEntry;
+
+PredEntry pred_log[PRED_LOG];
+long pred_len = 0;                     // writes ever logged
+int scan_validation = 1;               // 0 = scans are plain snapshot reads
+long phantom_aborts = 0;
+
+// Caller holds global_lock.
+static void pred_log_add(const char *key, commit_ts_t ts) {
+    PredEntry *e = &pred_log[pred_len++ % PRED_LOG];
+    e->ts = ts;
+    memcpy(e->key, key, MAX_KEYNAME);
+}
+
+// Returns the prefix a phantom was committed into, or NULL. Caller holds
+// global_lock.
+static const char* pred_conflict(Transaction *tx) {
+    for (long i=pred_len-1;i>=0;i--) {
+        PredEntry *e = &pred_log[i % PRED_LOG];
+        if (pred_len - i > PRED_LOG) return "(history)";
+        if (e->ts <= tx->start_ts) return NULL;
+        for (int j=0;j<tx->scan_count;j++)
+            if (strncmp(e->key, tx->scan_set[j], strlen(tx->scan_set[j])) == 0) return tx->scan_set[j];
+    }
+    return NULL;
+}
+
+// Remembers a scanned prefix; a full set degrades to the empty prefix.
+static void pred_add(Transaction *tx, const char *prefix) {
+    for (int i=0;i<tx->scan_count;i++)
+        if (strncmp(prefix, tx->scan_set[i], strlen(tx->scan_set[i])) == 0) return;
+    if (tx->scan_count == MAX_SCANSET) {
+        tx->scan_set[0][0] = 0;
+        tx->scan_count = 1;
+        return;
+    }
+    strncpy(tx->scan_set[tx->scan_count++], prefix, MAX_KEYNAME-1);
+}
+
+// ===== Admission Control =====
+// Once admit_limit transactions are running, tx_begin waits up to
+// admit_wait_ms for one to finish and then refuses: it returns NULL with
+// errno EBUSY. Each running transaction pins a snapshot, so letting them
+// pile up also stalls GC. tx_try_begin refuses without waiting; the server
+// uses it, since the transactions holding the slots belong to connections
+// on its own event loop and could not finish while it waited.
+// With admit_adaptive, the limit hill-climbs on goodput. After every
+// ADMIT_WINDOW transactions finish, it takes a step of an eighth in the
+// same direction if the window committed faster than the one before, and
+// reverses otherwise. It always steps down if more than admit_max_abort of
+// the window aborted, or if the mean begin-to-end latency was over twice
+// the best recent window.
+#define ADMIT_WINDOW 256
+#define ADMIT_MIN 2
+
+int admit_limit = 0;                   // 0 = admit everything
+int admit_wait_ms = 0;                 // 0 = refuse at once
+int admit_adaptive = 0;
+double admit_max_abort = 0.5;
+int active_count = 0;                  // transactions in active_tx
+long admit_rejects = 0;
+int admit_waiters = 0;
+pthread_cond_t admit_cond = PTHREAD_COND_INITIALIZER;
+int admit_n, admit_commits, admit_windows, admit_dir = 1;
+uint64_t admit_lat_ns, admit_best_ns, admit_start_ns;
+double admit_goodput;
+
+// Caller holds global_lock, which may be dropped while waiting (only if
+// wait is set).
+static int admit(int wait) {
+    struct timespec until = {0, 0};
+    while (admit_limit && active_count >= admit_limit) {
+        if (!until.tv_sec) {
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += admit_wait_ms/1000;
+            until.tv_nsec += admit_wait_ms%1000*1000000L;
+            if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+        }
+        admit_waiters++;
+        int rc = wait && admit_wait_ms ? pthread_cond_timedwait(&admit_cond, &global_lock, &until) : ETIMEDOUT;
+        admit_waiters--;
+        if (rc == ETIMEDOUT && admit_limit && active_count >= admit_limit) {
+            admit_rejects++;
+            return 0;
+        }
+    }
+    active_count++;
+    return 1;
+}
+
+// tx leaves the active set. Caller holds global_lock.
+static void admit_done(Transaction *tx, int aborted) {
+    active_count--;
+    if (admit_waiters) pthread_cond_signal(&admit_cond);
+    if (!admit_adaptive) return;
+    if (!admit_start_ns) admit_start_ns = tx->begin_ns;
+    admit_n++;
+    admit_commits += !aborted;
+    admit_lat_ns += now_ns() - tx->begin_ns;
+    if (admit_n < ADMIT_WINDOW) return;
+    uint64_t now = now_ns(), mean = admit_lat_ns / admit_n;
+    double goodput = admit_commits*1e9 / (now - admit_start_ns + 1);
+    if (!admit_best_ns || mean < admit_best_ns || ++admit_windows % 64 == 0) admit_best_ns = mean;
+    if (admit_n - admit_commits > admit_max_abort*admit_n || mean > 2*admit_best_ns) admit_dir = -1;
+    else if (goodput < admit_goodput) admit_dir = -admit_dir;
+    admit_goodput = goodput;
+    admit_limit += admit_dir*(1 + admit_limit/8);
+    if (admit_limit < ADMIT_MIN) admit_limit = ADMIT_MIN;
+    if (admit_limit > MAX_TRANSACTIONS) admit_limit = MAX_TRANSACTIONS;
+    if (admit_dir > 0 && admit_waiters) pthread_cond_broadcast(&admit_cond);
+    admit_n = admit_commits = 0;
+    admit_lat_ns = 0;
+    admit_start_ns = now;
+}
+
+// ===== Two-Phase Locking =====
+// Strict 2PL, chosen per transaction with tx_begin_2pl, as an alternative to
+// snapshot reads. Key.lock_owner names the exclusive holder, lock_holders
+// lists every holder and lock_waiters queues, in arrival order, the
+// transactions blocked on the key, each sleeping on its own condition under
+// global_lock. A request waits behind conflicting holders and behind
+// conflicting requests queued ahead of it, so a released lock goes to the
+// transaction that waited for it rather than to whoever asks first; upgrades
+// skip the queue. Locks are held until commit or abort. On a conflict the
+// requester's policy decides:
+//   wait-die    an older requester waits, a younger one aborts
+//   wound-wait  an older requester wounds the younger blockers and waits;
+//               a younger one waits
+//   detect      wait, unless that closes a cycle in the waits-for graph,
+//               in which case the requester aborts
+// Age is the id of the first attempt (tx_restart_2pl keeps it), so a retried
+// transaction ends up the oldest and cannot starve. Lock state is found by
+// key name, because a flush moves Keys to new slots.
+#define LOCK_MAX_BLOCKERS 64
+
+long lock_waits = 0, deadlock_aborts = 0;
+
+static LockHolder* lock_find(Key *k, Transaction *tx) {
+    LockHolder *h = k->lock_holders;
+    while (h && h->tx != tx) h = h->next;
+    return h;
+}
+
+// Fills out with the transactions tx has to wait for to take k: conflicting
+// holders, then conflicting requests queued ahead of it. Returns how many.
+static int lock_blockers(Key *k, Transaction *tx, int exclusive, Transaction **out) {
+    int n = 0;
+    for (LockHolder *h = k->lock_holders; h && n < LOCK_MAX_BLOCKERS; h = h->next)
+        if (h->tx != tx && (exclusive || h->exclusive)) out[n++] = h->tx;
+    if (lock_find(k, tx)) return n;
+    for (LockWait *w = k->lock_waiters; w && w->tx != tx && n < LOCK_MAX_BLOCKERS; w = w->next)
+        if (exclusive || w->exclusive) out[n++] = w->tx;
+    return n;
+}
+
+// Whether target is reachable from tx over waits-for edges.
+static int waits_for(Transaction *tx, Transaction *target, int depth) {
+    Transaction *b[LOCK_MAX_BLOCKERS];
+    if (tx == target) return 1;
+    if (!tx->waiting_for[0] || depth > LOCK_MAX_BLOCKERS) return 0;
+    int n = lock_blockers(get_key(tx->waiting_for), tx, tx->waiting_exclusive, b);
+    for (int i=0;i<n;i++) if (waits_for(b[i], target, depth+1)) return 1;
+    return 0;
+}
+
+static void lock_wake(Key *k) {
+    for (LockWait *w = k->lock_waiters; w; w = w->next) pthread_cond_signal(&w->tx->lock_cond);
+}
+
+// Takes tx out of k's queue and lets the requests behind it re-check.
+static void lock_dequeue(Key *k, Transaction *tx) {
+    for (LockWait **pw = &k->lock_waiters; *pw; pw = &(*pw)->next) {
+        if ((*pw)->tx != tx) continue;
+        LockWait *w = *pw;
+        *pw = w->next;
+        free(w);
+        break;
+    }
+    tx->waiting_for[0] = 0;
+    lock_wake(k);
+}
+
+// Takes name for tx, waiting as its policy allows. Returns 0 once granted,
+// -1 if tx must abort: errno EDEADLK if its policy refused the wait,
+// ENOSPC if the key is new and the store is full. Caller holds global_lock.
+static int lock_acquire(Transaction *tx, const char *name, int exclusive) {
+    Transaction *b[LOCK_MAX_BLOCKERS];
+    for (;;) {
+        Key *k = get_key(name);
+        if (!k && !(k = create_key(name, NULL))) { errno = ENOSPC; return -1; }
+        LockHolder *mine = lock_find(k, tx);
+        if (mine && (mine->exclusive || !exclusive)) return 0;
+        int n = lock_blockers(k, tx, exclusive, b), die = tx->wounded;
+        for (int i=0;i<n;i++) {
+            if (tx->deadlock == DL_WAIT_DIE && tx->age > b[i]->age) die = 1;
+            if (tx->deadlock == DL_WOUND_WAIT && tx->age < b[i]->age && !b[i]->wounded) {
+                b[i]->wounded = 1;
+                pthread_cond_signal(&b[i]->lock_cond);
+            }
+        }
+        int queued = tx->waiting_for[0] != 0;
+        if (!die && n && tx->deadlock == DL_DETECT) {
+            snprintf(tx->waiting_for, MAX_KEYNAME, "%s", name);
+            tx->waiting_exclusive = exclusive;
+            for (int i=0;i<n && !die;i++) die = waits_for(b[i], tx, 0);
+        }
+        if (die || !n) {
+            if (queued) lock_dequeue(k, tx);
+            tx->waiting_for[0] = 0;
+            if (die) { errno = EDEADLK; return -1; }
+            if (mine) {
+                mine->exclusive = 1;       // upgrade
+            } else {
+                LockHolder *h = malloc(sizeof(LockHolder));
+                *h = (LockHolder){tx, exclusive, k->lock_holders};
+                k->lock_holders = h;
+                if (tx->nheld == tx->held_cap) {
+                    tx->held_cap = tx->held_cap ? tx->held_cap*2 : 8;
+                    tx->held = realloc(tx->held, tx->held_cap*MAX_KEYNAME);
+                }
+                snprintf(tx->held[tx->nheld++], MAX_KEYNAME, "%s", name);
+            }
+            if (exclusive) k->lock_owner = tx->id;
+            return 0;
+        }
+        if (!queued) {
+            LockWait *w = malloc(sizeof(LockWait)), **pw = &k->lock_waiters;
+            *w = (LockWait){tx, exclusive, NULL};
+            while (*pw) pw = &(*pw)->next;
+            *pw = w;
+            snprintf(tx->waiting_for, MAX_KEYNAME, "%s", name);
+            tx->waiting_exclusive = exclusive;
+            lock_waits++;
+        }
+        pthread_cond_wait(&tx->lock_cond, &global_lock);
+    }
+}
+
+// Drops every lock of tx and wakes the transactions waiting on those keys.
+// Caller holds global_lock.
+static void locks_release(Transaction *tx) {
+    for (int i=0;i<tx->nheld;i++) {
+        Key *k = get_key(tx->held[i]);
+        for (LockHolder **ph = &k->lock_holders; *ph; ph = &(*ph)->next) {
+            if ((*ph)->tx != tx) continue;
+            LockHolder *h = *ph;
+            *ph = h->next;
+            free(h);
+            break;
+        }
+        if (k->lock_owner == tx->id) k->lock_owner = 0;
+        lock_wake(k);
+    }
+    free(tx->held);
+    tx->held = NULL;
+    tx->nheld = tx->held_cap = 0;
+}
+
+// Ends tx without installing anything. Caller holds global_lock.
+static void tx_end_aborted(Transaction *tx) {
+    tx->state = TX_ABORTED;
+    if (tx->slot >= 0) {
+        active_tx[tx->slot] = NULL;
+        admit_done(tx, 1);
+        if (tx->two_pl) pthread_cond_destroy(&tx->lock_cond);
+    }
+    tx->slot = -1;
+    if (tx->nheld) locks_release(tx);
+}
+
+// Locks key for a 2PL transaction; on failure tx is aborted, with errno as
+// from lock_acquire.
+static int tx_lock(Transaction *tx, const char *key, int exclusive) {
+    pthread_mutex_lock(&global_lock);
+    int rc = -1, err = EDEADLK;
+    if (tx->state == TX_ACTIVE && (rc = lock_acquire(tx, key, exclusive)) < 0) {
+        err = errno;
+        tx_end_aborted(tx);
+        if (err == EDEADLK) deadlock_aborts++;
+    }
+    pthread_mutex_unlock(&global_lock);
+    if (rc < 0) {
+        TRACE("[TX %" PRId64 "] ABORT: lock on %s refused (%s)\n", tx->id, key,
+              err == ENOSPC ? "store full" : tx->wounded ? "wounded" : "deadlock avoidance");
+        errno = err;
+    }
+    return rc;
+}
+
+// ===== Snapshot Age =====
+// A transaction that is never finished would hold the GC watermark back
+// forever. Once snapshot_max_age_ms is set, gc_watermark first expires
+// every snapshot older than that. Under 2PL, reads are at the latest commit
+// and the snapshot only pins, so it is just renewed. A read-only
+// transaction under STALE_DOWNGRADE continues as read committed. Any other
+// stale transaction is aborted. Its reads then fail, and its commit fails.
+// Prepared 2PC transactions, and a commit whose install runs the watermark
+// (LSM flush, index or inline GC), are never expired.
+typedef enum {STALE_ABORT, STALE_DOWNGRADE} stale_policy_t;
+
+stale_policy_t stale_policy = STALE_ABORT;
+long stale_aborts = 0, stale_downgrades = 0;
+
+// Caller holds global_lock.
+static void snapshot_expire(void) {
+    uint64_t now = now_ns(), max = snapshot_max_age_ms*1000000ull;
+    for (int i=0;i<MAX_TRANSACTIONS;i++) {
+        Transaction *tx = active_tx[i];
+        if (!tx || tx->state != TX_ACTIVE || tx->installing || now - tx->snapshot_ns <= max) continue;
+        int readonly = !tx->write_count && !tx->watch_count && !tx->scan_count;
+        if (tx->two_pl || (stale_policy == STALE_DOWNGRADE && readonly)) {
+            if (!tx->two_pl) tx->isolation = ISO_READ_COMMITTED;
+            tx->start_ts = global_commit_ts;
+            tx->snapshot_ns = now;
+            stale_downgrades++;
+            TRACE("[TX %" PRId64 "] snapshot older than %" PRId64 " ms, renewed at ts=%" PRId64 "\n",
+                  tx->id, snapshot_max_age_ms, tx->start_ts);
+        } else {
+            tx_end_aborted(tx);
+            stale_aborts++;
+            TRACE("[TX %" PRId64 "] ABORT: snapshot older than %" PRId64 " ms\n", tx->id, snapshot_max_age_ms);
+        }
+    }
+}
+
+// Versions of k a GC at watermark wm keeps.
+static long chain_retained(const Key *k, commit_ts_t wm) {
+    long n = 0;
+    const Version *v = k->versions;
+    for (; v && v->commit_ts > wm; v = v->next) n++;
+    return n + (v != NULL);
+}
+
+static int cmp_tx_start(const void *a, const void *b) {
+    commit_ts_t x = (*(Transaction* const*)a)->start_ts, y = (*(Transaction* const*)b)->start_ts;
+    return (x > y) - (x < y);
+}
+
+// Lists the top oldest snapshots. For each, it gives how many memtable
+// versions it keeps alive beyond what the next younger snapshot (or the
+// present) needs.
+void snapshot_report(int top) {
+    Transaction *by_age[MAX_TRANSACTIONS];
+    txid_t id[top];
+    commit_ts_t snap[top];
+    double age_ms[top];
+    long pinned[top];
+    int n = 0;
+    pthread_mutex_lock(&global_lock);
+    uint64_t now = now_ns();
+    for (int i=0;i<MAX_TRANSACTIONS;i++)
+        if (active_tx[i]) by_age[n++] = active_tx[i];
+    qsort(by_age, n, sizeof(Transaction*), cmp_tx_start);
+    int shown = n < top ? n : top;
+    for (int i=0;i<shown;i++) {
+        commit_ts_t next = i+1 < n ? by_age[i+1]->start_ts : global_commit_ts;
+        id[i] = by_age[i]->id;
+        snap[i] = by_age[i]->start_ts;
+        age_ms[i] = (now - by_age[i]->snapshot_ns)/1e6;
+        pinned[i] = 0;
+        for (int k=0;k<store_count;k++)
+            if (store[k].name[0]) pinned[i] += chain_retained(&store[k], snap[i]) - chain_retained(&store[k], next);
+    }
+    pthread_mutex_unlock(&global_lock);
+    printf("=== Snapshot Pins (%d active) ===\n", n);
+    for (int i=0;i<shown;i++)
+        printf("  [TX %" PRId64 "] snapshot ts=%" PRId64 ", %.1f ms old, holds back %ld versions\n", id[i], snap[i],
+               age_ms[i], pinned[i]);
+}
+
+// ===== Timestamp Oracle =====
+// Commit timestamps come from a pluggable oracle, so that several engine
+// processes can share one timeline:
+//   counter  a local atomic counter; the default, for a single process
+//   hlc      hybrid logical clock: wall-clock ms above the low
+//            HLC_LOGICAL_BITS, a logical counter below. Timestamps received
+//            from other processes are folded in with ts_observe, so a commit
+//            that causally follows one elsewhere gets a larger timestamp
+//            without a round trip.
+//   batched  ranges of TSO_BATCH leased from a timestamp service
+//            (tso-server), so each process pays one round trip per range
+// next(o, floor) returns a timestamp above floor and above everything o
+// handed out or observed before, or -1 if the service cannot be reached.
+// tx_commit passes the latest local commit as floor, which keeps commits in
+// order when WAL replay or a follower moves global_commit_ts ahead. The
+// commit paths call ts_reserve before taking global_lock: the batched
+// oracle leases its next range there, so the round trip to the service is
+// not paid with the engine locked. A lease that gets no answer within
+// TSO_TIMEOUT_MS fails the commit and the connection is redialled on the
+// next lease.
+#define HLC_LOGICAL_BITS 16
+#define TSO_BATCH 1024
+#define TSO_TIMEOUT_MS 1000
+#define TSO_SAVE_AHEAD (1LL<<20)
+
+typedef struct TsOracle {
+    const char *name;
+    commit_ts_t (*next)(struct TsOracle *o, commit_ts_t floor);
+    void (*reserve)(struct TsOracle *o);   // optional: work to do before global_lock
+    _Atomic commit_ts_t last;          // latest timestamp handed out or observed
+    const char *addr;                  // batched: the service
+    int fd;                            // batched: connection to it, -1 to redial
+    commit_ts_t lo, hi;                // batched: unused part of the lease
+    commit_ts_t spare_lo, spare_hi;    // batched: the next lease, taken ahead
+    long leases;
+    uint64_t failed_ns;                // batched: when a lease last failed
+    pthread_mutex_t lease_lock;        // lo, hi and the spare range
+    pthread_mutex_t conn_lock;         // fd; never waited for under lease_lock by ts_reserve
+} TsOracle;
+
+int client_connect(const char *addr);
+int server_listen(const char *addr);
+
+// Raises o->last to ts.
+static void ts_raise(TsOracle *o, commit_ts_t ts) {
+    commit_ts_t last = atomic_load(&o->last);
+    while (last < ts && !atomic_compare_exchange_weak(&o->last, &last, ts));
+}
+
+static commit_ts_t counter_next(TsOracle *o, commit_ts_t floor) {
+    commit_ts_t last = atomic_load(&o->last), ts;
+    do ts = (last > floor ? last : floor) + 1;
+    while (!atomic_compare_exchange_weak(&o->last, &last, ts));
+    return ts;
+}
+
+static commit_ts_t hlc_next(TsOracle *o, commit_ts_t floor) {
+    commit_ts_t pt = wall_ms() << HLC_LOGICAL_BITS, last = atomic_load(&o->last), ts;
+    do {
+        ts = (last > floor ? last : floor) + 1;
+        if (pt > ts) ts = pt;          // the clock moved on: logical part restarts
+    } while (!atomic_compare_exchange_weak(&o->last, &last, ts));
+    return ts;
+}
+
+static int tso_dial(const char *addr) {
+    struct timeval tv = {TSO_TIMEOUT_MS/1000, TSO_TIMEOUT_MS%1000*1000};
+    int fd = client_connect(addr);
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    return fd;
+}
+
+// Leases a range above floor into *lo. Caller holds o->conn_lock.
+static int tso_lease(TsOracle *o, commit_ts_t floor, commit_ts_t *lo) {
+    int64_t req[2] = {TSO_BATCH, floor};
+    if (o->fd < 0 && (o->fd = tso_dial(o->addr)) < 0) {
+        o->failed_ns = now_ns();
+        return -1;
+    }
+    if (send(o->fd, req, sizeof req, MSG_NOSIGNAL) != sizeof req || read_full(o->fd, lo, sizeof *lo) < 0) {
+        close(o->fd);              // a late answer must not be taken for the next request's
+        o->fd = -1;
+        o->failed_ns = now_ns();
+        return -1;
+    }
+    o->leases++;
+    return 0;
+}
+
+static commit_ts_t tso_next(TsOracle *o, commit_ts_t floor) {
+    commit_ts_t ts = -1, last = atomic_load(&o->last);
+    if (last > floor) floor = last;
+    pthread_mutex_lock(&o->lease_lock);
+    for (;;) {
+        if (o->lo <= floor) o->lo = floor + 1;     // already passed locally
+        if (o->lo < o->hi) { ts = o->lo++; break; }
+        if (o->spare_hi) {
+            o->lo = o->spare_lo, o->hi = o->spare_hi;
+            o->spare_lo = o->spare_hi = 0;
+            continue;
+        }
+        // nothing leased ahead: pay the round trip here
+        pthread_mutex_lock(&o->conn_lock);
+        int rc = tso_lease(o, floor, &o->lo);
+        pthread_mutex_unlock(&o->conn_lock);
+        if (rc < 0) break;
+        o->hi = o->lo + TSO_BATCH;
+    }
+    pthread_mutex_unlock(&o->lease_lock);
+    if (ts > 0) ts_raise(o, ts);
+    return ts;
+}
+
+// Leases the next range once half of the current one is used. After a
+// failed lease commits stop trying here for TSO_TIMEOUT_MS and draw on what
+// is left of the current range.
+static void tso_reserve(TsOracle *o) {
+    pthread_mutex_lock(&o->lease_lock);
+    int low = !o->spare_hi && o->hi - o->lo < TSO_BATCH/2;
+    commit_ts_t floor = o->hi > atomic_load(&o->last) ? o->hi : atomic_load(&o->last), lo;
+    pthread_mutex_unlock(&o->lease_lock);
+    if (!low || pthread_mutex_trylock(&o->conn_lock) != 0) return;  // or one is on its way
+    int rc = now_ns() - o->failed_ns < TSO_TIMEOUT_MS*1000000ULL ? -1 : tso_lease(o, floor, &lo);
+    pthread_mutex_unlock(&o->conn_lock);
+    pthread_mutex_lock(&o->lease_lock);
+    if (rc == 0 && !o->spare_hi && lo >= o->hi) o->spare_lo = lo, o->spare_hi = lo + TSO_BATCH;
+    pthread_mutex_unlock(&o->lease_lock);
+}
+
+TsOracle ts_counter = {.name = "counter", .next = counter_next, .fd = -1};
+TsOracle ts_hlc = {.name = "hlc", .next = hlc_next, .fd = -1};
+TsOracle *_Atomic ts_oracle = &ts_counter;
+
+// A batched oracle leasing from the tso-server at addr, or NULL.
+TsOracle* tso_connect(const char *addr) {
+    int fd = tso_dial(addr);
+    if (fd < 0) return NULL;
+    TsOracle *o = calloc(1, sizeof(TsOracle));
+    o->name = "batched";
+    o->next = tso_next;
+    o->reserve = tso_reserve;
+    o->addr = strdup(addr);
+    o->fd = fd;
+    pthread_mutex_init(&o->lease_lock, NULL);
+    pthread_mutex_init(&o->conn_lock, NULL);
+    return o;
+}
+
+// Switches the commit path to o. Takes effect from the next commit.
+void ts_oracle_set(TsOracle *o) {
+    pthread_mutex_lock(&global_lock);
+    ts_oracle = o;
+    pthread_mutex_unlock(&global_lock);
+}
+
+// Does the oracle's blocking work ahead of a commit. Caller does not hold
+// global_lock.
+void ts_reserve(void) {
+    TsOracle *o = ts_oracle;
+    if (o->reserve) o->reserve(o);
+}
+
+// Folds in a timestamp seen from another process, so later local commits
+// order after it.
+void ts_observe(commit_ts_t ts) {
+    ts_raise(ts_oracle, ts);
+}
+
+typedef struct TsoShared {
+    pthread_mutex_t lock;
+    commit_ts_t next;
+    commit_ts_t saved;         // on disk: nothing at or above it handed out yet
+    const char *path;
+} TsoShared;
+
+typedef struct TsoConn {
+    TsoShared *s;
+    int fd;
+} TsoConn;
+
+// Records that timestamps below hw may have been handed out. Caller holds
+// s->lock.
+static int tso_save(TsoShared *s, commit_ts_t hw) {
+    char tmp[310];
+    snprintf(tmp, sizeof tmp, "%s.tmp", s->path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+    fprintf(f, "%" PRId64 "\n", hw);
+    fflush(f);
+    int rc = fdatasync(fileno(f));
+    fclose(f);
+    if (rc < 0 || rename(tmp, s->path) < 0) return -1;
+    s->saved = hw;
+    return 0;
+}
+
+static void* tso_conn(void *arg) {
+    TsoConn *c = arg;
+    int64_t req[2];
+    while (read_full(c->fd, req, sizeof req) == 0) {
+        pthread_mutex_lock(&c->s->lock);
+        commit_ts_t lo = c->s->next > req[1] ? c->s->next : req[1] + 1;
+        int ok = !c->s->path || lo + req[0] <= c->s->saved || tso_save(c->s, lo + req[0] + TSO_SAVE_AHEAD) == 0;
+        if (ok) c->s->next = lo + req[0];
+        pthread_mutex_unlock(&c->s->lock);
+        if (!ok || send(c->fd, &lo, sizeof lo, MSG_NOSIGNAL) != sizeof lo) break;
+    }
+    close(c->fd);
+    free(c);
+    return NULL;
+}
+
+// Timestamp service: each request [i64 count][i64 floor] is answered with
+// the start of a fresh range of count timestamps above floor. With a path
+// the service keeps a high-water mark there, TSO_SAVE_AHEAD past the last
+// range handed out and synced before the range is, and starts from it
+// after a restart, so it never hands out a timestamp twice. Returns only
+// on error.
+int tso_serve(const char *addr, const char *path) {
+    static TsoShared s = {PTHREAD_MUTEX_INITIALIZER, 1, 0, NULL};
+    if (path) {
+        FILE *f = fopen(path, "r");
+        if (f && fscanf(f, "%" SCNd64, &s.next) != 1) s.next = 1;
+        if (f) fclose(f);
+        s.path = path;
+    }
+    int lfd = server_listen(addr);
+    if (lfd < 0) return -1;
+    fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) & ~O_NONBLOCK);
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        TsoConn *c = malloc(sizeof(TsoConn));
+        *c = (TsoConn){&s, fd};
+        pthread_t th;
+        pthread_create(&th, NULL, tso_conn, c);
+        pthread_detach(th);
+    }
+}
+
+// ===== Isolation Levels =====
+// Chosen per transaction with tx_begin_iso; tx_begin is snapshot isolation.
+//   read committed  each statement reads a fresh snapshot. start_ts moves
+//                   with it, so a long reader only holds back the GC
+//                   watermark for the statement in flight.
+//   snapshot        every statement reads the snapshot taken at begin.
+//   serializable    snapshot reads, plus every key read is validated at
+//                   commit like a tx_watch and every scan like a predicate,
+//                   so a write skew aborts instead of committing.
+// The read path pays one compare for read committed and a watch-set insert
+// for serializable.
+
+// Snapshot a statement of tx reads. Read committed takes a new one.
+// Caller holds global_lock, so the watermark sees the move.
+static commit_ts_t tx_statement_ts(Transaction *tx) {
+    if (tx->isolation == ISO_READ_COMMITTED) {
+        tx->start_ts = global_commit_ts;
+        tx->snapshot_ns = now_ns();
+    }
+    return tx->start_ts;
+}
+
+// Snapshot a read of tx sees: the statement's, or under 2PL the latest
+// commit (the lock keeps it stable). Caller holds global_lock.
+static commit_ts_t tx_read_ts(Transaction *tx) {
+    return tx->two_pl ? global_commit_ts : tx_statement_ts(tx);
+}
+
+int tx_watch(Transaction *tx, const char *key);
+
+// Records a serializable read for validation. When the watch set is full
+// the transaction falls back to validating everything it could have read.
+static void tx_read_track(Transaction *tx, const char *key) {
+    if (tx->isolation == ISO_SERIALIZABLE && tx_watch(tx, key) < 0) pred_add(tx, "");
+}
+
+static Transaction* tx_begin_admit(int wait) {
+    Transaction *tx = calloc(1,sizeof(Transaction));
+    pthread_mutex_lock(&global_lock);
+    if (!admit(wait)) {
+        int active = active_count, limit = admit_limit;
+        pthread_mutex_unlock(&global_lock);
+        free(tx);
+        TRACE("[TX] BEGIN shed: overloaded (%d active, limit %d)\n", active, limit);
+        errno = EBUSY;
+        return NULL;
+    }
+    tx->slot = -1;
+    for (int i=0;i<MAX_TRANSACTIONS;i++) {
+        if (!active_tx[i]) { active_tx[i] = tx; tx->slot = i; break; }
+    }
+    if (tx->slot < 0) {
+        active_count--;
+        pthread_mutex_unlock(&global_lock);
+        free(tx);
+        printf("[TX] BEGIN failed: too many active transactions\n");
+        errno = EMFILE;
+        return NULL;
+    }
+    tx->begin_ns = tx->snapshot_ns = now_ns();
+    tx->id = global_tx_seq++;
+    tx->start_ts = global_commit_ts; // snapshot timestamp
+    tx->state = TX_ACTIVE;
+    pthread_mutex_unlock(&global_lock);
+    TRACE("[TX %" PRId64 "] BEGIN (snapshot=%" PRId64 ")\n", tx->id, tx->start_ts);
+    return tx;
+}
+
+// NULL with errno EBUSY if admission control sheds the transaction, EMFILE
+// if active_tx is full. May wait for admission (admit_wait_ms).
+Transaction* tx_begin() {
+    return tx_begin_admit(1);
+}
+
+// tx_begin that sheds at once instead of waiting for admission.
+Transaction* tx_try_begin(void) {
+    return tx_begin_admit(0);
+}
+
+Transaction* tx_begin_iso(isolation_t level) {
+    Transaction *tx = tx_begin();
+    if (tx) tx->isolation = level;
+    return tx;
+}
+
+Transaction* tx_begin_2pl(deadlock_policy_t policy) {
+    Transaction *tx = tx_begin();
+    if (!tx) return NULL;
+    tx->two_pl = 1;
+    tx->deadlock = policy;
+    tx->age = tx->id;
+    pthread_cond_init(&tx->lock_cond, NULL);    // destroyed when tx ends
+    return tx;
+}
+
+// Retries an aborted 2PL transaction: a new transaction with old's policy
+// and age.
+Transaction* tx_restart_2pl(Transaction *old) {
+    Transaction *tx = tx_begin_2pl(old->deadlock);
+    if (tx) tx->age = old->age;
+    return tx;
+}
+
+// Snapshot read for tx: 1 found, 0 absent, -1 once tx is aborted (or
+// EBUSY from a prepared transaction, see Two-Phase Commit). The
+// watermark may expire a stale snapshot while the lookup waits for a
+// prepared transaction (see Snapshot Age), after which GC can drop what it
+// read. The result only counts if tx is still active at the snapshot it
+// read.
+static int tx_lookup(Transaction *tx, const char *key, char *out, size_t outlen, commit_ts_t *found_ts) {
+    int found = -1;
+    pthread_mutex_lock(&global_lock);
+    while (tx->state != TX_ABORTED) {
+        commit_ts_t ts = tx_read_ts(tx);
+        found = mvcc_lookup_locked(key, ts, out, outlen, found_ts);
+        if (tx->state == TX_ABORTED) found = -1;
+        else if (found < 0 || tx->two_pl || tx->start_ts == ts) break;
+    }
+    pthread_mutex_unlock(&global_lock);
+    return found;
+}
+
+void tx_read(Transaction *tx, const char *keyname) {
+    char val[128];
+    commit_ts_t ts;
+    if (tx->two_pl && tx_lock(tx, keyname, 0) < 0) return;
+    tx_read_track(tx, keyname);
+    int found = tx_lookup(tx, keyname, val, sizeof val, &ts);
+    if (found > 0)
+        TRACE("[TX %" PRId64 "] READ %s -> %s (as of ts=%" PRId64 ")\n", tx->id, keyname, val, ts);
+    else if (found == 0)
+        TRACE("[TX %" PRId64 "] READ %s -> NULL\n", tx->id,keyname);
+    else
+        TRACE("[TX %" PRId64 "] READ %s failed: %s\n", tx->id, keyname,
+              tx->state == TX_ABORTED ? "aborted" : "busy");
+}
+
+// Read-your-writes on top of what tx_read would see. Returns 1 if found, 0
+// if absent, -1 if tx was aborted (waiting for a 2PL lock, or its snapshot
+// grew too old) or, with errno EBUSY, if a 2PC decision is overdue.
+int tx_get(Transaction *tx, const char *key, char *out, size_t outlen) {
+    commit_ts_t ts;
+    for (int i=0;i<tx->write_count;i++) {
+        if (strcmp(tx->write_set[i].key, key) == 0) {
+            snprintf(out, outlen, "%s", tx->write_set[i].value);
+            return 1;
+        }
+    }
+    if (tx->two_pl && tx_lock(tx, key, 0) < 0) return -1;
+    tx_read_track(tx, key);
+    return tx_lookup(tx, key, out, outlen, &ts);
+}
+
+// Explicit versioned read
+void tx_read_versioned(const char *keyname, commit_ts_t ts) {
+    char val[128];
+    commit_ts_t found;
+    if (mvcc_lookup(keyname, ts, val, sizeof val, &found) > 0)
+        TRACE("[Versioned] %s at ts=%" PRId64 " -> %s (commit_ts=%" PRId64 ")\n", keyname, ts, val, found);
+    else
+        TRACE("[Versioned] %s at ts=%" PRId64 " -> NULL\n", keyname, ts);
+}
+
+// Whether what tx read at snap still counts once the read is done: 1 yes,
+// 0 if its snapshot was renewed meanwhile (read again), -1 if tx was
+// aborted meanwhile (see Snapshot Age).
+static int tx_read_done(Transaction *tx, commit_ts_t snap) {
+    pthread_mutex_lock(&global_lock);
+    int ok = tx->state == TX_ABORTED ? -1 : tx->two_pl || tx->start_ts == snap;
+    pthread_mutex_unlock(&global_lock);
+    return ok;
+}
+
+// Prefix scan at the statement's snapshot: the number of keys, or -1 once
+// tx is aborted or as for mvcc_scan. Like tx_lookup, the scan only counts
+// if tx is still active at the snapshot it scanned.
+int tx_scan(Transaction *tx, const char *prefix) {
+    ScanResult r;
+    for (;;) {
+        pthread_mutex_lock(&global_lock);
+        int aborted = tx->state == TX_ABORTED;
+        commit_ts_t snap = tx_statement_ts(tx);
+        pthread_mutex_unlock(&global_lock);
+        if (aborted || mvcc_scan(prefix, snap, &r) < 0) return -1;
+        int ok = tx_read_done(tx, snap);
+        if (ok > 0) break;
+        free(r.hits);
+        if (ok < 0) return -1;
+    }
+    if (tx->isolation == ISO_SERIALIZABLE || (scan_validation && tx->isolation == ISO_SNAPSHOT))
+        pred_add(tx, prefix);
+    for (int i=0;i<r.n;i++)
+        TRACE("[TX %" PRId64 "] SCAN %s* -> %s=%s (as of ts=%" PRId64 ")\n", tx->id, prefix,
+              r.hits[i].key, r.hits[i].value, r.hits[i].ts);
+    if (!r.n) TRACE("[TX %" PRId64 "] SCAN %s* -> (empty)\n", tx->id, prefix);
+    free(r.hits);
+    return r.n;
+}
+
+// Index lookup at the statement's snapshot, with each key's value: the
+// number of keys, or -1 once tx is aborted. As for tx_scan, the index and
+// the values are read again if the snapshot moved meanwhile.
+int tx_index_lookup(Transaction *tx, SecIndex *ix, const char *ikey) {
+    ScanResult r;
+    for (;;) {
+        pthread_mutex_lock(&global_lock);
+        int aborted = tx->state == TX_ABORTED;
+        commit_ts_t snap = tx_statement_ts(tx);
+        pthread_mutex_unlock(&global_lock);
+        if (aborted) return -1;
+        index_lookup(ix, ikey, snap, &r);
+        for (int i=0;i<r.n;i++) {
+            ScanHit *h = &r.hits[i];
+            h->expired = mvcc_lookup(h->key, snap, h->value, sizeof h->value, &h->ts) <= 0;
+        }
+        int ok = tx_read_done(tx, snap);
+        if (ok > 0) break;
+        free(r.hits);
+        if (ok < 0) return -1;
+    }
+    for (int i=0;i<r.n;i++) {
+        tx_read_track(tx, r.hits[i].key);
+        if (!r.hits[i].expired)
+            TRACE("[TX %" PRId64 "] INDEX %s=%s -> %s=%s (as of ts=%" PRId64 ")\n", tx->id, ix->name, ikey,
+                  r.hits[i].key, r.hits[i].value, r.hits[i].ts);
+    }
+    if (!r.n) TRACE("[TX %" PRId64 "] INDEX %s=%s -> (empty)\n", tx->id, ix->name, ikey);
+    free(r.hits);
+    return r.n;
+}
+
+// ===== Bulk Load =====
+// bulk_load creates n keys, each with a base version at commit_ts 0, the
+// way create_key(keys[i], vals[i]) would, but in three phases:
+//   1. build, without global_lock: thread t takes the t-th range of the
+//      input. It carves the Versions and values of that range out of one
+//      arena, fills a staging Key for each key, and buckets the keys by
+//      hash into one of nthreads shards;
+//   2. index, under global_lock: the threads insert the staged keys into a
+//      private copy of key_index. Thread s inserts the keys of shard s, so
+//      a name can only collide with one already inserted;
+//   3. publish, still under the lock: the copy replaces key_index and the
+//      staged keys are copied in behind store_count.
+// Readers see either none of the keys or all of them. The input may be in
+// any order: the index is hashed, so sorting buys nothing. Keys take the
+// slots the reaper freed first. Like create_key, this bypasses the WAL,
+// replication and secondary indexes; with LSM the load is flushed to a
+// table before bulk_load returns, so it is durable all the same.
+typedef struct BulkStats {
+    long loads, keys;
+    uint64_t build_ns, locked_ns;       // phase 1; phases 2 and 3
+} BulkStats;
+
+BulkStats bulk_stats;
+
+typedef struct BulkShard {
+    long *i;                   // input indexes
+    long n, cap;
+} BulkShard;
+
+typedef struct BulkLoad {
+    char *const *keys, *const *vals;
+    long n;
+    int nt;
+    int *slot;                 // store slot of each staged key
+    int *staged;               // by store slot: staged key + 1, or 0
+    Key *stage;
+    unsigned *hash;
+    BulkShard *shards;         // [thread*nt + shard]
+    int *ix;                   // key_index being built
+    atomic_int dup;
+} BulkLoad;
+
+typedef struct BulkWorker {
+    BulkLoad *b;
+    int id;
+    char *arena;
+    long bytes;
+} BulkWorker;
+
+// A page-aligned piece of the bulk range, or NULL once it is used up.
+static char* bulk_alloc(size_t size) {
+    char *p = NULL;
+    size = (size + 4095) & ~(size_t)4095;
+    pthread_mutex_lock(&bulk_lock);
+    if (!bulk_base) {
+        bulk_base = mmap(NULL, BULK_RESERVE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (bulk_base == MAP_FAILED) bulk_base = NULL;
+    }
+    if (bulk_base && bulk_used + size <= BULK_RESERVE) {
+        p = bulk_base + bulk_used;
+        bulk_used += size;
+    }
+    pthread_mutex_unlock(&bulk_lock);
+    return p;
+}
+
+static void* bulk_build(void *arg) {
+    BulkWorker *w = arg;
+    BulkLoad *b = w->b;
+    long lo = b->n*w->id/b->nt, hi = b->n*(w->id+1)/b->nt;
+    size_t size = (hi - lo)*sizeof(Version);
+    for (long i=lo;i<hi;i++) size += strlen(b->vals[i]) + 1;
+    if (!(w->arena = bulk_alloc(size))) return NULL;
+    Version *v = (Version*)w->arena;
+    char *val = w->arena + (hi - lo)*sizeof(Version);
+    for (long i=lo;i<hi;i++, v++) {
+        size_t len = strlen(b->vals[i]) + 1;
+        memcpy(val, b->vals[i], len);
+        *v = (Version){0, val, 0, NULL};
+        val += len;
+        w->bytes += sizeof(Version) + len;
+        Key *k = &b->stage[i];
+        snprintf(k->name, MAX_KEYNAME, "%s", b->keys[i]);
+        k->versions = v;
+        unsigned h = b->hash[i] = key_hash(k->name);
+        BulkShard *sh = &b->shards[w->id*b->nt + h % b->nt];
+        if (sh->n == sh->cap) {
+            sh->cap = sh->cap ? 2*sh->cap : 1024;
+            sh->i = realloc(sh->i, sh->cap*sizeof(long));
+        }
+        sh->i[sh->n++] = i;
+    }
+    return NULL;
+}
+
+static void* bulk_index(void *arg) {
+    BulkWorker *w = arg;
+    BulkLoad *b = w->b;
+    for (int t=0;t<b->nt && !atomic_load(&b->dup);t++) {
+        BulkShard *sh = &b->shards[t*b->nt + w->id];
+        for (long j=0;j<sh->n;j++) {
+            long i = sh->i[j];
+            const char *name = b->stage[i].name;
+            for (unsigned p = b->hash[i] % KEY_INDEX_SLOTS;; p = (p+1) % KEY_INDEX_SLOTS) {
+                int s = __atomic_load_n(&b->ix[p], __ATOMIC_ACQUIRE), empty = 0;
+                if (!s && __atomic_compare_exchange_n(&b->ix[p], &empty, b->slot[i] + 1, 0,
+                                                      __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+                    break;
+                if (!s) s = empty;
+                const Key *k = b->staged[s-1] ? &b->stage[b->staged[s-1] - 1] : &store[s-1];
+                if (strcmp(k->name, name) == 0) {
+                    atomic_store(&b->dup, 1);
+                    return NULL;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static void bulk_phase(BulkWorker *w, int n, void *(*fn)(void*)) {
+    pthread_t th[n];
+    for (int i=1;i<n;i++) pthread_create(&th[i], NULL, fn, &w[i]);
+    fn(&w[0]);
+    for (int i=1;i<n;i++) pthread_join(th[i], NULL);
+}
+
+// Loads keys[i] = vals[i] for i < n with nthreads threads. All or nothing:
+// returns -1 with errno EEXIST if a key is already in the store or appears
+// twice in the input, ENOSPC if the store can't take n more keys (counting
+// the ones prepared transactions hold), and ENOMEM if the bulk range is
+// used up.
+int bulk_load(char *const *keys, char *const *vals, long n, int nthreads) {
+    if (n <= 0) return 0;
+    if (n > MAX_KEYS) { errno = ENOSPC; return -1; }
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > n) nthreads = n;
+    BulkLoad b = {keys, vals, n, nthreads, malloc(n*sizeof(int)), calloc(MAX_KEYS, sizeof(int)),
+                  calloc(n, sizeof(Key)), malloc(n*sizeof(unsigned)),
+                  calloc(nthreads*nthreads, sizeof(BulkShard)), malloc(sizeof key_index), 0};
+    BulkWorker *w = calloc(nthreads, sizeof(BulkWorker));
+    for (int i=0;i<nthreads;i++) w[i].b = &b, w[i].id = i;
+    int err = 0;
+    pthread_mutex_lock(&bulk_lock);
+    bulk_building++;
+    pthread_mutex_unlock(&bulk_lock);
+    uint64_t t0 = now_ns();
+    bulk_phase(w, nthreads, bulk_build);
+    for (int i=0;i<nthreads;i++) if (!w[i].arena) err = ENOMEM;
+    pthread_mutex_lock(&global_lock);
+    uint64_t t1 = now_ns();
+    if (!err) lsm_make_room(n);
+    if (!err && store_count - nfree + keys_reserved + n > MAX_KEYS) err = ENOSPC;
+    int reused = nfree < n ? nfree : n;
+    if (!err) {
+        for (long i=0;i<n;i++) {
+            b.slot[i] = i < reused ? free_slots[nfree-1-i] : store_count + i - reused;
+            b.staged[b.slot[i]] = i + 1;
+        }
+        memcpy(b.ix, key_index, sizeof key_index);
+        bulk_phase(w, nthreads, bulk_index);
+        if (atomic_load(&b.dup)) err = EEXIST;
+    }
+    if (!err) {
+        memcpy(key_index, b.ix, sizeof key_index);
+        for (long i=0;i<n;i++) store[b.slot[i]] = b.stage[i];
+        nfree -= reused;
+        store_count += n - reused;
+        for (int i=0;i<nthreads;i++) memtable_bytes += w[i].bytes;
+        bulk_stats.loads++;
+        bulk_stats.keys += n;
+    }
+    pthread_mutex_lock(&bulk_lock);
+    bulk_building--;
+    pthread_mutex_unlock(&bulk_lock);
+    if (!err && lsm_enabled) lsm_flush();       // not in the WAL: make it durable now
+    bulk_stats.build_ns += t1 - t0;
+    bulk_stats.locked_ns += now_ns() - t1;
+    pthread_mutex_unlock(&global_lock);
+    for (int i=0;i<nthreads*nthreads;i++) free(b.shards[i].i);
+    free(b.shards);
+    free(b.ix);
+    free(b.hash);
+    free(b.stage);
+    free(b.staged);
+    free(b.slot);
+    free(w);
+    if (err) { errno = err; return -1; }
+    return 0;
+}
+
+// ===== Interleaved Execution =====
+// A point read walks key_index, the Key, and then the version chain, and
+// each of those loads can miss to DRAM. tx_interleave runs the reads of many
+// read-only transactions on one thread as stackless coroutines (ILTask plus
+// il_step). Each step makes the load that the previous step prefetched,
+// prefetches the next one, and yields. While one transaction's line is in
+// flight, the rest of the group runs. global_lock is held for the whole
+// call, so the pointers a suspended task keeps stay valid.
+#define IL_MAX_GROUP 64
+
+enum {IL_HASH, IL_PROBE, IL_KEY, IL_CHAIN, IL_VALUE, IL_DONE};
+
+typedef struct ILTask {
+    Transaction *tx;
+    const char (*keys)[MAX_KEYNAME];
+    int nkeys;
+    char (*vals)[128];         // per key, "" if absent; NULL to only count
+    int found;                 // keys found, -1 if tx was aborted
+    // coroutine state, private to tx_interleave
+    int i, state;
+    commit_ts_t ts;
+    unsigned h;                // key_index slot being probed
+    Key *k;
+    Version *v;
+} ILTask;
+
+// Ends the current read with v (NULL: not in the memtable) and moves to
+// the next key. Returns 0 once the task is done.
+static int il_finish(ILTask *t, const Version *v, int64_t now) {
+    char buf[128], *out = t->vals ? t->vals[t->i] : buf;
+    commit_ts_t ts;
+    int64_t exp = 0;
+    int found = 0;
+    if (v) {
+        snprintf(out, 128, "%s", v->value);
+        exp = v->expires_ms;
+        found = 1;
+    } else if (lsm_enabled) found = lsm_get(t->keys[t->i], t->ts, out, 128, &ts, &exp);
+    if (found && exp && exp <= now) found = 0;
+    if (!found) out[0] = 0;
+    t->found += found;
+    lsm_stats.lookups++;
+    t->state = ++t->i == t->nkeys ? IL_DONE : IL_HASH;
+    return t->state != IL_DONE;
+}
+
+// Runs t up to its next prefetch. Returns 0 once the task is done.
+static int il_step(ILTask *t, int64_t now) {
+    switch (t->state) {
+    case IL_HASH:
+        t->h = key_hash(t->keys[t->i]) % KEY_INDEX_SLOTS;
+        __builtin_prefetch(&key_index[t->h]);
+        t->state = IL_PROBE;
+        return 1;
+    case IL_PROBE: {
+        int s = key_index[t->h];
+        if (!s) return il_finish(t, NULL, now);
+        t->k = &store[s-1];
+        __builtin_prefetch(t->k->name);
+        __builtin_prefetch(&t->k->versions);
+        t->state = IL_KEY;
+        return 1;
+    }
+    case IL_KEY:
+        if (strcmp(t->k->name, t->keys[t->i]) != 0) {
+            t->h = (t->h+1) % KEY_INDEX_SLOTS;
+            t->state = IL_PROBE;
+            return 1;
+        }
+        if (!(t->v = t->k->versions)) return il_finish(t, NULL, now);
+        __builtin_prefetch(t->v);
+        t->state = IL_CHAIN;
+        return 1;
+    case IL_CHAIN:
+        if (t->v->commit_ts > t->ts) {
+            if (!(t->v = t->v->next)) return il_finish(t, NULL, now);
+            __builtin_prefetch(t->v);
+            return 1;
+        }
+        __builtin_prefetch(t->v->value);
+        t->state = IL_VALUE;
+        return 1;
+    case IL_VALUE:
+        return il_finish(t, t->v, now);
+    }
+    return 0;
+}
+
+// Runs the point reads of n transactions with up to group of them in
+// flight. Writers wait for the whole call, so callers keep n modest. A
+// transaction with buffered writes or under 2PL reads through tx_get.
+// While a 2PC transaction is prepared, everything goes through
+// mvcc_lookup, which can wait for the decision.
+void tx_interleave(ILTask *tasks, int n, int group) {
+    ILTask *run[IL_MAX_GROUP];
+    int live = 0, next = 0;
+    if (group > IL_MAX_GROUP) group = IL_MAX_GROUP;
+    if (group < 1) group = 1;
+    for (int i=0;i<n;i++) {
+        ILTask *t = &tasks[i];
+        t->i = t->found = 0;
+        t->state = t->nkeys ? IL_HASH : IL_DONE;
+        if (t->tx->two_pl || t->tx->write_count) {
+            char buf[128];
+            for (; t->i < t->nkeys; t->i++) {
+                char *out = t->vals ? t->vals[t->i] : buf;
+                if (tx_get(t->tx, t->keys[t->i], out, 128) == 1) t->found++;
+                else out[0] = 0;
+            }
+            t->state = IL_DONE;
+            continue;
+        }
+        for (int j=0;j<t->nkeys;j++) tx_read_track(t->tx, t->keys[j]);
+    }
+    int64_t now = wall_ms();
+    pthread_mutex_lock(&global_lock);
+    // The watermark may have expired a snapshot.
+    for (int i=0;i<n;i++) {
+        ILTask *t = &tasks[i];
+        if (t->state == IL_DONE) continue;
+        if (t->tx->state == TX_ABORTED) t->found = -1, t->state = IL_DONE;
+        else t->ts = tx_read_ts(t->tx);
+    }
+    if (prepared_count) {
+        pthread_mutex_unlock(&global_lock);
+        for (int i=0;i<n;i++) {
+            ILTask *t = &tasks[i];
+            char buf[128];
+            commit_ts_t ts;
+            for (; t->state != IL_DONE && t->i < t->nkeys; t->i++) {
+                char *out = t->vals ? t->vals[t->i] : buf;
+                if (mvcc_lookup(t->keys[t->i], t->ts, out, 128, &ts) > 0) t->found++;
+                else out[0] = 0;
+            }
+            t->state = IL_DONE;
+        }
+        return;
+    }
+    for (; next < n && live < group; next++)
+        if (tasks[next].state != IL_DONE) run[live++] = &tasks[next];
+    while (live) {
+        for (int j=0;j<live;) {
+            if (il_step(run[j], now)) { j++; continue; }
+            while (next < n && tasks[next].state == IL_DONE) next++;
+            run[j] = next < n ? &tasks[next++] : run[--live];
+        }
+    }
+    pthread_mutex_unlock(&global_lock);
+}
+
+// ttl_ms > 0: the version expires that long after the write is buffered.
+int tx_write_ttl(Transaction *tx, const char *key, const char *val, int64_t ttl_ms) {
+    int64_t exp = ttl_ms > 0 ? wall_ms() + ttl_ms : 0;
+    if (tx->two_pl && tx_lock(tx, key, 1) < 0) return -1;
+    for (int i=0;i<tx->write_count;i++) {
+        if (strncmp(tx->write_set[i].key, key, MAX_KEYNAME-1) == 0) {
+            strncpy(tx->write_set[i].value,val,127);
+            tx->write_set[i].expires_ms = exp;
+            TRACE("[TX %" PRId64 "] WRITE buffered %s=%s\n", tx->id, key,val);
+            return 0;
+        }
+    }
+    if (tx->write_count == MAX_WRITESET) {
+        TRACE("[TX %" PRId64 "] WRITE %s rejected: write set full\n", tx->id, key);
+        return -1;
+    }
+    strncpy(tx->write_set[tx->write_count].key,key,MAX_KEYNAME-1);
+    strncpy(tx->write_set[tx->write_count].value,val,127);
+    tx->write_set[tx->write_count].expires_ms = exp;
+    tx->write_count++;
+    TRACE("[TX %" PRId64 "] WRITE buffered %s=%s\n", tx->id, key,val);
+    return 0;
+}
+
+int tx_write(Transaction *tx, const char *key, const char *val) {
+    return tx_write_ttl(tx, key, val, 0);
+}
+
+// Optimistic check: the commit fails if key gets a version newer than the
+// snapshot of the watch. Under read committed that is a fresh statement
+// snapshot; later statements moving start_ts do not move it.
+int tx_watch(Transaction *tx, const char *key) {
+    for (int i=0;i<tx->watch_count;i++)
+        if (strncmp(tx->watch_set[i], key, MAX_KEYNAME-1) == 0) return 0;
+    if (tx->watch_count == MAX_WATCHSET) return -1;
+    pthread_mutex_lock(&global_lock);
+    tx->watch_ts[tx->watch_count] = tx_statement_ts(tx);
+    pthread_mutex_unlock(&global_lock);
+    snprintf(tx->watch_set[tx->watch_count++], MAX_KEYNAME, "%s", key);
+    return 0;
+}
+
+// Commit timestamp of the newest version of key. Caller holds global_lock.
+static commit_ts_t latest_commit_ts(const char *key) {
+    char val[128];
+    commit_ts_t ts = -1;
+    Key *k = get_key(key);
+    if (k && k->versions) return k->versions->commit_ts;
+    if (lsm_enabled) lsm_get(key, global_commit_ts, val, sizeof val, &ts, NULL);
+    return ts;
+}
+
+// Releases tx as aborted. Caller holds global_lock, which is dropped.
+static int commit_fail(Transaction *tx, const char *what, const char *why) {
+    tx_end_aborted(tx);
+    pthread_mutex_unlock(&global_lock);
+    TRACE("[TX %" PRId64 "] ABORT: %s %s\n", tx->id, what, why);
+    return -1;
+}
+
+// Store slots the writes of tx would take. Caller holds global_lock.
+static int tx_new_keys(Transaction *tx) {
+    int n = 0;
+    for (int i=0;i<tx->write_count;i++) n += !get_key(tx->write_set[i].key);
+    return n;
+}
+
+// Checks shared by tx_commit and tx_prepare, including room in the store
+// for every write, so that the install cannot fail halfway. Returns 0 with
+// global_lock still held, or -1 with tx aborted and the lock dropped.
+static int tx_validate(Transaction *tx) {
+    const char *phantom;
+    if (tx->wounded) return commit_fail(tx, "wounded", "by an older transaction");
+    for (int i=0;i<tx->watch_count;i++)
+        if (latest_commit_ts(tx->watch_set[i]) > tx->watch_ts[i])
+            return commit_fail(tx, tx->watch_set[i], "changed after snapshot");
+    if (tx->scan_count && tx->write_count && (phantom = pred_conflict(tx))) {
+        phantom_aborts++;
+        return commit_fail(tx, phantom, "written after snapshot");
+    }
+    for (int i=0;i<tx->write_count && prepared_count;i++) {
+        if (prepared_writer(tx->write_set[i].key, 0, INT64_MAX, tx)) {
+            commit_fail(tx, tx->write_set[i].key, "held by a prepared transaction");
+            errno = EBUSY;             // not a conflict: retry once decided
+            return -1;
+        }
+    }
+    int fresh = tx_new_keys(tx);
+    if (fresh && store_count - nfree + keys_reserved + fresh > MAX_KEYS) {
+        lsm_make_room(keys_reserved + fresh);
+        fresh = tx_new_keys(tx);
+    }
+    if (store_count - nfree + keys_reserved + fresh > MAX_KEYS)
+        return commit_fail(tx, "store", "full");
+    tx->reserved = fresh;
+    return 0;
+}
+
+// Makes the writes of tx visible at ts and ends it. Caller holds
+// global_lock.
+static void tx_install(Transaction *tx, commit_ts_t ts) {
+    static long installs;
+    tx->installing = 1;
+    lsm_make_room(tx->write_count);
+    if (ts > global_commit_ts) global_commit_ts = ts;
+    if (inline_gc && ++installs % INLINE_GC_REFRESH == 0) gc_watermark();
+    commit_ts_t wm = index_count ? gc_watermark() : 0;
+    if (lsm_enabled || repl_enabled) {
+        char rec[WAL_MAX_RECORD];
+        size_t n = wal_encode(tx, ts, rec);
+        if (lsm_enabled) wal_append(rec, n);
+        if (repl_enabled) repl_append(rec, n);
+    }
+    if (cdc_count) cdc_reserve(tx->write_count);
+    for (int i=0;i<tx->write_count;i++) {
+        Key *k = get_key(tx->write_set[i].key);
+        if (!k) k = create_key(tx->write_set[i].key,NULL);     // tx_validate made room
+        if (index_count) index_write(k, tx->write_set[i].value, ts, wm);
+        add_version(k,ts,tx->write_set[i].value,tx->write_set[i].expires_ms);
+        pred_log_add(k->name, global_commit_ts);
+        if (cdc_count) cdc_publish(k->name, tx->write_set[i].value, ts);
+        TRACE("[TX %" PRId64 "] COMMIT %s=%s (ts=%" PRId64 ")\n", tx->id,
+               tx->write_set[i].key, tx->write_set[i].value,ts);
+    }
+    tx->state = TX_COMMITTED;
+    tx->commit_ts = ts;
+    if (tx->slot >= 0) {               // not if restored from the WAL
+        active_tx[tx->slot] = NULL;
+        admit_done(tx, 0);
+        if (tx->two_pl) pthread_cond_destroy(&tx->lock_cond);
+    }
+    tx->slot = -1;
+    if (tx->nheld) locks_release(tx);
+}
+
+// Takes a commit ts once no 2PC proposal is outstanding (see Two-Phase
+// Commit). Returns -1 with tx aborted if that wait fails (errno EBUSY), tx
+// ended meanwhile or the oracle is unreachable. Caller holds global_lock,
+// which is dropped on failure.
+static commit_ts_t commit_ts_next(Transaction *tx, int wait) {
+    if (prepared_drain(wait) < 0) {
+        commit_fail(tx, "waiting for", "a prepared transaction");
+        errno = EBUSY;
+        return -1;
+    }
+    if (tx->state != TX_ACTIVE) {      // expired while waiting
+        pthread_mutex_unlock(&global_lock);
+        return -1;
+    }
+    commit_ts_t ts = ts_oracle->next(ts_oracle, global_commit_ts);
+    if (ts < 0) commit_fail(tx, "timestamp", "oracle unreachable");
+    return ts;
+}
+
+static int tx_commit_wait(Transaction *tx, int wait) {
+    errno = 0;
+    if (wait && tx->write_count) cdc_throttle(tx->write_count);
+    ts_reserve();
+    pthread_mutex_lock(&global_lock);
+    if (tx->state != TX_ACTIVE) {
+        pthread_mutex_unlock(&global_lock);
+        return -1;
+    }
+    if (tx_validate(tx) < 0) return -1;
+    commit_ts_t new_ts = commit_ts_next(tx, wait);
+    if (new_ts < 0) return -1;
+    tx_install(tx, new_ts);
+    pthread_mutex_unlock(&global_lock);
+    return 0;
+}
+
+// Returns 0 once committed, -1 if a watched key changed, a scanned prefix
+// gained a key, a written key is held by a prepared transaction (EBUSY), a
+// 2PL transaction was wounded or a 2PC decision took too long (EBUSY; tx is
+// aborted). May first wait up to cdc_wait_ms for a CDC subscriber to drain.
+int tx_commit(Transaction *tx) {
+    return tx_commit_wait(tx, 1);
+}
+
+// tx_commit for the event loop: fails with errno EBUSY (tx aborted) rather
+// than wait for a 2PC decision, which the loop itself may have to apply,
+// and does not wait for CDC subscribers either.
+int tx_try_commit(Transaction *tx) {
+    return tx_commit_wait(tx, 0);
+}
+
+void tx_abort(Transaction *tx) {
+    pthread_mutex_lock(&global_lock);
+    tx_end_aborted(tx);
+    pthread_mutex_unlock(&global_lock);
+    TRACE("[TX %" PRId64 "] ABORT\n", tx->id);
+}
+
+// ===== Two-Phase Commit =====
+// Participant side. tx_prepare runs the commit checks and parks tx under
+// the coordinator's gtid, after which it can no longer fail; it proposes a
+// timestamp from the oracle. The writes stay buffered until tx_decide:
+// local commits to those keys abort, and a read at a snapshot at or past the
+// proposal waits for the decision, because the common commit ts (the
+// largest proposal) may still land at or below that snapshot. Such a read
+// gives up with EBUSY after prepared_wait_ms, in case the coordinator is
+// gone. With LSM the prepare is logged before the vote, so a participant
+// that crashes after voting yes restores the transaction on restart and
+// can still apply the decision.
+// Every participant installs the decision at exactly the coordinator's ts,
+// so a snapshot sees all of the transaction or none of it on every
+// partition. For that, local commits wait until no proposal is outstanding
+// (the event loop refuses them with EBUSY instead): the clock then stays
+// below every proposal, and so below every decision, which is the largest
+// proposal. Only another decision can pass it. Then it installs below the
+// clock. That is still exact: the keys are disjoint, and every snapshot at
+// or past its proposal waited for it. But the log, CDC and followers see
+// those two commits out of ts order.
+
+// On success tx belongs to the participant until tx_decide frees it.
+int tx_prepare(Transaction *tx, uint64_t gtid, commit_ts_t *proposal) {
+    ts_reserve();
+    pthread_mutex_lock(&global_lock);
+    if (tx->state != TX_ACTIVE) {
+        pthread_mutex_unlock(&global_lock);
+        return -1;
+    }
+    if (prepared_count == MAX_PREPARED) return commit_fail(tx, "prepare", "table full");
+    if (tx_validate(tx) < 0) return -1;
+    commit_ts_t ts = ts_oracle->next(ts_oracle, global_commit_ts);
+    if (ts < 0) return commit_fail(tx, "timestamp", "oracle unreachable");
+    tx->gtid = gtid;
+    tx->prepare_ts = ts;
+    tx->state = TX_PREPARED;
+    keys_reserved += tx->reserved;
+    prepared[prepared_count++] = tx;
+    if (lsm_enabled) wal_log_prepared(tx, WAL_PREPARED);
+    pthread_mutex_unlock(&global_lock);
+    *proposal = ts;
+    TRACE("[TX %" PRId64 "] PREPARED as %" PRIu64 " (proposal ts=%" PRId64 ")\n", tx->id, gtid, ts);
+    return 0;
+}
+
+// Applies the coordinator's decision for gtid: commit at ts, or abort if
+// ts < 0. Returns -1 if gtid is not prepared here (e.g. already decided).
+int tx_decide(uint64_t gtid, commit_ts_t ts) {
+    Transaction *tx = NULL;
+    pthread_mutex_lock(&global_lock);
+    if (ts >= 0) ts_observe(ts);        // other participants proposed it
+    for (int i=0;i<prepared_count && !tx;i++) {
+        if (prepared[i]->gtid != gtid) continue;
+        tx = prepared[i];
+        prepared[i] = prepared[--prepared_count];
+        keys_reserved -= tx->reserved;
+    }
+    if (tx && ts >= 0) {
+        tx_install(tx, ts);
+    } else if (tx) {
+        if (lsm_enabled) wal_log_prepared(tx, WAL_DECIDED);
+        tx_end_aborted(tx);
+    }
+    if (tx) pthread_cond_broadcast(&prepared_cond);
+    pthread_mutex_unlock(&global_lock);
+    if (!tx) return -1;
+    TRACE("[TX %" PRId64 "] %s %" PRIu64 "\n", tx->id, ts >= 0 ? "COMMIT PREPARED" : "ABORT PREPARED", gtid);
+    free(tx);
+    return 0;
+}
+
+// Print all versions of a key
+void print_versions(const char *keyname) {
+    Key *k = get_key(keyname);
+    if (!k) return;
+    printf("Versions of %s:\n", keyname);
+    Version *v = k->versions;
+    while(v) {
+        printf("  ts=%" PRId64 " -> %s\n", v->commit_ts, v->value);
+        v = v->next;
+    }
+}
+
+// ===== Async API =====
+// tx_commit_async validates and installs like tx_commit, but it does not
+// wait for durability. With lsm_sync, the record is appended without an
+// fdatasync, and the future is queued with the WAL offset its record ends
+// at. The syncer thread makes one fdatasync for everything appended so far
+// and completes every future that sync covered, so concurrent commits share
+// a sync (group commit) and nobody syncs under global_lock. As with early
+// lock release, the writes are visible before they are durable.
+// tx_get_async answers from the memtable inline; a read that would go to
+// disk, wait for a 2PC decision or take a 2PL lock is left pending for the
+// reader pool. Until it completes, the transaction must not be used.
+typedef struct Future Future;
+typedef void (*future_cb)(Future *f, void *arg);
+
+struct Future {
+    int done;
+    int rc;                    // commit: 0 or -1; read: as tx_get
+    commit_ts_t ts;            // commit ts
+    char value[128];           // read result
+    future_cb cb;              // run on completion; then owns the future
+    void *arg;
+    long wal_end;              // commit: durable once synced past this
+    Transaction *tx;           // read: left to the pool
+    char key[MAX_KEYNAME];
+    Future *next;
+};
+
+pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t async_done = PTHREAD_COND_INITIALIZER;
+pthread_cond_t async_work = PTHREAD_COND_INITIALIZER;
+Future *sync_head, *sync_tail;         // commits awaiting fdatasync, WAL order
+Future *read_head, *read_tail;         // reads for the pool
+long wal_synced = 0;                   // wal_bytes covered by an fdatasync
+atomic_int async_running = 0;
+pthread_t async_syncer, async_readers[16];
+int async_nreaders;
+long async_syncs = 0, async_synced_commits = 0;
+
+static Future* future_new(future_cb cb, void *arg) {
+    Future *f = calloc(1, sizeof(Future));
+    f->cb = cb;
+    f->arg = arg;
+    return f;
+}
+
+// Without a callback a waiter may free f as soon as done is set.
+static void future_complete(Future *f, int rc) {
+    future_cb cb = f->cb;
+    f->rc = rc;
+    pthread_mutex_lock(&async_lock);
+    f->done = 1;
+    pthread_cond_broadcast(&async_done);
+    pthread_mutex_unlock(&async_lock);
+    if (cb) cb(f, f->arg);
+}
+
+// Blocks until f completes; returns its rc. Only for futures without a
+// callback.
+int future_wait(Future *f) {
+    pthread_mutex_lock(&async_lock);
+    while (!f->done) pthread_cond_wait(&async_done, &async_lock);
+    pthread_mutex_unlock(&async_lock);
+    return f->rc;
+}
+
+void future_free(Future *f) {
+    free(f);
+}
+
+static void* async_syncer_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&async_lock);
+        while (!sync_head && async_running) pthread_cond_wait(&async_work, &async_lock);
+        if (!sync_head) { pthread_mutex_unlock(&async_lock); break; }
+        pthread_mutex_unlock(&async_lock);
+
+        // A dup survives lsm_flush reopening the WAL; what the old file held
+        // is then durable in a table anyway.
+        pthread_mutex_lock(&global_lock);
+        int fd = wal ? dup(fileno(wal)) : -1;
+        long end = lsm_stats.wal_bytes;
+        pthread_mutex_unlock(&global_lock);
+        if (fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+
+        pthread_mutex_lock(&async_lock);
+        wal_synced = end;
+        Future *done = NULL, **tail = &done;
+        while (sync_head && sync_head->wal_end <= end) {
+            *tail = sync_head;
+            tail = &sync_head->next;
+            sync_head = sync_head->next;
+            async_synced_commits++;
+        }
+        *tail = NULL;
+        if (!sync_head) sync_tail = NULL;
+        async_syncs++;
+        pthread_mutex_unlock(&async_lock);
+        while (done) {
+            Future *next = done->next;
+            future_complete(done, 0);
+            done = next;
+        }
+    }
+    return NULL;
+}
+
+static void* async_reader_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&async_lock);
+        while (!read_head && async_running) pthread_cond_wait(&async_work, &async_lock);
+        Future *f = read_head;
+        if (f && !(read_head = f->next)) read_tail = NULL;
+        pthread_mutex_unlock(&async_lock);
+        if (!f) break;
+        future_complete(f, tx_get(f->tx, f->key, f->value, sizeof f->value));
+    }
+    return NULL;
+}
+
+// Starts the syncer and nreaders pool threads (at most 16).
+void async_start(int nreaders) {
+    if (atomic_exchange(&async_running, 1)) return;
+    async_nreaders = nreaders < 1 ? 1 : nreaders > 16 ? 16 : nreaders;
+    pthread_create(&async_syncer, NULL, async_syncer_main, NULL);
+    for (int i=0;i<async_nreaders;i++) pthread_create(&async_readers[i], NULL, async_reader_main, NULL);
+}
+
+// Completes what is queued, then stops the threads.
+void async_stop(void) {
+    if (!atomic_exchange(&async_running, 0)) return;
+    pthread_mutex_lock(&async_lock);
+    pthread_cond_broadcast(&async_work);
+    pthread_mutex_unlock(&async_lock);
+    pthread_join(async_syncer, NULL);
+    for (int i=0;i<async_nreaders;i++) pthread_join(async_readers[i], NULL);
+}
+
+// Commits tx and returns a future for its durability: rc 0 once the commit
+// is durable (at once without lsm_sync), -1 if the commit failed. tx is
+// finished when this returns. Needs async_start when lsm_sync is set.
+Future* tx_commit_async(Transaction *tx, future_cb cb, void *arg) {
+    Future *f = future_new(cb, arg);
+    ts_reserve();
+    pthread_mutex_lock(&global_lock);
+    if (tx->state != TX_ACTIVE) {
+        pthread_mutex_unlock(&global_lock);
+        future_complete(f, -1);
+        return f;
+    }
+    if (tx_validate(tx) < 0) { future_complete(f, -1); return f; }
+    commit_ts_t ts = commit_ts_next(tx, 1);
+    if (ts < 0) {
+        future_complete(f, -1);
+        return f;
+    }
+    wal_defer_sync = 1;
+    tx_install(tx, ts);
+    wal_defer_sync = 0;
+    f->ts = ts;
+    f->wal_end = lsm_stats.wal_bytes;
+    int queue = lsm_enabled && lsm_sync;
+    pthread_mutex_unlock(&global_lock);
+    if (!queue) { future_complete(f, 0); return f; }
+    pthread_mutex_lock(&async_lock);
+    if (f->wal_end <= wal_synced) queue = 0;
+    else {
+        if (sync_tail) sync_tail->next = f;
+        else sync_head = f;
+        sync_tail = f;
+        pthread_cond_broadcast(&async_work);
+    }
+    pthread_mutex_unlock(&async_lock);
+    if (!queue) future_complete(f, 0);
+    return f;
+}
+
+// tx_get as a future. Completes before returning unless the read needs the
+// pool (see above).
+Future* tx_get_async(Transaction *tx, const char *key, future_cb cb, void *arg) {
+    Future *f = future_new(cb, arg);
+    int found = -1;
+    for (int i=0;i<tx->write_count && found < 0;i++)
+        if (strcmp(tx->write_set[i].key, key) == 0) {
+            snprintf(f->value, sizeof f->value, "%s", tx->write_set[i].value);
+            found = 1;
+        }
+    if (found < 0 && !tx->two_pl) {
+        tx_read_track(tx, key);
+        pthread_mutex_lock(&global_lock);
+        if (tx->state == TX_ABORTED) {
+            pthread_mutex_unlock(&global_lock);
+            future_complete(f, -1);
+            return f;
+        }
+        commit_ts_t ts = tx_read_ts(tx);       // as renewed by the watermark, if stale
+        if (!prepared_count || !prepared_writer(key, 0, ts, NULL)) {
+            Key *k = get_key(key);
+            Version *v = k ? k->versions : NULL;
+            while (v && v->commit_ts > ts) v = v->next;
+            if (v && expired(v, wall_ms())) found = 0;
+            else if (v) {
+                snprintf(f->value, sizeof f->value, "%s", v->value);
+                found = 1;
+            } else if (!lsm_enabled) found = 0;
+        }
+        pthread_mutex_unlock(&global_lock);
+    }
+    if (found >= 0) { future_complete(f, found); return f; }
+    f->tx = tx;
+    snprintf(f->key, sizeof f->key, "%s", key);
+    pthread_mutex_lock(&async_lock);
+    if (read_tail) read_tail->next = f;
+    else read_head = f;
+    read_tail = f;
+    pthread_cond_broadcast(&async_work);
+    pthread_mutex_unlock(&async_lock);
+    return f;
+}
+
+// ===== Watch/Notify =====
+// Waiters hang off the Key they watch, so commits to unwatched keys only pay
+// the k->waiters test in add_version. Watching a key that does not exist in
+// memory creates an empty entry to carry the list; memtable_clear keeps it,
+// and the last watcher to give up without it being written removes it.
+
+// Drops k if it only existed to carry watchers. Caller holds global_lock.
+static void watch_reclaim(Key *k) {
+    if (!k->waiters && !k->versions && !k->lock_holders && !k->lock_waiters) key_remove(k);
+}
+
+// Blocks until key has a version newer than since_ts; returns 0 and its
+// commit ts, or -1 after timeout_ms (< 0 waits forever).
+int watch(const char *key, commit_ts_t since_ts, int timeout_ms, commit_ts_t *ts) {
+    pthread_mutex_lock(&global_lock);
+    commit_ts_t latest = latest_commit_ts(key);
+    if (latest > since_ts) {
+        pthread_mutex_unlock(&global_lock);
+        *ts = latest;
+        return 0;
+    }
+    Key *k = get_key(key);
+    if (!k) k = create_key(key, NULL);
+    if (!k) { pthread_mutex_unlock(&global_lock); return -1; }
+    Waiter w = {since_ts, 0, NULL, NULL, PTHREAD_COND_INITIALIZER, k->waiters};
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    k->waiters = &w;
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += timeout_ms/1000;
+    until.tv_nsec += (long)(timeout_ms%1000)*1000000;
+    if (until.tv_nsec >= 1000000000) { until.tv_sec++; until.tv_nsec -= 1000000000; }
+    while (!w.fired_ts) {
+        if (timeout_ms < 0) pthread_cond_wait(&w.cond, &global_lock);
+        else if (pthread_cond_timedwait(&w.cond, &global_lock, &until) == ETIMEDOUT) break;
+    }
+    if (!w.fired_ts) {         // timed out: unlink (the key may have been moved by a flush)
+        k = get_key(key);
+        for (Waiter **pw = &k->waiters; *pw; pw = &(*pw)->next)
+            if (*pw == &w) { *pw = w.next; break; }
+        watch_reclaim(k);
+    }
+    pthread_mutex_unlock(&global_lock);
+    pthread_cond_destroy(&w.cond);
+    *ts = w.fired_ts;
+    return w.fired_ts ? 0 : -1;
+}
+
+// Calls cb(key, ts, arg) once, from the committing thread and under
+// global_lock, for the first version of key newer than since_ts (right away
+// if one exists). cb must not use the transaction API. Returns a handle for
+// watch_cancel, or NULL if it already fired or the store is full.
+Waiter* watch_async(const char *key, commit_ts_t since_ts, watch_cb cb, void *arg) {
+    pthread_mutex_lock(&global_lock);
+    commit_ts_t latest = latest_commit_ts(key);
+    Waiter *w = NULL;
+    Key *k = get_key(key);
+    if (latest > since_ts) cb(key, latest, arg);
+    else if (k || (k = create_key(key, NULL))) {
+        w = calloc(1, sizeof(Waiter));
+        w->since_ts = since_ts;
+        w->cb = cb;
+        w->arg = arg;
+        w->next = k->waiters;
+        k->waiters = w;
+    }
+    pthread_mutex_unlock(&global_lock);
+    return w;
+}
+
+// Returns 0 if w was still pending (it will not fire), -1 if it had fired.
+int watch_cancel(const char *key, Waiter *w) {
+    int found = -1;
+    pthread_mutex_lock(&global_lock);
+    Key *k = get_key(key);
+    for (Waiter **pw = k ? &k->waiters : NULL; pw && *pw; pw = &(*pw)->next) {
+        if (*pw == w) {
+            *pw = w->next;
+            free(w);
+            watch_reclaim(k);
+            found = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&global_lock);
+    return found;
+}
+
+// ===== Server =====
+// Single-threaded epoll loop over a length-prefixed binary protocol.
+// Request:  [u32 len][u8 op][payload]   Response: [u32 len][u8 status][payload]
+// Each connection carries at most one open transaction. Clients may pipeline
+// any number of requests: every complete frame in the input buffer is
+// executed in order and the responses go out in a single write.
+#define OP_BEGIN 1             // -> [txid][snapshot ts]
+#define OP_READ 2              // key -> [ts][value] | NOTFOUND
+#define OP_WRITE 3             // [u8 klen][key][value]
+#define OP_COMMIT 4            // -> [commit ts]
+#define OP_ABORT 5
+#define OP_READ_AT 6           // [ts][key] -> [ts][value] | NOTFOUND | BUSY (not applied), no transaction
+#define OP_STATUS 7            // -> [latest commit ts][u64 replication lag ns]
+#define OP_PREPARE 8           // [u64 gtid] -> [proposed ts]; the connection's tx is handed over
+#define OP_DECIDE 9            // [u64 gtid][commit ts, -1 = abort]
+#define ST_OK 0
+#define ST_NOTFOUND 1
+#define ST_ERR 2
+#define ST_BUSY 3              // key held by a prepared transaction, or BEGIN shed; retry
+#define MAX_FRAME 4096
+
+typedef struct Buf {
+    char *data;
+    size_t len, cap, off;
+} Buf;
+
+#define RESP_MAX_ARGS 64
+
+typedef enum {PROTO_BINARY, PROTO_RESP} proto_t;
+
+typedef struct RespCmd {
+    int argc;
+    char *argv[RESP_MAX_ARGS]; // NUL-terminated copies
+} RespCmd;
+
+typedef struct Conn {
+    int fd;
+    proto_t proto;
+    Transaction *tx;
+    Buf in, out;
+    int multi;                 // RESP: inside MULTI
+    int multi_err;             // RESP: a queued command was rejected
+    int watching;              // RESP: WATCH issued on c->tx
+    RespCmd *queue;
+    int nqueued, qcap;
+    commit_ts_t tpc_snap;      // --cores: snapshot of the open transaction, 0 if none
+    KVPair *tpc_writes;        // --cores: its buffered writes
+    int tpc_nwrites;
+    struct CoreShard *tpc_core;// --cores: the core that accepted it
+    int tpc_slot;              // --cores: index in the core's conns
+    int tpc_parked;            // --cores: waiting for another core's reply
+} Conn;
+
+volatile int server_stop = 0;
+int server_readonly = 0;       // followers: writes are rejected
+
+static void buf_put(Buf *b, const void *p, size_t n) {
+    if (b->len + n > b->cap) {
+        b->cap = (b->len + n)*2;
+        b->data = realloc(b->data, b->cap);
+    }
+    if (n) memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void put_frame(Buf *b, uint8_t tag, const void *payload, uint32_t n) {
+    uint32_t len = n + 1;
+    buf_put(b, &len, 4);
+    buf_put(b, &tag, 1);
+    buf_put(b, payload, n);
+}
+
+// Parses "unix:/path", "tcp:port" or "tcp:host:port".
+static int sock_addr(const char *addr, struct sockaddr_storage *sa, socklen_t *len) {
+    memset(sa, 0, sizeof *sa);
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un*)sa;
+        un->sun_family = AF_UNIX;
+        snprintf(un->sun_path, sizeof un->sun_path, "%s", addr+5);
+        *len = sizeof *un;
+        return AF_UNIX;
+    }
+    if (strncmp(addr, "tcp:", 4) == 0) {
+        struct sockaddr_in *in = (struct sockaddr_in*)sa;
+        const char *port = strrchr(addr, ':') + 1;
+        char host[64] = "127.0.0.1";
+        if (port - addr > 5) snprintf(host, sizeof host, "%.*s", (int)(port - addr - 5), addr+4);
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(port));
+        if (inet_pton(AF_INET, host, &in->sin_addr) != 1) return -1;
+        *len = sizeof *in;
+        return AF_INET;
+    }
+    return -1;
+}
+
+// reuseport: TCP listeners bound to the same address share its connections.
+static int server_listen_opt(const char *addr, int reuseport) {
+    struct sockaddr_storage sa;
+    socklen_t len;
+    int family = sock_addr(addr, &sa, &len), one = 1;
+    if (family < 0) return -1;
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (family == AF_UNIX) unlink(((struct sockaddr_un*)&sa)->sun_path);
+    else setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    if (family != AF_UNIX && reuseport) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one);
+    if (bind(fd, (struct sockaddr*)&sa, len) < 0 || listen(fd, 512) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_listen(const char *addr) {
+    return server_listen_opt(addr, 0);
+}
+
+int client_connect(const char *addr) {
+    struct sockaddr_storage sa;
+    socklen_t len;
+    int family = sock_addr(addr, &sa, &len), one = 1;
+    if (family < 0) return -1;
+    int fd = socket(family, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&sa, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (family == AF_INET) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return fd;
+}
+
+// Latest commit this process has installed (on a follower: applied).
+static commit_ts_t applied_ts(void) {
+    pthread_mutex_lock(&global_lock);
+    commit_ts_t ts = global_commit_ts;
+    pthread_mutex_unlock(&global_lock);
+    return ts;
+}
+
+static void tpc_exec(Conn *c, uint8_t op, const char *p, uint32_t n);
+
+static void server_exec(Conn *c, uint8_t op, const char *p, uint32_t n) {
+    char resp[256], key[MAX_KEYNAME], val[128];
+    uint8_t st = ST_OK;
+    uint32_t rn = 0;
+    commit_ts_t ts;
+    uint64_t lag;
+    if (c->tpc_core) {
+        tpc_exec(c, op, p, n);
+        return;
+    }
+    switch (op) {
+    case OP_BEGIN:
+        if (c->tx) tx_abort(c->tx), free(c->tx);
+        c->tx = tx_try_begin();
+        if (!c->tx) { st = errno == EBUSY ? ST_BUSY : ST_ERR; break; }
+        memcpy(resp, &c->tx->id, sizeof(txid_t));
+        memcpy(resp + sizeof(txid_t), &c->tx->start_ts, sizeof ts);
+        rn = sizeof(txid_t) + sizeof ts;
+        break;
+    case OP_READ:
+        if (!c->tx || n >= MAX_KEYNAME) { st = ST_ERR; break; }
+        memcpy(key, p, n); key[n] = 0;
+        if (prepared_pending(key, c->tx->start_ts)) { st = ST_BUSY; break; }  // never block the loop
+        if (!mvcc_lookup(key, c->tx->start_ts, val, sizeof val, &ts)) { st = ST_NOTFOUND; break; }
+        memcpy(resp, &ts, sizeof ts);
+        rn = strlen(val);
+        memcpy(resp + sizeof ts, val, rn);
+        rn += sizeof ts;
+        break;
+    case OP_WRITE: {
+        uint8_t kl = n ? (uint8_t)p[0] : 0;
+        if (!c->tx || !n || kl >= MAX_KEYNAME || 1u + kl > n || n - 1 - kl > 127 ||
+            server_readonly) { st = ST_ERR; break; }
+        memcpy(key, p+1, kl); key[kl] = 0;
+        memcpy(val, p+1+kl, n-1-kl); val[n-1-kl] = 0;
+        if (tx_write(c->tx, key, val) < 0) st = ST_ERR;
+        break;
+    }
+    case OP_COMMIT:
+        if (!c->tx) { st = ST_ERR; break; }
+        if (server_readonly) {             // nothing to commit; do not advance the clock
+            tx_abort(c->tx);
+            c->tx->commit_ts = c->tx->start_ts;
+        } else if (tx_try_commit(c->tx) < 0) {
+            st = errno == EBUSY ? ST_BUSY : ST_ERR;
+        }
+        memcpy(resp, &c->tx->commit_ts, sizeof ts);
+        rn = sizeof ts;
+        free(c->tx);
+        c->tx = NULL;
+        break;
+    case OP_READ_AT:
+        if (n <= sizeof ts || n - sizeof ts >= MAX_KEYNAME) { st = ST_ERR; break; }
+        memcpy(&ts, p, sizeof ts);
+        memcpy(key, p + sizeof ts, n - sizeof ts); key[n - sizeof ts] = 0;
+        if (server_readonly && ts > applied_ts()) { st = ST_BUSY; break; }   // not replicated yet
+        if (prepared_pending(key, ts)) { st = ST_BUSY; break; }
+        if (!mvcc_lookup(key, ts, val, sizeof val, &ts)) { st = ST_NOTFOUND; break; }
+        memcpy(resp, &ts, sizeof ts);
+        rn = strlen(val);
+        memcpy(resp + sizeof ts, val, rn);
+        rn += sizeof ts;
+        break;
+    case OP_STATUS:
+        ts = applied_ts();
+        memcpy(resp, &ts, sizeof ts);
+        lag = atomic_load(&repl_last_lag_ns);
+        memcpy(resp + sizeof ts, &lag, 8);
+        rn = sizeof ts + 8;
+        break;
+    case OP_ABORT:
+        if (!c->tx) { st = ST_ERR; break; }
+        tx_abort(c->tx);
+        free(c->tx);
+        c->tx = NULL;
+        break;
+    case OP_PREPARE: {
+        uint64_t gtid;
+        if (!c->tx || n != sizeof gtid || server_readonly) { st = ST_ERR; break; }
+        memcpy(&gtid, p, sizeof gtid);
+        if (tx_prepare(c->tx, gtid, &ts) < 0) {
+            st = ST_ERR;
+            free(c->tx);
+        }
+        c->tx = NULL;
+        memcpy(resp, &ts, sizeof ts);
+        rn = st == ST_OK ? sizeof ts : 0;
+        break;
+    }
+    case OP_DECIDE: {
+        uint64_t gtid;
+        if (n != sizeof gtid + sizeof ts) { st = ST_ERR; break; }
+        memcpy(&gtid, p, sizeof gtid);
+        memcpy(&ts, p + sizeof gtid, sizeof ts);
+        if (tx_decide(gtid, ts) < 0) st = ST_NOTFOUND;
+        break;
+    }
+    default:
+        st = ST_ERR;
+    }
+    put_frame(&c->out, st, resp, rn);
+}
+
+static void resp_cmd_free(RespCmd *cmd);
+
+static void conn_free(Conn *c) {
+    if (c->tx) { tx_abort(c->tx); free(c->tx); }
+    for (int i=0;i<c->nqueued;i++) resp_cmd_free(&c->queue[i]);
+    free(c->queue);
+    free(c->tpc_writes);
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+}
+
+static void conn_close(int ep, Conn *c) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    conn_free(c);
+}
+
+// Returns -1 when the connection should be dropped.
+static int conn_flush(int ep, Conn *c) {
+    while (c->out.off < c->out.len) {
+        ssize_t w = send(c->fd, c->out.data + c->out.off, c->out.len - c->out.off, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno != EAGAIN) return -1;
+            struct epoll_event ev = {EPOLLIN | EPOLLOUT, {.ptr = c}};
+            epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+            return 0;
+        }
+        c->out.off += w;
+    }
+    c->out.len = c->out.off = 0;
+    struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+static int resp_readable(Conn *c);
+
+// Runs the complete binary frames in c->in; stops early while the
+// connection is parked (--cores).
+static int conn_frames(Conn *c) {
+    size_t off = 0;
+    while (!c->tpc_parked && c->in.len - off >= 5) {
+        uint32_t len;
+        memcpy(&len, c->in.data + off, 4);
+        if (!len || len > MAX_FRAME) return -1;
+        if (c->in.len - off - 4 < len) break;
+        server_exec(c, c->in.data[off+4], c->in.data + off + 5, len - 1);
+        off += 4 + len;
+    }
+    if (off) memmove(c->in.data, c->in.data + off, c->in.len - off);
+    c->in.len -= off;
+    return 0;
+}
+
+static int conn_readable(Conn *c) {
+    char chunk[16384];
+    for (;;) {
+        ssize_t r = read(c->fd, chunk, sizeof chunk);
+        if (r == 0) return -1;
+        if (r < 0) {
+            if (errno == EAGAIN) break;
+            return -1;
+        }
+        buf_put(&c->in, chunk, r);
+    }
+    return c->proto == PROTO_RESP ? resp_readable(c) : conn_frames(c);
+}
+
+// Serves until server_stop is set.
+int server_run(int lfd, proto_t proto) {
+    int ep = epoll_create1(0);
+    struct epoll_event ev = {EPOLLIN, {.ptr = NULL}}, events[256];
+    epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+    while (!server_stop) {
+        int n = epoll_wait(ep, events, 256, 100);
+        for (int i=0;i<n;i++) {
+            Conn *c = events[i].data.ptr;
+            if (!c) {
+                int fd, one = 1;
+                while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+                    c = calloc(1, sizeof(Conn));
+                    c->fd = fd;
+                    c->proto = proto;
+                    struct epoll_event cev = {EPOLLIN, {.ptr = c}};
+                    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev);
+                }
+                continue;
+            }
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+                conn_close(ep, c);
+                continue;
+            }
+            if ((events[i].events & EPOLLIN) && conn_readable(c) < 0) {
+                conn_close(ep, c);
+                continue;
+            }
+            if (conn_flush(ep, c) < 0) conn_close(ep, c);
+        }
+    }
+    close(ep);
+    return 0;
+}
+
+// ===== RESP Front-End =====
+// Redis protocol on the same event loop. Outside MULTI every command runs in
+// its own transaction. MULTI queues commands; EXEC runs them in a single
+// transaction, at a snapshot taken by the first WATCH if there was one and
+// by EXEC otherwise, and replies nil if a WATCHed key was committed after
+// that snapshot. INCR watches its key implicitly so concurrent increments
+// are never lost; a transaction that only conflicts on those is rerun on a
+// fresh snapshot.
+static void resp_cmd_free(RespCmd *cmd) {
+    for (int i=0;i<cmd->argc;i++) free(cmd->argv[i]);
+    cmd->argc = 0;
+}
+
+// Parses one command (multibulk or inline). Returns bytes consumed, 0 if
+// the frame is incomplete, -1 on a protocol error.
+static long resp_parse(const char *buf, size_t n, RespCmd *cmd) {
+    const char *p = buf, *end = buf + n, *nl;
+    cmd->argc = 0;
+    if (!n) return 0;
+    if (*p != '*') {                        // inline: space separated words
+        if (!(nl = memchr(p, '\n', n))) return n > MAX_FRAME ? -1 : 0;
+        const char *e = nl > p && nl[-1] == '\r' ? nl-1 : nl;
+        while (p < e && cmd->argc < RESP_MAX_ARGS) {
+            while (p < e && *p == ' ') p++;
+            const char *s = p;
+            while (p < e && *p != ' ') p++;
+            if (p > s) cmd->argv[cmd->argc++] = strndup(s, p - s);
+        }
+        return nl + 1 - buf;
+    }
+    if (!(nl = memchr(p, '\n', n))) return 0;
+    long argc = strtol(p+1, NULL, 10);
+    if (argc < 0 || argc > RESP_MAX_ARGS) return -1;
+    p = nl + 1;
+    for (long i=0;i<argc;i++) {
+        if (p >= end || !(nl = memchr(p, '\n', end - p))) goto incomplete;
+        if (*p != '$') { resp_cmd_free(cmd); return -1; }
+        long len = strtol(p+1, NULL, 10);
+        if (len < 0 || len > MAX_FRAME) { resp_cmd_free(cmd); return -1; }
+        p = nl + 1;
+        if (end - p < len + 2) goto incomplete;
+        cmd->argv[cmd->argc++] = strndup(p, len);
+        p += len + 2;
+    }
+    return p - buf;
+incomplete:
+    resp_cmd_free(cmd);
+    return 0;
+}
+
+static void resp_line(Buf *out, char type, const char *s) {
+    buf_put(out, &type, 1);
+    buf_put(out, s, strlen(s));
+    buf_put(out, "\r\n", 2);
+}
+
+static void resp_int(Buf *out, long v) {
+    char s[32];
+    snprintf(s, sizeof s, "%ld", v);
+    resp_line(out, ':', s);
+}
+
+static void resp_bulk(Buf *out, const char *v) {
+    char s[32];
+    if (!v) { buf_put(out, "$-1\r\n", 5); return; }
+    snprintf(s, sizeof s, "%zu", strlen(v));
+    resp_line(out, '$', s);
+    buf_put(out, v, strlen(v));
+    buf_put(out, "\r\n", 2);
+}
+
+static void resp_array(Buf *out, long n) {
+    char s[32];
+    snprintf(s, sizeof s, "%ld", n);
+    resp_line(out, '*', s);
+}
+
+// -1 (EBUSY) if key is held by a prepared transaction: tx_get would block
+// the event loop in prepared_wait, so report it as server_exec does.
+static int resp_get(Transaction *tx, const char *key, char *out, size_t outlen) {
+    if (prepared_pending(key, tx->start_ts)) {
+        errno = EBUSY;
+        return -1;
+    }
+    return tx_get(tx, key, out, outlen) > 0;
+}
+
+static int resp_is(const RespCmd *cmd, const char *name) {
+    return cmd->argc && strcasecmp(cmd->argv[0], name) == 0;
+}
+
+// Commands that run inside a transaction; returns 0 if cmd is not one, -1
+// if a key it reads is held by a prepared transaction.
+static int resp_data_cmd(Transaction *tx, RespCmd *cmd, Buf *out) {
+    char val[128];
+    int found;
+    for (int i=1;i<cmd->argc;i++) {
+        if (strlen(cmd->argv[i]) >= MAX_KEYNAME && !(resp_is(cmd, "SET") && i == 2)) {
+            resp_line(out, '-', "ERR key too long");
+            return 1;
+        }
+    }
+    if (resp_is(cmd, "GET") && cmd->argc == 2) {
+        if ((found = resp_get(tx, cmd->argv[1], val, sizeof val)) < 0) return -1;
+        resp_bulk(out, found ? val : NULL);
+    } else if (resp_is(cmd, "MGET") && cmd->argc >= 2) {
+        resp_array(out, cmd->argc - 1);
+        for (int i=1;i<cmd->argc;i++) {
+            if ((found = resp_get(tx, cmd->argv[i], val, sizeof val)) < 0) return -1;
+            resp_bulk(out, found ? val : NULL);
+        }
+    } else if (resp_is(cmd, "SET") && cmd->argc >= 3) {
+        long ttl = 0;          // SET key value [EX seconds | PX milliseconds]
+        if (cmd->argc == 5 && !strcasecmp(cmd->argv[3], "EX")) ttl = atol(cmd->argv[4])*1000;
+        if (cmd->argc == 5 && !strcasecmp(cmd->argv[3], "PX")) ttl = atol(cmd->argv[4]);
+        if ((cmd->argc != 3 && cmd->argc != 5) || (cmd->argc == 5 && ttl <= 0))
+            resp_line(out, '-', "ERR syntax error");
+        else if (strlen(cmd->argv[2]) > 127) resp_line(out, '-', "ERR value too long");
+        else if (tx_write_ttl(tx, cmd->argv[1], cmd->argv[2], ttl) < 0) resp_line(out, '-', "ERR too many writes");
+        else resp_line(out, '+', "OK");
+    } else if ((resp_is(cmd, "INCR") || resp_is(cmd, "DECR")) && cmd->argc == 2) {
+        if ((found = resp_get(tx, cmd->argv[1], val, sizeof val)) < 0) return -1;
+        char *end = val;
+        long v = found ? strtol(val, &end, 10) : 0;
+        if (found && (*end || !*val)) {
+            resp_line(out, '-', "ERR value is not an integer or out of range");
+            return 1;
+        }
+        v += resp_is(cmd, "INCR") ? 1 : -1;
+        snprintf(val, sizeof val, "%ld", v);
+        if (tx_watch(tx, cmd->argv[1]) < 0 || tx_write(tx, cmd->argv[1], val) < 0)
+            resp_line(out, '-', "ERR too many writes");
+        else
+            resp_int(out, v);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Runs cmds in one transaction, retrying on conflicts the client did not ask
+// to see. Returns -1 if an explicit WATCH failed.
+static int resp_run_tx(Conn *c, RespCmd *cmds, int n, int array) {
+    size_t mark = c->out.len;
+    for (;;) {
+        Transaction *tx = c->tx ? c->tx : tx_try_begin();
+        c->tx = NULL;
+        if (!tx) {
+            resp_line(&c->out, '-', errno == EBUSY ? "BUSY overloaded, retry later" : "ERR too many active transactions");
+            return 0;
+        }
+        if (array) resp_array(&c->out, n);
+        int busy = 0, rc = -1;
+        for (int i=0;i<n && !busy;i++) busy = resp_data_cmd(tx, &cmds[i], &c->out) < 0;
+        if (busy) tx_abort(tx);
+        else busy = (rc = tx_try_commit(tx)) < 0 && errno == EBUSY;
+        int watched = c->watching;
+        free(tx);
+        c->watching = 0;
+        if (rc == 0) return 0;
+        c->out.len = mark;
+        if (busy) {
+            resp_line(&c->out, '-', "BUSY 2PC decision pending, retry later");
+            return 0;
+        }
+        if (watched) return -1;
+    }
+}
+
+static void resp_reset_multi(Conn *c) {
+    for (int i=0;i<c->nqueued;i++) resp_cmd_free(&c->queue[i]);
+    c->nqueued = 0;
+    c->multi = c->multi_err = 0;
+}
+
+static void resp_exec(Conn *c, RespCmd *cmd) {
+    Buf *out = &c->out;
+    if (!cmd->argc) return;
+    if (c->multi && !resp_is(cmd, "EXEC") && !resp_is(cmd, "DISCARD") &&
+        !resp_is(cmd, "MULTI") && !resp_is(cmd, "WATCH")) {
+        if (!resp_is(cmd, "GET") && !resp_is(cmd, "SET") && !resp_is(cmd, "MGET") &&
+            !resp_is(cmd, "INCR") && !resp_is(cmd, "DECR")) {
+            c->multi_err = 1;
+            resp_line(out, '-', "ERR unknown command inside MULTI");
+            return;
+        }
+        if (c->nqueued == c->qcap) {
+            c->qcap = c->qcap ? c->qcap*2 : 8;
+            c->queue = realloc(c->queue, c->qcap*sizeof(RespCmd));
+        }
+        c->queue[c->nqueued++] = *cmd;      // takes ownership of the args
+        cmd->argc = 0;
+        resp_line(out, '+', "QUEUED");
+        return;
+    }
+
+    if (resp_is(cmd, "PING")) {
+        if (cmd->argc > 1) resp_bulk(out, cmd->argv[1]);
+        else resp_line(out, '+', "PONG");
+    } else if (resp_is(cmd, "MULTI")) {
+        if (c->multi) { resp_line(out, '-', "ERR MULTI calls can not be nested"); return; }
+        c->multi = 1;
+        resp_line(out, '+', "OK");
+    } else if (resp_is(cmd, "EXEC")) {
+        if (!c->multi) { resp_line(out, '-', "ERR EXEC without MULTI"); return; }
+        if (c->multi_err) {
+            resp_line(out, '-', "EXECABORT Transaction discarded because of previous errors.");
+            if (c->tx) { tx_abort(c->tx); free(c->tx); c->tx = NULL; }
+            c->watching = 0;
+        } else if (resp_run_tx(c, c->queue, c->nqueued, 1) < 0) {
+            buf_put(out, "*-1\r\n", 5);
+        }
+        resp_reset_multi(c);
+    } else if (resp_is(cmd, "DISCARD")) {
+        if (!c->multi) { resp_line(out, '-', "ERR DISCARD without MULTI"); return; }
+        if (c->tx) { tx_abort(c->tx); free(c->tx); c->tx = NULL; }
+        c->watching = 0;
+        resp_reset_multi(c);
+        resp_line(out, '+', "OK");
+    } else if (resp_is(cmd, "WATCH") && cmd->argc >= 2) {
+        if (c->multi) { resp_line(out, '-', "ERR WATCH inside MULTI is not allowed"); return; }
+        if (!c->tx && !(c->tx = tx_try_begin())) {
+            resp_line(out, '-', errno == EBUSY ? "BUSY overloaded, retry later" : "ERR too many active transactions");
+            return;
+        }
+        for (int i=1;i<cmd->argc;i++) {
+            if (strlen(cmd->argv[i]) >= MAX_KEYNAME || tx_watch(c->tx, cmd->argv[i]) < 0) {
+                resp_line(out, '-', "ERR cannot watch key");
+                return;
+            }
+        }
+        c->watching = 1;
+        resp_line(out, '+', "OK");
+    } else if (resp_is(cmd, "UNWATCH")) {
+        if (c->tx) { tx_abort(c->tx); free(c->tx); c->tx = NULL; }
+        c->watching = 0;
+        resp_line(out, '+', "OK");
+    } else if (resp_is(cmd, "CONFIG") || resp_is(cmd, "COMMAND")) {
+        resp_array(out, 0);                 // benchmark tools probe these
+    } else if (resp_is(cmd, "SELECT") || resp_is(cmd, "CLIENT")) {
+        resp_line(out, '+', "OK");
+    } else if (resp_is(cmd, "GET") || resp_is(cmd, "SET") || resp_is(cmd, "MGET") ||
+               resp_is(cmd, "INCR") || resp_is(cmd, "DECR")) {
+        Transaction *watched = c->tx;      // autocommit must not consume a WATCH
+        int w = c->watching;
+        c->tx = NULL;
+        c->watching = 0;
+        resp_run_tx(c, cmd, 1, 0);
+        c->tx = watched;
+        c->watching = w;
+    } else {
+        char msg[96];
+        snprintf(msg, sizeof msg, "ERR unknown command '%.40s'", cmd->argv[0]);
+        resp_line(out, '-', msg);
+    }
+}
+
+static int resp_readable(Conn *c) {
+    size_t off = 0;
+    for (;;) {
+        RespCmd cmd;
+        long n = resp_parse(c->in.data + off, c->in.len - off, &cmd);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        off += n;
+        resp_exec(c, &cmd);
+        resp_cmd_free(&cmd);
+    }
+    if (off) memmove(c->in.data, c->in.data + off, c->in.len - off);
+    c->in.len -= off;
+    return 0;
+}
+
+// ===== Load Generator =====
+// One thread per connection. Each round trip pipelines `depth` units in a
+// single write and waits for all replies. A unit is a BEGIN, READ, WRITE,
+// COMMIT transaction on the binary protocol, or SET + GET over RESP (the
+// redis-benchmark mix), counted as two operations.
+typedef struct LoadArgs {
+    const char *addr;
+    proto_t proto;
+    int readonly;              // binary: BEGIN, READ, READ, ABORT
+    int depth;
+    int nkeys;
+    uint64_t deadline;
+    long txs;
+    uint64_t *lat;             // per round trip, ns
+    long nlat, cap;
+} LoadArgs;
+
+// Length of the complete RESP reply at p, 0 if more bytes are needed.
+static size_t resp_reply_len(const char *p, size_t n) {
+    const char *nl = n ? memchr(p, '\n', n) : NULL;
+    if (!nl) return 0;
+    size_t head = nl + 1 - p;
+    long v = strtol(p+1, NULL, 10);
+    if (*p == '$') {
+        if (v < 0) return head;
+        return n >= head + v + 2 ? head + v + 2 : 0;
+    }
+    if (*p == '*') {
+        size_t off = head;
+        for (long i=0;i<v;i++) {
+            size_t m = resp_reply_len(p + off, n - off);
+            if (!m) return 0;
+            off += m;
+        }
+        return off;
+    }
+    return head;
+}
+
+static int read_replies(int fd, proto_t proto, Buf *b, int want) {
+    char chunk[16384];
+    while (want > 0) {
+        size_t off = 0;
+        while (want > 0 && b->len - off >= 4) {
+            size_t m;
+            if (proto == PROTO_RESP) {
+                if (!(m = resp_reply_len(b->data + off, b->len - off))) break;
+            } else {
+                uint32_t len;
+                memcpy(&len, b->data + off, 4);
+                if (b->len - off - 4 < len) break;
+                m = 4 + len;
+            }
+            off += m;
+            want--;
+        }
+        if (off) memmove(b->data, b->data + off, b->len - off);
+        b->len -= off;
+        if (!want) break;
+        ssize_t r = read(fd, chunk, sizeof chunk);
+        if (r <= 0) return -1;
+        buf_put(b, chunk, r);
+    }
+    return 0;
+}
+
+static void* load_worker(void *arg) {
+    LoadArgs *a = arg;
+    int fd = client_connect(a->addr);
+    if (fd < 0) return NULL;
+    Buf out = {0}, in = {0};
+    unsigned seed = (unsigned)(uintptr_t)a;
+    char payload[64];
+    while (now_ns() < a->deadline) {
+        out.len = 0;
+        for (int d=0;d<a->depth;d++) {
+            char key[MAX_KEYNAME];
+            int kl = snprintf(key, sizeof key, "k%d", rand_r(&seed) % a->nkeys);
+            if (a->proto == PROTO_RESP) {
+                int n = snprintf(payload, sizeof payload, "*3\r\n$3\r\nSET\r\n$%d\r\n%s\r\n$3\r\nxxx\r\n",
+                                 kl, key);
+                buf_put(&out, payload, n);
+                n = snprintf(payload, sizeof payload, "*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n", kl, key);
+                buf_put(&out, payload, n);
+                continue;
+            }
+            put_frame(&out, OP_BEGIN, NULL, 0);
+            put_frame(&out, OP_READ, key, kl);
+            if (a->readonly) {
+                kl = snprintf(key, sizeof key, "k%d", rand_r(&seed) % a->nkeys);
+                put_frame(&out, OP_READ, key, kl);
+                put_frame(&out, OP_ABORT, NULL, 0);
+                continue;
+            }
+            payload[0] = kl;
+            memcpy(payload+1, key, kl);
+            int vl = snprintf(payload+1+kl, sizeof payload - 1 - kl, "v%u", rand_r(&seed));
+            put_frame(&out, OP_WRITE, payload, 1+kl+vl);
+            put_frame(&out, OP_COMMIT, NULL, 0);
+        }
+        uint64_t t0 = now_ns();
+        if (write(fd, out.data, out.len) != (ssize_t)out.len) break;
+        if (read_replies(fd, a->proto, &in, (a->proto == PROTO_RESP ? 2 : 4)*a->depth) < 0) break;
+        if (a->nlat == a->cap) {
+            a->cap = a->cap ? a->cap*2 : 4096;
+            a->lat = realloc(a->lat, a->cap*sizeof(uint64_t));
+        }
+        a->lat[a->nlat++] = now_ns() - t0;
+        a->txs += a->proto == PROTO_RESP ? 2*a->depth : a->depth;
+    }
+    close(fd);
+    free(out.data);
+    free(in.data);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+void loadgen(const char *addr, proto_t proto, int readonly, int conns, int depth, double secs) {
+    LoadArgs *args = calloc(conns, sizeof(LoadArgs));
+    pthread_t *th = calloc(conns, sizeof(pthread_t));
+    uint64_t start = now_ns(), deadline = start + (uint64_t)(secs*1e9);
+    for (int i=0;i<conns;i++) {
+        args[i] = (LoadArgs){addr, proto, readonly, depth, 10000, deadline, 0, NULL, 0, 0};
+        pthread_create(&th[i], NULL, load_worker, &args[i]);
+    }
+    long txs = 0, nlat = 0;
+    for (int i=0;i<conns;i++) {
+        pthread_join(th[i], NULL);
+        txs += args[i].txs;
+        nlat += args[i].nlat;
+    }
+    double elapsed = (now_ns() - start)/1e9;
+    uint64_t *lat = malloc((nlat ? nlat : 1)*sizeof(uint64_t));
+    long k = 0;
+    for (int i=0;i<conns;i++) {
+        if (args[i].nlat) memcpy(lat + k, args[i].lat, args[i].nlat*sizeof(uint64_t));
+        k += args[i].nlat;
+        free(args[i].lat);
+    }
+    qsort(lat, nlat, sizeof(uint64_t), cmp_u64);
+    if (nlat)
+        printf("conns=%3d depth=%2d: %8.0f %s  p50=%7.1f us  p99=%7.1f us  p99.9=%7.1f us\n",
+               conns, depth, txs/elapsed, proto == PROTO_RESP ? "ops/s" : "tx/s ", lat[nlat/2]/1e3, lat[nlat*99/100]/1e3,
+               lat[nlat*999/1000]/1e3);
+    else
+        printf("conns=%3d depth=%2d: no completed requests\n", conns, depth);
+    free(lat);
+    free(args);
+    free(th);
+}
+
+typedef struct ServerArgs {
+    int lfd;
+    proto_t proto;
+} ServerArgs;
+
+static void* server_thread(void *arg) {
+    ServerArgs *a = arg;
+    server_run(a->lfd, a->proto);
+    return NULL;
+}
+
+// ===== Replication =====
+// Asynchronous log shipping over local sockets. The primary runs one sender
+// thread per follower; commits never wait for followers. A follower opens
+// with the latest commit it has applied (0 when empty) and first receives
+// every version the primary holds above it, taken under global_lock at the
+// log position it then follows. It applies entries in stream order, which
+// is commit_ts order, and publishes each one by advancing global_commit_ts
+// under global_lock, so every snapshot it hands out is an applied commit.
+// It acknowledges the stream bytes it has applied, which lets the primary
+// trim its log, and reconnects from its last commit when the stream ends.
+// Followers serve reads over the binary protocol in read-only mode. Versions
+// the primary has already collected are not resent; a re-seeded follower
+// keeps the newest one at each key.
+typedef struct SnapVersion {
+    commit_ts_t ts;
+    KVPair kv;
+} SnapVersion;
+
+static int cmp_snap_version(const void *a, const void *b) {
+    commit_ts_t x = ((const SnapVersion*)a)->ts, y = ((const SnapVersion*)b)->ts;
+    return (x > y) - (x < y);
+}
+
+static void snap_push(SnapVersion **v, long *n, long *cap, const char *key, commit_ts_t ts,
+                      const char *val, size_t vlen, int64_t expires_ms) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap*2 : 1024;
+        *v = realloc(*v, *cap*sizeof(SnapVersion));
+    }
+    SnapVersion *s = &(*v)[(*n)++];
+    if (vlen > 127) vlen = 127;
+    s->ts = ts;
+    snprintf(s->kv.key, MAX_KEYNAME, "%s", key);
+    memcpy(s->kv.value, val, vlen);
+    s->kv.value[vlen] = 0;
+    s->kv.expires_ms = expires_ms;
+}
+
+// Encodes the versions above since (and every base version) from the
+// memtable and every table as stream entries in commit_ts order, so the
+// versions of a key reach a follower oldest first. Returns -1 with nothing
+// encoded if a table cannot be read. Caller holds global_lock.
+static int repl_snapshot(commit_ts_t since, char **out, size_t *len, size_t *cap) {
+    SnapVersion *v = NULL;
+    long n = 0, vcap = 0;
+    int corrupt = 0;
+    for (int i=0;i<store_count;i++)
+        for (Version *x = store[i].versions; x; x = x->next)
+            if (x->commit_ts > since || !x->commit_ts)
+                snap_push(&v, &n, &vcap, store[i].name, x->commit_ts, x->value, strlen(x->value), x->expires_ms);
+    for (int l=0;l<LSM_MAX_LEVELS;l++)
+        for (int i=0;i<level_count[l];i++) {
+            SstIter it = {.t = levels[l][i], .b = -1};
+            for (sst_iter_next(&it); it.valid; sst_iter_next(&it))
+                if (it.ts > since || !it.ts)
+                    snap_push(&v, &n, &vcap, it.key, it.ts, it.val, it.vlen, it.expires_ms);
+            free(it.buf);
+            corrupt |= it.corrupt;
+        }
+    if (corrupt) {
+        free(v);
+        return -1;
+    }
+    if (n) qsort(v, n, sizeof(SnapVersion), cmp_snap_version);
+    char rec[WAL_MAX_RECORD];
+    KVPair w[MAX_WRITESET];
+    for (long i=0;i<n;) {
+        int m = 0;
+        commit_ts_t ts = v[i].ts;
+        while (i < n && m < MAX_WRITESET && v[i].ts == ts) w[m++] = v[i++].kv;
+        repl_put(out, len, cap, rec, wal_encode_kv(w, m, ts, 0, 0, rec));
+    }
+    free(v);
+    return 0;
+}
+
+static int send_full(int fd, const char *p, size_t n) {
+    for (size_t done = 0; done < n;) {
+        ssize_t w = send(fd, p + done, n - done, MSG_NOSIGNAL);
+        if (w <= 0) return -1;
+        done += w;
+    }
+    return 0;
+}
+
+// One follower: its seed, then the log from the position the seed was
+// taken at. Acknowledgements (u64 stream bytes applied) are picked up
+// between chunks.
+static void* repl_sender(void *arg) {
+    int fd = (int)(intptr_t)arg, slot = -1;
+    commit_ts_t since;
+    char *seed = NULL;
+    size_t seed_len = 0, seed_cap = 0, start = 0, off, acked = 0;
+    uint64_t ack;
+    size_t ackn = 0;
+    if (read_full(fd, &since, sizeof since) < 0) {
+        close(fd);
+        return NULL;
+    }
+    pthread_mutex_lock(&global_lock);
+    if (repl_snapshot(since, &seed, &seed_len, &seed_cap) < 0) {
+        printf("replication: a table cannot be read, follower dropped\n");
+    } else {
+        pthread_mutex_lock(&repl_lock);
+        for (int i=0;i<REPL_MAX_FOLLOWERS && slot < 0;i++)
+            if (!repl_followers[i].used) slot = i;
+        if (slot >= 0) {
+            start = repl_base + repl_len;
+            repl_followers[slot] = (ReplFollower){1, 0, start};
+        }
+        pthread_mutex_unlock(&repl_lock);
+    }
+    pthread_mutex_unlock(&global_lock);
+    if (slot < 0 || send_full(fd, seed, seed_len) < 0) goto out;
+    free(seed);
+    seed = NULL;
+    for (off = start;;) {
+        pthread_mutex_lock(&repl_lock);
+        ReplFollower *f = &repl_followers[slot];
+        while (off == repl_base + repl_len && !f->cut) pthread_cond_wait(&repl_cond, &repl_lock);
+        if (f->cut) {
+            pthread_mutex_unlock(&repl_lock);
+            break;
+        }
+        size_t n = repl_base + repl_len - off < (1u<<20) ? repl_base + repl_len - off : (1u<<20);
+        char *chunk = malloc(n);           // the log may be reallocated meanwhile
+        memcpy(chunk, repl_log + (off - repl_base), n);
+        pthread_mutex_unlock(&repl_lock);
+        int rc = send_full(fd, chunk, n);
+        free(chunk);
+        if (rc < 0) break;
+        off += n;
+        ssize_t r;
+        while ((r = recv(fd, (char*)&ack + ackn, sizeof ack - ackn, MSG_DONTWAIT)) > 0)
+            if ((ackn += r) == sizeof ack) {
+                ackn = 0;
+                if (ack >= seed_len) acked = start + ack - seed_len;
+            }
+        if (r == 0) break;
+        pthread_mutex_lock(&repl_lock);
+        if (acked > f->acked) {
+            f->acked = acked;
+            repl_trim();
+        }
+        pthread_mutex_unlock(&repl_lock);
+    }
+out:
+    if (slot >= 0) {
+        pthread_mutex_lock(&repl_lock);
+        repl_followers[slot].used = 0;
+        repl_trim();
+        pthread_mutex_unlock(&repl_lock);
+    }
+    free(seed);
+    close(fd);
+    return NULL;
+}
+
+static void* repl_acceptor(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return NULL;
+        }
+        pthread_t th;
+        pthread_create(&th, NULL, repl_sender, (void*)(intptr_t)fd);
+        pthread_detach(th);
+    }
+}
+
+// Primary side: start logging commits and accept followers on addr.
+int repl_start(const char *addr) {
+    int lfd = server_listen(addr);
+    if (lfd < 0) return -1;
+    int flags = fcntl(lfd, F_GETFL);
+    fcntl(lfd, F_SETFL, flags & ~O_NONBLOCK);
+    pthread_mutex_lock(&global_lock);
+    repl_enabled = 1;
+    pthread_mutex_unlock(&global_lock);
+    pthread_t th;
+    pthread_create(&th, NULL, repl_acceptor, (void*)(intptr_t)lfd);
+    pthread_detach(th);
+    return 0;
+}
+
+// Connects to the primary and asks for everything after the latest commit
+// applied here.
+static int follower_connect(const char *primary, int tries) {
+    int fd = -1;
+    for (int i=0;i<tries && fd < 0;i++)
+        if ((fd = client_connect(primary)) < 0) usleep(50000);
+    if (fd < 0) return -1;
+    commit_ts_t since = applied_ts();
+    if (write(fd, &since, sizeof since) != sizeof since) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+typedef struct FollowerArgs {
+    const char *primary;
+    int fd;
+} FollowerArgs;
+
+static void* follower_apply(void *arg) {
+    FollowerArgs *a = arg;
+    int fd = a->fd;
+    Buf in = {0};
+    char chunk[65536];
+    uint64_t applied = 0;                  // stream bytes, acknowledged to the primary
+    for (;;) {
+        ssize_t r = read(fd, chunk, sizeof chunk);
+        if (r <= 0) {
+            close(fd);
+            printf("follower: primary stream closed, reconnecting\n");
+            fflush(stdout);
+            while ((fd = follower_connect(a->primary, 1)) < 0) usleep(100000);
+            in.len = 0;
+            applied = 0;
+            continue;
+        }
+        buf_put(&in, chunk, r);
+        size_t off = 0;
+        while (in.len - off >= 12) {
+            uint64_t t;
+            uint32_t len;
+            memcpy(&t, in.data + off, 8);
+            memcpy(&len, in.data + off + 8, 4);
+            if (in.len - off - 12 < len) break;
+            pthread_mutex_lock(&global_lock);
+            commit_ts_t ts = wal_apply(in.data + off + 12, len);
+            pthread_mutex_unlock(&global_lock);
+            if (ts == -2) {
+                printf("follower: malformed record in the stream, replication stopped\n");
+                close(fd);
+                free(in.data);
+                return NULL;
+            }
+            if (ts < 0) {
+                memcpy(&ts, in.data + off + 12, sizeof ts);
+                printf("follower: store full at ts=%" PRId64 ", replication stopped "
+                       "(start the follower with a directory)\n", ts);
+                close(fd);
+                free(in.data);
+                return NULL;
+            }
+            atomic_store(&repl_last_lag_ns, now_ns() - t);
+            off += 12 + len;
+        }
+        if (off) memmove(in.data, in.data + off, in.len - off);
+        in.len -= off;
+        applied += off;
+        if (off && send(fd, &applied, sizeof applied, MSG_NOSIGNAL) < 0) {}
+    }
+}
+
+// Follower side: replicate from primary and serve reads on serve_addr.
+int follower_run(const char *primary, const char *serve_addr) {
+    static FollowerArgs args;
+    args.primary = primary;
+    if ((args.fd = follower_connect(primary, 100)) < 0) return -1;
+    int lfd = server_listen(serve_addr);
+    if (lfd < 0) return -1;
+    pthread_t th;
+    pthread_create(&th, NULL, follower_apply, &args);
+    server_readonly = 1;
+    return server_run(lfd, PROTO_BINARY);
+}
+
+// Latest applied commit and the commit-to-apply delay of the last entry.
+static int repl_status(int fd, commit_ts_t *ts, uint64_t *lag) {
+    char req[5] = {1, 0, 0, 0, OP_STATUS}, resp[1 + sizeof *ts + 8];
+    uint32_t len;
+    if (write(fd, req, 5) != 5 || read_full(fd, &len, 4) < 0 || len != sizeof resp ||
+        read_full(fd, resp, len) < 0)
+        return -1;
+    memcpy(ts, resp + 1, sizeof *ts);
+    memcpy(lag, resp + 1 + sizeof *ts, 8);
+    return 0;
+}
+
+// ===== 2PC Coordinator =====
+// Runs transactions over engine processes that each own a hash partition of
+// the keys. A transaction on one partition goes there as a single
+// BEGIN/WRITE.../COMMIT batch. One spanning several is prepared on each in
+// a BEGIN/WRITE.../PREPARE batch and, if every participant prepares,
+// committed at the largest proposed timestamp; otherwise the prepared ones
+// are told to abort. The decision is appended to the coordinator's log and
+// synced before any participant hears it. A coordinator handles one
+// transaction at a time, so after a crash only the last logged decision and
+// the transaction after it can be unresolved: coord_open resends the first
+// and aborts the second.
+#define MAX_PARTICIPANTS 8
+
+typedef struct Coordinator {
+    int n;
+    int fd[MAX_PARTICIPANTS];
+    FILE *log;
+    uint64_t next_gtid;        // coordinator id << 48 | sequence
+    long commits, aborts;
+} Coordinator;
+
+int coord_sync = 1;            // fdatasync the decision log
+
+// Reads one response frame. Returns the payload length or -1.
+static int frame_read(int fd, uint8_t *st, void *payload, uint32_t cap) {
+    uint32_t len;
+    char buf[MAX_FRAME];
+    if (read_full(fd, &len, 4) < 0 || len < 1 || len > sizeof buf || read_full(fd, buf, len) < 0) return -1;
+    *st = buf[0];
+    if (len - 1 > cap) return -1;
+    memcpy(payload, buf + 1, len - 1);
+    return len - 1;
+}
+
+static int coord_part(Coordinator *c, const char *key) {
+    return hash64(key, strlen(key)) % c->n;
+}
+
+// Sends the decision for gtid to every participant flagged in to and waits
+// for the acknowledgements. Unknown gtids (already decided) are fine.
+static int coord_decide(Coordinator *c, uint64_t gtid, commit_ts_t ts, const int *to) {
+    char req[4 + 1 + 8 + sizeof ts], resp[16];
+    uint32_t len = 1 + 8 + sizeof ts;
+    uint8_t st;
+    memcpy(req, &len, 4);
+    req[4] = OP_DECIDE;
+    memcpy(req + 5, &gtid, 8);
+    memcpy(req + 13, &ts, sizeof ts);
+    for (int p=0;p<c->n;p++)
+        if ((!to || to[p]) && write_full(c->fd[p], req, sizeof req) < 0) return -1;
+    for (int p=0;p<c->n;p++)
+        if ((!to || to[p]) && frame_read(c->fd[p], &st, resp, sizeof resp) < 0) return -1;
+    return 0;
+}
+
+static void coord_log(Coordinator *c, uint64_t gtid, commit_ts_t ts) {
+    if (ts >= 0) fprintf(c->log, "C %" PRIu64 " %" PRId64 "\n", gtid, ts);
+    else fprintf(c->log, "A %" PRIu64 "\n", gtid);
+    fflush(c->log);
+    if (coord_sync) fdatasync(fileno(c->log));
+}
+
+// Connects to the n participants (partition i at addrs[i]) and recovers
+// from the decision log at log_path. id tells coordinators apart (1..65535).
+Coordinator* coord_open(const char **addrs, int n, const char *log_path, int id) {
+    Coordinator *c = calloc(1, sizeof(Coordinator));
+    c->n = n;
+    for (int i=0;i<n;i++) {
+        if ((c->fd[i] = client_connect(addrs[i])) >= 0) continue;
+        while (i--) close(c->fd[i]);
+        free(c);
+        return NULL;
+    }
+    uint64_t gtid, last = (uint64_t)id << 48;
+    commit_ts_t ts, last_ts = -1;
+    char kind;
+    FILE *f = fopen(log_path, "r");
+    while (f && fscanf(f, " %c %" SCNu64, &kind, &gtid) == 2) {
+        ts = -1;
+        if (kind == 'C' && fscanf(f, "%" SCNd64, &ts) != 1) break;
+        last = gtid;
+        last_ts = ts;
+    }
+    if (f) fclose(f);
+    c->log = fopen(log_path, "a");
+    if (last_ts >= 0) coord_decide(c, last, last_ts, NULL);
+    coord_decide(c, last + 1, -1, NULL);
+    c->next_gtid = last + 2;
+    return c;
+}
+
+void coord_close(Coordinator *c) {
+    for (int i=0;i<c->n;i++) close(c->fd[i]);
+    fclose(c->log);
+    free(c);
+}
+
+// Commits the n writes atomically across their partitions. Returns 0 and
+// the commit ts, or -1 if the transaction aborted.
+int coord_commit(Coordinator *c, const KVPair *w, int n, commit_ts_t *ts) {
+    Buf out[MAX_PARTICIPANTS];
+    int count[MAX_PARTICIPANTS] = {0}, prepared[MAX_PARTICIPANTS] = {0}, parts = 0, ok = 1;
+    memset(out, 0, sizeof out);
+    for (int i=0;i<n;i++) {
+        int p = coord_part(c, w[i].key);
+        char payload[1 + MAX_KEYNAME + 128];
+        uint8_t kl = strlen(w[i].key);
+        size_t vl = strlen(w[i].value);
+        if (!count[p]++) {
+            parts++;
+            put_frame(&out[p], OP_BEGIN, NULL, 0);
+        }
+        payload[0] = kl;
+        memcpy(payload + 1, w[i].key, kl);
+        memcpy(payload + 1 + kl, w[i].value, vl);
+        put_frame(&out[p], OP_WRITE, payload, 1 + kl + vl);
+    }
+    uint64_t gtid = parts > 1 ? c->next_gtid++ : 0;
+    commit_ts_t decision = 0, proposal;
+    for (int p=0;p<c->n;p++) {
+        if (!count[p]) continue;
+        if (parts > 1) put_frame(&out[p], OP_PREPARE, &gtid, sizeof gtid);
+        else put_frame(&out[p], OP_COMMIT, NULL, 0);
+        if (write_full(c->fd[p], out[p].data, out[p].len) < 0) ok = 0;
+        free(out[p].data);
+    }
+    for (int p=0;p<c->n;p++) {
+        char resp[64];
+        uint8_t st;
+        for (int i=0;count[p] && i<=count[p]+1;i++) {
+            int rn = frame_read(c->fd[p], &st, resp, sizeof resp);
+            if (rn < 0 || st != ST_OK) { ok = 0; continue; }
+            if (i <= count[p]) continue;       // BEGIN and WRITE replies
+            memcpy(&proposal, resp, sizeof proposal);
+            if (proposal > decision) decision = proposal;
+            prepared[p] = 1;
+        }
+    }
+    if (parts > 1) {
+        if (!ok) decision = -1;
+        coord_log(c, gtid, decision);
+        if (coord_decide(c, gtid, decision, prepared) < 0) ok = 0;
+    }
+    if (ok) c->commits++;
+    else c->aborts++;
+    *ts = decision;
+    return ok ? 0 : -1;
+}
+
+// ===== Thread-Per-Core Engine =====
+// Shared-nothing alternative to the global store. Each core thread owns the
+// keys that hash to it and is the only thread that touches their version
+// chains, so there are no latches. Under server --cores every core also
+// runs its own event loop with its own listener (SO_REUSEPORT for TCP; a
+// Unix socket is shared with EPOLLEXCLUSIVE) and serves the connections it
+// accepted. Work on keys the core owns runs inline; a read or install of
+// another core's key goes to the owner's lock-free MPSC mailbox, and the
+// reply comes back through the requester's own mailbox while the
+// connection is parked, so no core ever waits on another. Threads outside
+// the cores (tpc_read, tpc_commit) use the same mailboxes and spin for the
+// reply. A commit takes a timestamp from an atomic clock and installs its
+// writes on every owning core. The timestamp only becomes visible to new
+// snapshots once it and every earlier one are fully installed, so a reader
+// never sees half a cross-shard commit. Each core trims its chains behind
+// the newest version at or below the oldest snapshot any core or thread
+// still has pinned.
+#define TPC_MAX_CORES 64
+#define TPC_RING 65536                 // commits that may be in flight
+#define TPC_MAX_PINS 256               // tpc_begin callers at once
+#define TPC_GC_EVERY 64                // installs between horizon refreshes
+
+enum {MSG_READ, MSG_INSTALL, MSG_STOP, MSG_READ_DONE, MSG_INSTALLED};
+
+struct TpcCommit;
+
+typedef struct Msg {
+    struct Msg *_Atomic next;
+    int type;
+    commit_ts_t ts;            // READ: snapshot, INSTALL: commit ts
+    const char *key;           // READ
+    char *out;
+    size_t outlen;
+    int found;
+    KVPair *writes;            // INSTALL
+    int nwrites;
+    atomic_int *pending;       // thread caller: decremented once handled
+    struct CoreShard *reply_to;// core caller: the message comes back as *_DONE
+    Conn *conn;                // core caller, READ: the parked connection
+    struct TpcCommit *commit;  // core caller, INSTALL
+    char name[MAX_KEYNAME];    // core caller, READ: key and value live here
+    char val[128];
+} Msg;
+
+typedef struct CoreShard {
+    int id;
+    pthread_t thread;
+    int ep, efd, lfd;          // lfd: listener, -1 without server --cores
+    Msg *_Atomic head;         // producers swap in here
+    Msg *tail;                 // consumer side
+    Msg stub;
+    atomic_int sleeping;
+    Key *keys;
+    int nkeys, cap;
+    int *index;                // open addressing over keys, slot + 1
+    int index_slots;
+    long handled, installs, collected;
+    commit_ts_t gc_horizon;    // versions shadowed at or below it are dropped
+    _Atomic commit_ts_t pin;   // at or below the oldest open snapshot here
+    Conn **conns;              // accepted here
+    int nconns, conns_cap;
+    struct TpcCommit *waiting; // installed, not yet visible
+} CoreShard;
+
+// A commit started by a connection on a core: the writes grouped by owner
+// and one INSTALL message per remote owner.
+typedef struct TpcCommit {
+    Conn *conn;
+    commit_ts_t ts;
+    int pending;               // remote installs outstanding
+    struct TpcCommit *next;    // on the core's waiting list
+    KVPair writes[MAX_WRITESET];
+    Msg msgs[];
+} TpcCommit;
+
+CoreShard *tpc_cores;
+int tpc_ncores;
+_Atomic commit_ts_t tpc_clock;
+_Atomic commit_ts_t tpc_visible;
+atomic_uchar tpc_done[TPC_RING];
+_Atomic commit_ts_t tpc_pins[TPC_MAX_PINS];    // 0 = free
+static _Thread_local int tpc_pin_slot = -1;
+
+static int tpc_owner(const char *key) {
+    return key_hash(key) % tpc_ncores;
+}
+
+static void mailbox_push(CoreShard *c, Msg *m) {
+    atomic_store(&m->next, NULL);
+    Msg *prev = atomic_exchange(&c->head, m);
+    atomic_store(&prev->next, m);
+    if (atomic_load(&c->sleeping)) {
+        uint64_t one = 1;
+        if (write(c->efd, &one, 8) < 0) {}
+    }
+}
+
+// Vyukov's intrusive MPSC queue; returns NULL when empty (or mid-push).
+static Msg* mailbox_pop(CoreShard *c) {
+    Msg *tail = c->tail, *next = atomic_load(&tail->next);
+    if (tail == &c->stub) {
+        if (!next) return NULL;
+        c->tail = next;
+        tail = next;
+        next = atomic_load(&next->next);
+    }
+    if (next) {
+        c->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load(&c->head)) return NULL;
+    mailbox_push(c, &c->stub);
+    next = atomic_load(&tail->next);
+    if (next) {
+        c->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Publishes a snapshot in *pin: re-reads tpc_visible until the pin is
+// stored before the horizon could have moved past it.
+static commit_ts_t tpc_pin(_Atomic commit_ts_t *pin) {
+    commit_ts_t s;
+    do {
+        s = atomic_load(&tpc_visible);
+        atomic_store(pin, s);
+    } while (s != atomic_load(&tpc_visible));
+    return s;
+}
+
+// Oldest snapshot anyone may still read at. tpc_visible is read first, so a
+// pin published after that read is no older than the result.
+static commit_ts_t tpc_horizon(void) {
+    commit_ts_t h = atomic_load(&tpc_visible);
+    for (int i=0;i<tpc_ncores;i++) {
+        commit_ts_t p = atomic_load(&tpc_cores[i].pin);
+        if (p < h) h = p;
+    }
+    for (int i=0;i<TPC_MAX_PINS;i++) {
+        commit_ts_t p = atomic_load(&tpc_pins[i]);
+        if (p && p < h) h = p;
+    }
+    return h;
+}
+
+static Key* shard_key(CoreShard *c, const char *name, int create) {
+    unsigned h = key_hash(name) / TPC_MAX_CORES % c->index_slots;
+    while (c->index[h]) {
+        Key *k = &c->keys[c->index[h]-1];
+        if (strcmp(k->name, name) == 0) return k;
+        h = (h+1) % c->index_slots;
+    }
+    if (!create) return NULL;
+    if (c->nkeys*2 >= c->index_slots) {     // grow: rebuild the index
+        free(c->index);
+        c->index_slots *= 2;
+        c->index = calloc(c->index_slots, sizeof(int));
+        for (int i=0;i<c->nkeys;i++) {
+            unsigned g = key_hash(c->keys[i].name) / TPC_MAX_CORES % c->index_slots;
+            while (c->index[g]) g = (g+1) % c->index_slots;
+            c->index[g] = i+1;
+        }
+        h = key_hash(name) / TPC_MAX_CORES % c->index_slots;
+        while (c->index[h]) h = (h+1) % c->index_slots;
+    }
+    if (c->nkeys == c->cap) {
+        c->cap = c->cap ? c->cap*2 : 1024;
+        c->keys = realloc(c->keys, c->cap*sizeof(Key));
+    }
+    Key *k = &c->keys[c->nkeys++];
+    memset(k, 0, sizeof *k);
+    snprintf(k->name, MAX_KEYNAME, "%s", name);
+    c->index[h] = c->nkeys;
+    return k;
+}
+
+// Commits to one key can arrive out of timestamp order; keep the chain
+// sorted. Everything behind the newest version at or below the horizon is
+// unreachable and freed on the way.
+static void shard_install(CoreShard *c, Key *k, commit_ts_t ts, const char *val) {
+    Version **p = &k->versions;
+    while (*p && (*p)->commit_ts > ts) p = &(*p)->next;
+    Version *v = malloc(sizeof(Version));
+    v->commit_ts = ts;
+    v->value = strdup(val);
+    v->next = *p;
+    *p = v;
+    if (++c->installs % TPC_GC_EVERY == 0) c->gc_horizon = tpc_horizon();
+    for (v = k->versions; v && v->commit_ts > c->gc_horizon; v = v->next) {}
+    if (!v) return;
+    Version *dead = v->next;
+    v->next = NULL;
+    while (dead) {
+        Version *next = dead->next;
+        free(dead->value);
+        free(dead);
+        c->collected++;
+        dead = next;
+    }
+}
+
+static void shard_install_all(CoreShard *c, commit_ts_t ts, const KVPair *w, int n) {
+    for (int i=0;i<n;i++) shard_install(c, shard_key(c, w[i].key, 1), ts, w[i].value);
+}
+
+static int shard_read(CoreShard *c, const char *key, commit_ts_t *ts, char *out, size_t outlen) {
+    Key *k = shard_key(c, key, 0);
+    for (Version *v = k ? k->versions : NULL; v; v = v->next) {
+        if (v->commit_ts <= *ts) {
+            snprintf(out, outlen, "%s", v->value);
+            *ts = v->commit_ts;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Marks ts installed and advances tpc_visible over every finished commit.
+static void tpc_publish(commit_ts_t ts) {
+    atomic_store(&tpc_done[ts % TPC_RING], 1);
+    for (;;) {
+        commit_ts_t v = atomic_load(&tpc_visible);
+        if (!atomic_load(&tpc_done[(v+1) % TPC_RING])) break;
+        if (atomic_compare_exchange_weak(&tpc_visible, &v, v+1))
+            atomic_store(&tpc_done[(v+1) % TPC_RING], 0);
+    }
+}
+
+// Bounds the in-flight window so ring slots are not reused too early.
+static int tpc_window_full(void) {
+    return atomic_load(&tpc_clock) - atomic_load(&tpc_visible) >= TPC_RING - 1;
+}
+
+// Groups writes by owner into part (ordered like touched); returns the
+// number of owners.
+static int tpc_partition(const KVPair *writes, int n, KVPair *part, int *touched, int *count) {
+    int owner[MAX_WRITESET], nt = 0, at = 0;
+    for (int i=0;i<n;i++) {
+        int o = tpc_owner(writes[i].key), t = 0;
+        owner[i] = o;
+        while (t < nt && touched[t] != o) t++;
+        if (t == nt) touched[nt] = o, count[nt++] = 0;
+        count[t]++;
+    }
+    for (int t=0;t<nt;t++)
+        for (int i=0;i<n;i++)
+            if (owner[i] == touched[t]) part[at++] = writes[i];
+    return nt;
+}
+
+// A parked connection whose peer went away is freed once its reply lands.
+static void core_conn_close(CoreShard *c, Conn *conn) {
+    c->conns[conn->tpc_slot] = c->conns[--c->nconns];
+    c->conns[conn->tpc_slot]->tpc_slot = conn->tpc_slot;
+    if (!conn->tpc_parked) {
+        conn_close(c->ep, conn);
+        return;
+    }
+    epoll_ctl(c->ep, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+// The reply for a parked connection is in its out buffer: run the frames
+// that queued up behind it.
+static void core_resume(CoreShard *c, Conn *conn) {
+    conn->tpc_parked = 0;
+    if (conn->fd < 0) {
+        conn_free(conn);
+        return;
+    }
+    if (conn_frames(conn) < 0 || conn_flush(c->ep, conn) < 0) core_conn_close(c, conn);
+}
+
+static void tpc_reply_commit(CoreShard *c, Conn *conn, uint8_t st, commit_ts_t ts) {
+    put_frame(&conn->out, st, &ts, sizeof ts);
+    conn->tpc_snap = 0;
+    core_resume(c, conn);
+}
+
+// Replies to the commits whose timestamp has become visible.
+static int core_visible(CoreShard *c) {
+    commit_ts_t visible = atomic_load(&tpc_visible);
+    int done = 0;
+    for (TpcCommit **p = &c->waiting; *p;) {
+        TpcCommit *t = *p;
+        if (t->ts > visible) {
+            p = &t->next;
+            continue;
+        }
+        *p = t->next;
+        tpc_reply_commit(c, t->conn, ST_OK, t->ts);
+        free(t);
+        done = 1;
+    }
+    return done;
+}
+
+// Every part of t is in. Called from the loop, never from inside a
+// connection's frames, so it may resume the connection.
+static void core_installed(CoreShard *c, TpcCommit *t) {
+    tpc_publish(t->ts);
+    if (atomic_load(&tpc_visible) >= t->ts) {
+        tpc_reply_commit(c, t->conn, ST_OK, t->ts);
+        free(t);
+        return;
+    }
+    t->next = c->waiting;
+    c->waiting = t;
+}
+
+// COMMIT from a connection on core c. Installs the local part at once; if
+// other cores own some of the writes, or earlier commits are still being
+// installed, the connection stays parked until the commit is visible
+// (read-your-commit).
+static void core_commit(CoreShard *c, Conn *conn) {
+    KVPair part[MAX_WRITESET];
+    int touched[MAX_WRITESET], count[MAX_WRITESET], n = conn->tpc_nwrites;
+    commit_ts_t ts = conn->tpc_snap;
+    uint8_t st = ST_BUSY;
+    if (!tpc_window_full()) {
+        int nt = tpc_partition(conn->tpc_writes, n, part, touched, count), remote = 0;
+        for (int i=0;i<nt;i++) remote += touched[i] != c->id;
+        ts = atomic_fetch_add(&tpc_clock, 1) + 1;
+        TpcCommit *t = NULL;
+        if (remote) {
+            t = malloc(sizeof *t + remote*sizeof(Msg));
+            memcpy(t->writes, part, n*sizeof(KVPair));
+            t->conn = conn;
+            t->ts = ts;
+            t->pending = 0;
+        }
+        for (int i=0, at=0;i<nt;at+=count[i++]) {
+            if (touched[i] == c->id) {
+                shard_install_all(c, ts, part + at, count[i]);
+                continue;
+            }
+            Msg *m = &t->msgs[t->pending++];
+            *m = (Msg){.type = MSG_INSTALL, .ts = ts, .writes = t->writes + at, .nwrites = count[i],
+                       .reply_to = c, .commit = t};
+            mailbox_push(&tpc_cores[touched[i]], m);
+        }
+        if (t) {
+            conn->tpc_parked = 1;
+            return;
+        }
+        tpc_publish(ts);
+        if (atomic_load(&tpc_visible) < ts) {
+            t = malloc(sizeof *t);
+            t->conn = conn;
+            t->ts = ts;
+            t->next = c->waiting;
+            c->waiting = t;
+            conn->tpc_parked = 1;
+            return;
+        }
+        st = ST_OK;
+    }
+    put_frame(&conn->out, st, &ts, sizeof ts);
+    conn->tpc_snap = 0;
+}
+
+static void core_handle(CoreShard *c, Msg *m) {
+    switch (m->type) {
+    case MSG_READ:
+        m->found = shard_read(c, m->key, &m->ts, m->out, m->outlen);
+        break;
+    case MSG_INSTALL:
+        shard_install_all(c, m->ts, m->writes, m->nwrites);
+        break;
+    case MSG_READ_DONE: {                   // our own request coming back
+        Conn *conn = m->conn;
+        if (!m->found) {
+            put_frame(&conn->out, ST_NOTFOUND, NULL, 0);
+        } else {
+            char resp[sizeof(commit_ts_t) + 128];
+            uint32_t rn = strlen(m->val);
+            memcpy(resp, &m->ts, sizeof m->ts);
+            memcpy(resp + sizeof m->ts, m->val, rn);
+            put_frame(&conn->out, ST_OK, resp, rn + sizeof m->ts);
+        }
+        free(m);
+        core_resume(c, conn);
+        return;
+    }
+    case MSG_INSTALLED:
+        if (--m->commit->pending == 0) core_installed(c, m->commit);
+        return;
+    }
+    c->handled++;
+    if (m->reply_to) {
+        m->type = m->type == MSG_READ ? MSG_READ_DONE : MSG_INSTALLED;
+        mailbox_push(m->reply_to, m);
+    } else {
+        atomic_fetch_sub(m->pending, 1);   // m may be gone after this
+    }
+}
+
+// Recomputes the pin from the connections' open snapshots.
+static void core_repin(CoreShard *c) {
+    commit_ts_t p = INT64_MAX;
+    for (int i=0;i<c->nconns;i++)
+        if (c->conns[i]->tpc_snap && c->conns[i]->tpc_snap < p) p = c->conns[i]->tpc_snap;
+    atomic_store(&c->pin, p);
+}
+
+static void core_accept(CoreShard *c) {
+    int fd, one = 1;
+    while ((fd = accept4(c->lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        Conn *conn = calloc(1, sizeof(Conn));
+        conn->fd = fd;
+        conn->proto = PROTO_BINARY;
+        conn->tpc_core = c;
+        if (c->nconns == c->conns_cap) {
+            c->conns_cap = c->conns_cap ? c->conns_cap*2 : 64;
+            c->conns = realloc(c->conns, c->conns_cap*sizeof(Conn*));
+        }
+        conn->tpc_slot = c->nconns;
+        c->conns[c->nconns++] = conn;
+        struct epoll_event ev = {EPOLLIN, {.ptr = conn}};
+        epoll_ctl(c->ep, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void core_event(CoreShard *c, struct epoll_event *ev) {
+    Conn *conn = ev->data.ptr;
+    if (ev->data.ptr == c) {                // doorbell
+        uint64_t n;
+        if (read(c->efd, &n, 8) < 0) {}
+    } else if (ev->data.ptr == &c->lfd) {
+        core_accept(c);
+    } else if ((ev->events & (EPOLLERR | EPOLLHUP)) && !(ev->events & EPOLLIN)) {
+        core_conn_close(c, conn);
+    } else if ((ev->events & EPOLLIN) && conn_readable(conn) < 0) {
+        core_conn_close(c, conn);
+    } else if (conn_flush(c->ep, conn) < 0) {
+        core_conn_close(c, conn);
+    }
+}
+
+static void* core_loop(void *arg) {
+    CoreShard *c = arg;
+    struct epoll_event ev[64];
+    unsigned rounds = 0;
+    for (;;) {
+        Msg *m;
+        int busy = 0;
+        while ((m = mailbox_pop(c))) {
+            if (m->type == MSG_STOP) {
+                atomic_fetch_sub(m->pending, 1);
+                return NULL;
+            }
+            core_handle(c, m);
+            busy = 1;
+        }
+        busy |= core_visible(c);
+        if (++rounds % 1024 == 0) core_repin(c);
+        // Sleep unless a commit is waiting on other cores to become visible,
+        // which nothing rings the doorbell for.
+        int timeout = 0;
+        if (!busy && !c->waiting) {
+            core_repin(c);
+            atomic_store(&c->sleeping, 1);
+            if (!atomic_load(&c->tail->next) && c->tail == atomic_load(&c->head)) timeout = 100;
+        }
+        int n = epoll_wait(c->ep, ev, 64, timeout);
+        atomic_store(&c->sleeping, 0);
+        for (int i=0;i<n;i++) core_event(c, &ev[i]);
+        if (!n && !timeout && c->waiting) sched_yield();
+    }
+}
+
+// addr NULL: the cores only serve tpc_read and tpc_commit. Otherwise each
+// core also listens on addr and serves the binary protocol.
+int tpc_start(int ncores, const char *addr) {
+    int lfd[TPC_MAX_CORES], shared = addr && strncmp(addr, "unix:", 5) == 0;
+    if (ncores < 1 || ncores > TPC_MAX_CORES) return -1;
+    for (int i=0;i<ncores;i++) {
+        lfd[i] = !addr ? -1 : shared && i ? lfd[0] : server_listen_opt(addr, 1);
+        if (addr && lfd[i] < 0) {
+            for (int j=0;j<i;j++) if (!shared || !j) close(lfd[j]);
+            return -1;
+        }
+    }
+    tpc_ncores = ncores;
+    tpc_cores = calloc(ncores, sizeof(CoreShard));
+    atomic_store(&tpc_clock, 1);
+    atomic_store(&tpc_visible, 1);
+    for (int i=0;i<ncores;i++) {
+        CoreShard *c = &tpc_cores[i];
+        c->id = i;
+        c->head = c->tail = &c->stub;
+        c->index_slots = 4096;
+        c->index = calloc(c->index_slots, sizeof(int));
+        c->pin = INT64_MAX;
+        c->ep = epoll_create1(0);
+        c->efd = eventfd(0, EFD_NONBLOCK);
+        c->lfd = lfd[i];
+        struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+        epoll_ctl(c->ep, EPOLL_CTL_ADD, c->efd, &ev);
+        if (c->lfd >= 0) {
+            struct epoll_event lev = {EPOLLIN | (shared ? EPOLLEXCLUSIVE : 0), {.ptr = &c->lfd}};
+            epoll_ctl(c->ep, EPOLL_CTL_ADD, c->lfd, &lev);
+        }
+    }
+    for (int i=0;i<ncores;i++) pthread_create(&tpc_cores[i].thread, NULL, core_loop, &tpc_cores[i]);
+    return 0;
+}
+
+static void tpc_wait(atomic_int *pending) {
+    while (atomic_load(pending) > 0) sched_yield();
+}
+
+void tpc_stop(void) {
+    for (int i=0;i<tpc_ncores;i++) {
+        atomic_int pending = 1;
+        Msg m = {.type = MSG_STOP, .pending = &pending};
+        mailbox_push(&tpc_cores[i], &m);
+        pthread_join(tpc_cores[i].thread, NULL);
+    }
+    // Replies still in flight when the cores stopped are lost with them.
+    for (int i=0;i<tpc_ncores;i++) {
+        CoreShard *c = &tpc_cores[i];
+        for (int k=0;k<c->nkeys;k++) {
+            Version *v = c->keys[k].versions;
+            while (v) {
+                Version *next = v->next;
+                free(v->value);
+                free(v);
+                v = next;
+            }
+        }
+        for (int k=0;k<c->nconns;k++) conn_close(c->ep, c->conns[k]);
+        while (c->waiting) {
+            TpcCommit *t = c->waiting;
+            c->waiting = t->next;
+            free(t);
+        }
+        if (c->lfd >= 0 && (i == 0 || c->lfd != tpc_cores[0].lfd)) close(c->lfd);
+        free(c->conns);
+        free(c->keys);
+        free(c->index);
+        close(c->ep);
+        close(c->efd);
+    }
+    free(tpc_cores);
+    tpc_cores = NULL;
+    tpc_ncores = 0;
+}
+
+// Snapshot: every commit at or below it is installed on all its shards.
+// The calling thread's chains are pinned at it until tpc_end; a second
+// tpc_begin moves the pin.
+commit_ts_t tpc_begin(void) {
+    while (tpc_pin_slot < 0) {
+        for (int i=0;i<TPC_MAX_PINS && tpc_pin_slot < 0;i++) {
+            commit_ts_t free_slot = 0;
+            if (atomic_compare_exchange_strong(&tpc_pins[i], &free_slot, 1)) tpc_pin_slot = i;
+        }
+        if (tpc_pin_slot < 0) sched_yield();
+    }
+    return tpc_pin(&tpc_pins[tpc_pin_slot]);
+}
+
+void tpc_end(void) {
+    if (tpc_pin_slot < 0) return;
+    atomic_store(&tpc_pins[tpc_pin_slot], 0);
+    tpc_pin_slot = -1;
+}
+
+// Called from non-core threads only: the caller blocks until the owner replies.
+// snapshot must be pinned (tpc_begin). found_ts (optional) gets the commit ts
+// of the version read.
+int tpc_read(commit_ts_t snapshot, const char *key, char *out, size_t outlen, commit_ts_t *found_ts) {
+    atomic_int pending = 1;
+    Msg m = {.type = MSG_READ, .ts = snapshot, .key = key, .out = out, .outlen = outlen,
+             .pending = &pending};
+    mailbox_push(&tpc_cores[tpc_owner(key)], &m);
+    tpc_wait(&pending);
+    if (m.found && found_ts) *found_ts = m.ts;
+    return m.found;
+}
+
+// Called from non-core threads only. Returns the commit ts, or -1 (errno
+// E2BIG) for more than MAX_WRITESET writes.
+commit_ts_t tpc_commit(const KVPair *writes, int n) {
+    KVPair part[MAX_WRITESET];
+    int count[MAX_WRITESET], touched[MAX_WRITESET];
+    if (n > MAX_WRITESET) {
+        errno = E2BIG;
+        return -1;
+    }
+    int nt = tpc_partition(writes, n, part, touched, count);
+    while (tpc_window_full()) sched_yield();
+    commit_ts_t ts = atomic_fetch_add(&tpc_clock, 1) + 1;
+    atomic_int pending = nt;
+    Msg msgs[MAX_WRITESET];
+    for (int i=0, at=0;i<nt;at+=count[i++]) {
+        msgs[i] = (Msg){.type = MSG_INSTALL, .ts = ts, .writes = part + at, .nwrites = count[i],
+                        .pending = &pending};
+        mailbox_push(&tpc_cores[touched[i]], &msgs[i]);
+    }
+    tpc_wait(&pending);
+    tpc_publish(ts);
+    while (atomic_load(&tpc_visible) < ts) sched_yield();  // read-your-commit
+    return ts;
+}
+
+// The binary protocol on the cores (server --cores), run by the core that
+// accepted the connection. A transaction reads at the snapshot it began
+// with, pinned on that core, and buffers its writes until COMMIT. A read or
+// commit that needs another core parks the connection; its later frames
+// run once the reply is in. Nothing is validated: of two transactions
+// writing a key both commit and the later timestamp wins. The cores keep no
+// log, so 2PC and replication stay with the shared engine. READ_AT below
+// the GC horizon may find a trimmed chain.
+static void tpc_exec(Conn *c, uint8_t op, const char *p, uint32_t n) {
+    static _Atomic txid_t next_id = 1;
+    CoreShard *core = c->tpc_core;
+    char resp[256], key[MAX_KEYNAME], val[128];
+    uint8_t st = ST_OK;
+    uint32_t rn = 0;
+    commit_ts_t ts;
+    switch (op) {
+    case OP_BEGIN: {
+        txid_t id = atomic_fetch_add(&next_id, 1);
+        if (!c->tpc_writes) c->tpc_writes = malloc(MAX_WRITESET*sizeof(KVPair));
+        // Open snapshots here are all at or above the pin; only an unpinned
+        // core has to publish.
+        c->tpc_snap = atomic_load(&core->pin) == INT64_MAX ? tpc_pin(&core->pin) : atomic_load(&tpc_visible);
+        c->tpc_nwrites = 0;
+        memcpy(resp, &id, sizeof id);
+        memcpy(resp + sizeof id, &c->tpc_snap, sizeof ts);
+        rn = sizeof id + sizeof ts;
+        break;
+    }
+    case OP_READ:
+    case OP_READ_AT: {
+        if (op == OP_READ) {
+            if (!c->tpc_snap || n >= MAX_KEYNAME) { st = ST_ERR; break; }
+            ts = c->tpc_snap;
+        } else {
+            if (n <= sizeof ts || n - sizeof ts >= MAX_KEYNAME) { st = ST_ERR; break; }
+            memcpy(&ts, p, sizeof ts);
+            p += sizeof ts, n -= sizeof ts;
+        }
+        memcpy(key, p, n); key[n] = 0;
+        int o = tpc_owner(key);
+        if (o != core->id) {
+            Msg *m = calloc(1, sizeof(Msg));
+            m->type = MSG_READ;
+            m->ts = ts;
+            memcpy(m->name, key, n + 1);
+            m->key = m->name;
+            m->out = m->val;
+            m->outlen = sizeof m->val;
+            m->reply_to = core;
+            m->conn = c;
+            c->tpc_parked = 1;
+            mailbox_push(&tpc_cores[o], m);
+            return;
+        }
+        if (!shard_read(core, key, &ts, val, sizeof val)) { st = ST_NOTFOUND; break; }
+        memcpy(resp, &ts, sizeof ts);
+        rn = strlen(val);
+        memcpy(resp + sizeof ts, val, rn);
+        rn += sizeof ts;
+        break;
+    }
+    case OP_WRITE: {
+        uint8_t kl = n ? (uint8_t)p[0] : 0;
+        int i = 0;
+        if (!c->tpc_snap || !n || kl >= MAX_KEYNAME || 1u + kl > n || n - 1 - kl > 127) { st = ST_ERR; break; }
+        memcpy(key, p+1, kl); key[kl] = 0;
+        while (i < c->tpc_nwrites && strcmp(c->tpc_writes[i].key, key) != 0) i++;
+        if (i == MAX_WRITESET) { st = ST_ERR; break; }
+        if (i == c->tpc_nwrites) c->tpc_nwrites++;
+        KVPair *w = &c->tpc_writes[i];
+        strcpy(w->key, key);
+        memcpy(w->value, p+1+kl, n-1-kl); w->value[n-1-kl] = 0;
+        w->expires_ms = 0;
+        break;
+    }
+    case OP_COMMIT:
+        if (!c->tpc_snap) { st = ST_ERR; break; }
+        if (c->tpc_nwrites) {
+            core_commit(core, c);
+            return;
+        }
+        memcpy(resp, &c->tpc_snap, sizeof ts);
+        rn = sizeof ts;
+        c->tpc_snap = 0;
+        break;
+    case OP_ABORT:
+        if (!c->tpc_snap) st = ST_ERR;
+        c->tpc_snap = 0;
+        break;
+    case OP_STATUS:
+        ts = atomic_load(&tpc_visible);
+        memset(resp, 0, sizeof ts + 8);
+        memcpy(resp, &ts, sizeof ts);
+        rn = sizeof ts + 8;
+        break;
+    default:
+        st = ST_ERR;
+    }
+    put_frame(&c->out, st, resp, rn);
+}
+
+// ===== Transaction Scheduler =====
+// Runs transaction closures on a pool of workers, each with its own deque.
+// A worker pops the newest job from the bottom of its deque, since that
+// job's data is likely still in cache. When its deque is empty, it steals
+// the oldest job of a random other worker. A job whose commit fails
+// validation goes back on the worker that ran it, for another attempt at
+// a fresh snapshot. One that tx_begin sheds goes back after a short sleep,
+// without using up an attempt.
+// With place_by_key, a job submitted with a key goes to the worker that
+// owns the key's hash. Transactions on the same hot key then run one after
+// another instead of aborting each other. Such a job is stolen only from
+// a worker with more than SCHED_STEAL_AFFINE jobs queued.
+#define SCHED_MAX_WORKERS 64
+#define SCHED_STEAL_AFFINE 8
+#define SCHED_MAX_ATTEMPTS 64
+#define SCHED_SHED_US 100          // backoff after tx_begin sheds a job
+
+typedef int (*tx_fn)(Transaction *tx, void *arg);      // 0 commits, else aborts
+// rc: 0 committed at ts, -1 aborted by the closure or out of attempts
+typedef void (*sched_done_cb)(int rc, commit_ts_t ts, int attempts, void *arg);
+
+typedef struct SchedJob {
+    tx_fn fn;
+    void *arg;
+    sched_done_cb done;
+    int affine;                // placed by key
+    int attempts;
+} SchedJob;
+
+// Ring of jobs; the owner works the bottom, thieves take the top.
+typedef struct SchedDeque {
+    pthread_mutex_t lock;
+    SchedJob **ring;
+    long cap;
+    atomic_long top, bottom;
+} __attribute__((aligned(64))) SchedDeque;
+
+typedef struct Scheduler Scheduler;
+
+typedef struct SchedWorker {
+    Scheduler *s;
+    int id;
+    unsigned seed;
+    pthread_t th;
+} SchedWorker;
+
+struct Scheduler {
+    int n;
+    int steal;                 // 0: workers only run their own deque
+    int place_by_key;          // 0: keys are ignored, jobs go round-robin
+    SchedDeque q[SCHED_MAX_WORKERS];
+    SchedWorker w[SCHED_MAX_WORKERS];
+    atomic_uint next;          // round-robin cursor
+    atomic_long queued;
+    atomic_int running, sleepers;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    atomic_long commits, aborts, retries, steals;
+};
+
+static void deque_push(SchedDeque *d, SchedJob *j) {
+    pthread_mutex_lock(&d->lock);
+    long top = atomic_load(&d->top), bottom = atomic_load(&d->bottom);
+    if (bottom - top == d->cap) {
+        long cap = d->cap ? 2*d->cap : 256;
+        SchedJob **ring = malloc(cap*sizeof(SchedJob*));
+        for (long i=top;i<bottom;i++) ring[i % cap] = d->ring[i % d->cap];
+        free(d->ring);
+        d->ring = ring;
+        d->cap = cap;
+    }
+    d->ring[bottom % d->cap] = j;
+    atomic_store(&d->bottom, bottom + 1);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static SchedJob* deque_pop(SchedDeque *d) {
+    SchedJob *j = NULL;
+    if (atomic_load(&d->bottom) == atomic_load(&d->top)) return NULL;
+    pthread_mutex_lock(&d->lock);
+    long bottom = atomic_load(&d->bottom);
+    if (bottom > atomic_load(&d->top)) {
+        j = d->ring[(bottom - 1) % d->cap];
+        atomic_store(&d->bottom, bottom - 1);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return j;
+}
+
+static SchedJob* deque_steal(SchedDeque *d) {
+    SchedJob *j = NULL;
+    if (atomic_load(&d->bottom) == atomic_load(&d->top)) return NULL;
+    pthread_mutex_lock(&d->lock);
+    long top = atomic_load(&d->top), bottom = atomic_load(&d->bottom);
+    if (bottom > top) {
+        j = d->ring[top % d->cap];
+        if (j->affine && bottom - top <= SCHED_STEAL_AFFINE) j = NULL;
+        else atomic_store(&d->top, top + 1);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return j;
+}
+
+static void sched_enqueue(Scheduler *s, int w, SchedJob *j) {
+    atomic_fetch_add(&s->queued, 1);
+    deque_push(&s->q[w], j);
+    if (atomic_load(&s->sleepers)) {
+        pthread_mutex_lock(&s->idle_lock);
+        pthread_cond_broadcast(&s->idle_cond);
+        pthread_mutex_unlock(&s->idle_lock);
+    }
+}
+
+// Queues fn to run as a transaction. key, if not NULL, is the (hot) key the
+// transaction mostly touches. done runs on the worker when the job ends.
+void sched_submit(Scheduler *s, tx_fn fn, void *arg, const char *key, sched_done_cb done) {
+    SchedJob *j = malloc(sizeof(SchedJob));
+    *j = (SchedJob){fn, arg, done, key && s->place_by_key, 0};
+    int w = j->affine ? (int)(key_hash(key) % s->n) : (int)(atomic_fetch_add(&s->next, 1) % s->n);
+    sched_enqueue(s, w, j);
+}
+
+static SchedJob* sched_find(SchedWorker *w) {
+    Scheduler *s = w->s;
+    SchedJob *j = deque_pop(&s->q[w->id]);
+    if (!j && s->steal && s->n > 1) {
+        int start = rand_r(&w->seed) % s->n;
+        for (int i=0;i<s->n && !j;i++) {
+            int v = (start + i) % s->n;
+            if (v != w->id && (j = deque_steal(&s->q[v]))) atomic_fetch_add(&s->steals, 1);
+        }
+    }
+    if (j) atomic_fetch_sub(&s->queued, 1);
+    return j;
+}
+
+static void sched_run(SchedWorker *w, SchedJob *j) {
+    Scheduler *s = w->s;
+    Transaction *tx = tx_begin();
+    int rc = -1, retry = 0;
+    commit_ts_t ts = 0;
+    if (!tx) {                         // shed: not an attempt
+        usleep(SCHED_SHED_US);
+        sched_enqueue(s, w->id, j);
+        return;
+    }
+    j->attempts++;
+    if (j->fn(tx, j->arg) != 0) {
+        if (tx->state == TX_ACTIVE) tx_abort(tx);
+    } else if (tx_commit(tx) == 0) {
+        rc = 0;
+        ts = tx->commit_ts;
+    } else retry = 1;
+    free(tx);
+    if (retry && j->attempts < SCHED_MAX_ATTEMPTS) {
+        atomic_fetch_add(&s->retries, 1);
+        sched_enqueue(s, w->id, j);
+        return;
+    }
+    atomic_fetch_add(rc == 0 ? &s->commits : &s->aborts, 1);
+    if (j->done) j->done(rc, ts, j->attempts, j->arg);
+    free(j);
+}
+
+static void* sched_worker(void *arg) {
+    SchedWorker *w = arg;
+    Scheduler *s = w->s;
+    SchedDeque *own = &s->q[w->id];
+    for (;;) {
+        SchedJob *j = sched_find(w);
+        if (j) { sched_run(w, j); continue; }
+        // Sleep until there is something this worker may run. sleepers is
+        // raised before the re-check, and sched_enqueue reads it after its
+        // push, so a wakeup can't be missed.
+        pthread_mutex_lock(&s->idle_lock);
+        atomic_fetch_add(&s->sleepers, 1);
+        if (s->steal && atomic_load(&s->queued) && atomic_load(&s->running)) {
+            // Only jobs we may not steal are queued: back off briefly.
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_nsec += 200000;
+            if (t.tv_nsec >= 1000000000) { t.tv_sec++; t.tv_nsec -= 1000000000; }
+            pthread_cond_timedwait(&s->idle_cond, &s->idle_lock, &t);
+        }
+        while (atomic_load(&s->running) &&
+               (s->steal ? !atomic_load(&s->queued) : atomic_load(&own->bottom) == atomic_load(&own->top)))
+            pthread_cond_wait(&s->idle_cond, &s->idle_lock);
+        atomic_fetch_sub(&s->sleepers, 1);
+        int stopping = !atomic_load(&s->running);
+        pthread_mutex_unlock(&s->idle_lock);
+        if (stopping && !atomic_load(&s->queued)) break;
+        if (stopping) sched_yield();   // others are draining their deques
+    }
+    return NULL;
+}
+
+Scheduler* sched_start(int nworkers, int steal, int place_by_key) {
+    Scheduler *s = aligned_alloc(_Alignof(Scheduler), sizeof(Scheduler));    // the deques are cache-line aligned
+    memset(s, 0, sizeof(Scheduler));
+    s->n = nworkers < 1 ? 1 : nworkers > SCHED_MAX_WORKERS ? SCHED_MAX_WORKERS : nworkers;
+    s->steal = steal;
+    s->place_by_key = place_by_key;
+    atomic_store(&s->running, 1);
+    pthread_mutex_init(&s->idle_lock, NULL);
+    pthread_cond_init(&s->idle_cond, NULL);
+    for (int i=0;i<s->n;i++) {
+        pthread_mutex_init(&s->q[i].lock, NULL);
+        s->w[i] = (SchedWorker){s, i, 2654435761u*(i+1), 0};
+    }
+    for (int i=0;i<s->n;i++) pthread_create(&s->w[i].th, NULL, sched_worker, &s->w[i]);
+    return s;
+}
+
+// Runs what is queued, then stops the workers and frees s.
+void sched_stop(Scheduler *s) {
+    pthread_mutex_lock(&s->idle_lock);
+    atomic_store(&s->running, 0);
+    pthread_cond_broadcast(&s->idle_cond);
+    pthread_mutex_unlock(&s->idle_lock);
+    for (int i=0;i<s->n;i++) pthread_join(s->w[i].th, NULL);
+    for (int i=0;i<s->n;i++) {
+        pthread_mutex_destroy(&s->q[i].lock);
+        free(s->q[i].ring);
+    }
+    free(s);
+}
+
+// ===== Benchmarks =====
+static void bench_lsm(void) {
+    char dir[64];
+    snprintf(dir, sizeof dir, "/tmp/mvcc-lsm-%d", getpid());
+    trace = 0;
+    lsm_memtable_limit = 256L<<10;
+    if (lsm_open(dir) < 0) { printf("cannot open %s\n", dir); return; }
+
+    const int nkeys = 20000, ntx = 100000;
+    char key[MAX_KEYNAME], val[32];
+    srand(42);
+    uint64_t t0 = now_ns();
+    Transaction *old = NULL;
+    for (int i=0;i<ntx;i++) {
+        if (i % 20000 == 0) {            // a long reader pins the watermark for a while
+            if (old) tx_commit(old);
+            old = tx_begin();
+        }
+        Transaction *tx = tx_begin();
+        for (int j=0;j<4;j++) {
+            snprintf(key, sizeof key, "k%d", rand() % nkeys);
+            snprintf(val, sizeof val, "v%d-%d", i, j);
+            tx_write(tx, key, val);
+        }
+        tx_commit(tx);
+    }
+    tx_commit(old);
+    double secs = (now_ns() - t0)/1e9;
+    printf("loaded %d tx (%d writes) in %.2fs: %.0f commits/s\n", ntx, ntx*4, secs, ntx/secs);
+
+    char out[128];
+    commit_ts_t ts;
+    int hits = 0;
+    Transaction *rd = tx_begin();
+    t0 = now_ns();
+    for (int i=0;i<50000;i++) {
+        snprintf(key, sizeof key, "k%d", rand() % nkeys);
+        hits += mvcc_lookup(key, rd->start_ts, out, sizeof out, &ts);
+    }
+    printf("50000 snapshot reads: %d hits, %.2f us/read\n", hits, (now_ns()-t0)/1e3/50000);
+    tx_commit(rd);
+    lsm_report();
+    lsm_close();
+}
+
+// Negative point lookups and prefix scans for keys that fall inside every
+// table's key range, with and without filters.
+static void bench_filter(void) {
+    int bits[] = {0, 4, 10};
+    char dir[64], key[MAX_KEYNAME], val[32], out[128];
+    commit_ts_t ts;
+    trace = 0;
+    lsm_memtable_limit = 64L<<10;
+    for (int r=0;r<3;r++) {
+        snprintf(dir, sizeof dir, "/tmp/mvcc-filter-%d-%d", getpid(), bits[r]);
+        lsm_bloom_bits = bits[r];
+        if (lsm_open(dir) < 0) { printf("cannot open %s\n", dir); return; }
+        srand(7);
+        for (int i=0;i<40000;i++) {        // even users only
+            Transaction *tx = tx_begin();
+            snprintf(key, sizeof key, "u%03d:%d", rand() % 500 * 2, rand() % 20);
+            snprintf(val, sizeof val, "v%d", i);
+            tx_write(tx, key, val);
+            tx_commit(tx);
+        }
+        pthread_mutex_lock(&global_lock);
+        lsm_flush();
+        pthread_mutex_unlock(&global_lock);
+        int tables = 0;
+        for (int l=0;l<LSM_MAX_LEVELS;l++) tables += level_count[l];
+
+        long io0 = lsm_stats.block_reads;
+        uint64_t t0 = now_ns();
+        int hits = 0;
+        for (int i=0;i<50000;i++) {
+            snprintf(key, sizeof key, "u%03d:%d", rand() % 500 * 2 + 1, rand() % 20);
+            hits += mvcc_lookup(key, global_commit_ts, out, sizeof out, &ts);
+        }
+        double point_us = (now_ns()-t0)/1e3/50000;
+        long point_io = lsm_stats.block_reads - io0;
+
+        io0 = lsm_stats.block_reads;
+        t0 = now_ns();
+        for (int i=0;i<5000;i++) {
+            ScanResult sr;
+            snprintf(key, sizeof key, "u%03d", rand() % 500 * 2 + 1);
+            hits += mvcc_scan(key, global_commit_ts, &sr);
+            free(sr.hits);
+        }
+        printf("bits/key=%2d tables=%d: negative get %.2f us, %.2f I/O; "
+               "empty prefix scan %.2f us, %.2f I/O (hits=%d)\n",
+               bits[r], tables, point_us, (double)point_io/50000,
+               (now_ns()-t0)/1e3/5000, (double)(lsm_stats.block_reads - io0)/5000, hits);
+        lsm_close();
+    }
+}
+
+static void cache_totals(long *hits, long *misses) {
+    *hits = *misses = 0;
+    for (int i=0;i<CACHE_SHARDS;i++) {
+        *hits += cache_shards[i].hits;
+        *misses += cache_shards[i].misses;
+    }
+}
+
+// Hot-set point reads interleaved with historical scans several times larger
+// than the cache, under S3-FIFO and plain FIFO eviction.
+static void bench_cache(void) {
+    const char *names[] = {"s3-fifo", "fifo"};
+    cache_policy_t policies[] = {CACHE_S3FIFO, CACHE_FIFO};
+    char dir[64], key[MAX_KEYNAME], val[64], out[128];
+    commit_ts_t ts;
+    trace = 0;
+    lsm_memtable_limit = 4L<<20;
+    for (int r=0;r<2;r++) {
+        snprintf(dir, sizeof dir, "/tmp/mvcc-cache-%d-%s", getpid(), names[r]);
+        block_cache_policy = policies[r];
+        block_cache_init(256L<<10);
+        if (lsm_open(dir) < 0) { printf("cannot open %s\n", dir); return; }
+        commit_ts_t old_ts = 0;
+        for (int i=0;i<40000;i++) {
+            Transaction *tx = tx_begin();
+            snprintf(key, sizeof key, "k%05d", i);
+            snprintf(val, sizeof val, "value-%d-padding-padding", i);
+            tx_write(tx, key, val);
+            tx_commit(tx);
+            if (i == 20000) old_ts = global_commit_ts;
+        }
+        pthread_mutex_lock(&global_lock);
+        lsm_flush();
+        pthread_mutex_unlock(&global_lock);
+
+        srand(11);
+        long h0, m0, h1, m1, ph = 0, pm = 0;
+        uint64_t point_ns = 0, scan_ns = 0;
+        int scans = 0;
+        for (int i=0;i<200000;i++) {
+            if (i % 1000 == 999) {
+                ScanResult sr;
+                snprintf(key, sizeof key, "k%d", 1 + rand() % 3);
+                uint64_t t0 = now_ns();
+                mvcc_scan(key, old_ts, &sr);
+                scan_ns += now_ns() - t0;
+                free(sr.hits);
+                scans++;
+                continue;
+            }
+            int k = rand() % 10 ? rand() % 2000 : rand() % 40000;
+            snprintf(key, sizeof key, "k%05d", k);
+            cache_totals(&h0, &m0);
+            uint64_t t0 = now_ns();
+            mvcc_lookup(key, global_commit_ts, out, sizeof out, &ts);
+            point_ns += now_ns() - t0;
+            cache_totals(&h1, &m1);
+            ph += h1 - h0;
+            pm += m1 - m0;
+        }
+        printf("%-7s point reads: %.1f%% cache hit, %.2f us; %d scans: %.0f us each\n",
+               names[r], 100.0*ph/(ph+pm), point_ns/1e3/(200000-scans), scans,
+               scan_ns/1e3/scans);
+        block_cache_report();
+        lsm_close();
+    }
+}
+
+// RESP on an in-process server: one connection, then redis-benchmark's
+// defaults with and without pipelining.
+static void bench_resp(void) {
+    char addr[64];
+    snprintf(addr, sizeof addr, "unix:/tmp/mvcc-resp-%d.sock", getpid());
+    trace = 0;
+    int lfd = server_listen(addr);
+    if (lfd < 0) { printf("cannot listen on %s\n", addr); return; }
+    pthread_t th;
+    ServerArgs sa = {lfd, PROTO_RESP};
+    pthread_create(&th, NULL, server_thread, &sa);
+    loadgen(addr, PROTO_RESP, 0, 1, 1, 1.0);
+    loadgen(addr, PROTO_RESP, 0, 50, 1, 1.0);     // redis-benchmark defaults
+    loadgen(addr, PROTO_RESP, 0, 50, 16, 1.0);    // redis-benchmark -P 16
+    server_stop = 1;
+    pthread_join(th, NULL);
+    close(lfd);
+    unlink(addr+5);
+}
+
+// In-process server on a Unix socket driven at increasing connection counts.
+static void bench_server(void) {
+    char addr[64];
+    int conns[] = {1, 4, 16, 64};
+    snprintf(addr, sizeof addr, "unix:/tmp/mvcc-%d.sock", getpid());
+    trace = 0;
+    int lfd = server_listen(addr);
+    if (lfd < 0) { printf("cannot listen on %s\n", addr); return; }
+    pthread_t th;
+    ServerArgs sa = {lfd, PROTO_BINARY};
+    pthread_create(&th, NULL, server_thread, &sa);
+    for (int i=0;i<4;i++) loadgen(addr, PROTO_BINARY, 0, conns[i], 1, 1.0);
+    loadgen(addr, PROTO_BINARY, 0, 16, 8, 1.0);
+    server_stop = 1;
+    pthread_join(th, NULL);
+    close(lfd);
+    unlink(addr+5);
+}
+
+// The binary protocol over TCP against server --cores N, where every core
+// runs its own listener and event loop, and against the shared-everything
+// server's single event loop, with four connections per core.
+static void bench_tpc(void) {
+    char addr[64];
+    snprintf(addr, sizeof addr, "tcp:127.0.0.1:%d", 20000 + getpid() % 20000);
+    trace = 0;
+    printf("%ld CPUs online\n", sysconf(_SC_NPROCESSORS_ONLN));
+    for (int cores=1;cores<=TPC_MAX_CORES;cores*=2) {
+        printf("cores=%2d thread-per-core   ", cores);
+        fflush(stdout);
+        if (tpc_start(cores, addr) < 0) { printf("cannot listen on %s\n", addr); return; }
+        loadgen(addr, PROTO_BINARY, 0, 4*cores, 1, 0.5);
+        long handled = 0, collected = 0;
+        for (int i=0;i<cores;i++) handled += tpc_cores[i].handled, collected += tpc_cores[i].collected;
+        printf("         forwarded %ld ops, collected %ld versions\n", handled, collected);
+        tpc_stop();
+
+        printf("cores=%2d shared-everything ", cores);
+        fflush(stdout);
+        int lfd = server_listen(addr);
+        if (lfd < 0) { printf("cannot listen on %s\n", addr); return; }
+        pthread_t th;
+        ServerArgs sa = {lfd, PROTO_BINARY};
+        server_stop = 0;
+        pthread_create(&th, NULL, server_thread, &sa);
+        loadgen(addr, PROTO_BINARY, 0, 4*cores, 1, 0.5);
+        server_stop = 1;
+        pthread_join(th, NULL);
+        close(lfd);
+    }
+    server_stop = 0;
+    memtable_clear();
+}
+
+typedef struct WriterArgs {
+    uint64_t deadline;
+    long txs;
+} WriterArgs;
+
+static void* repl_writer(void *arg) {
+    WriterArgs *a = arg;
+    unsigned seed = (unsigned)(uintptr_t)a;
+    char key[MAX_KEYNAME], val[32];
+    while (now_ns() < a->deadline) {
+        Transaction *tx = tx_begin();
+        for (int i=0;i<2;i++) {
+            snprintf(key, sizeof key, "k%d", rand_r(&seed) % 10000);
+            snprintf(val, sizeof val, "v%ld", a->txs);
+            tx_write(tx, key, val);
+        }
+        tx_commit(tx);
+        free(tx);
+        a->txs++;
+    }
+    return NULL;
+}
+
+// Two follower processes on the same host: lag while the primary commits
+// flat out, catch-up time, then read throughput served by a follower.
+static void bench_repl(void) {
+    char primary[64], faddr[2][64];
+    pid_t pids[2];
+    trace = 0;
+    snprintf(primary, sizeof primary, "unix:/tmp/mvcc-repl-%d.sock", getpid());
+    for (int i=0;i<2;i++) {
+        snprintf(faddr[i], sizeof faddr[i], "unix:/tmp/mvcc-follower-%d-%d.sock", getpid(), i);
+        if ((pids[i] = fork()) == 0) {
+            follower_run(primary, faddr[i]);
+            _exit(0);
+        }
+    }
+    if (repl_start(primary) < 0) { printf("cannot listen on %s\n", primary); return; }
+    int fd = -1;
+    for (int i=0;i<100 && fd < 0;i++)
+        if ((fd = client_connect(faddr[0])) < 0) usleep(50000);
+    if (fd < 0) { printf("follower did not start\n"); return; }
+
+    WriterArgs wa[2];
+    pthread_t th[2];
+    uint64_t t0 = now_ns();
+    for (int i=0;i<2;i++) {
+        wa[i] = (WriterArgs){t0 + 2000000000ull, 0};
+        pthread_create(&th[i], NULL, repl_writer, &wa[i]);
+    }
+    uint64_t lags[4096], lag;
+    long gaps = 0, n = 0;
+    commit_ts_t fts;
+    while (now_ns() < t0 + 2000000000ull && n < 4096) {
+        if (repl_status(fd, &fts, &lag) < 0) break;
+        gaps += global_commit_ts - fts;
+        lags[n++] = lag;
+        usleep(1000);
+    }
+    for (int i=0;i<2;i++) pthread_join(th[i], NULL);
+    uint64_t t1 = now_ns();
+    do repl_status(fd, &fts, &lag); while (fts < global_commit_ts && now_ns() - t1 < 10000000000ull);
+    qsort(lags, n, sizeof(uint64_t), cmp_u64);
+    printf("primary: %.0f commits/s; follower lag over %ld samples: p50=%.1f us p99=%.1f us "
+           "max=%.1f us, avg %.1f commits behind; caught up %.1f ms after writes stopped\n",
+           (wa[0].txs + wa[1].txs)/((t1 - t0)/1e9), n, n ? lags[n/2]/1e3 : 0,
+           n ? lags[n*99/100]/1e3 : 0, n ? lags[n-1]/1e3 : 0, n ? (double)gaps/n : 0,
+           (now_ns() - t1)/1e6);
+    close(fd);
+    pthread_mutex_lock(&repl_lock);
+    printf("replication log: %zu KB kept of %.1f MB streamed\n", repl_len >> 10,
+           (repl_base + repl_len)/1048576.0);
+    pthread_mutex_unlock(&repl_lock);
+
+    // A follower joining now is seeded from a snapshot, not from the log.
+    char late[64];
+    snprintf(late, sizeof late, "unix:/tmp/mvcc-follower-%d-late.sock", getpid());
+    pid_t lpid = fork();
+    if (lpid == 0) {
+        follower_run(primary, late);
+        _exit(0);
+    }
+    t1 = now_ns();
+    fd = -1;
+    for (int i=0;i<100 && fd < 0;i++)
+        if ((fd = client_connect(late)) < 0) usleep(10000);
+    fts = -1;
+    while (fd >= 0 && repl_status(fd, &fts, &lag) == 0 && fts < global_commit_ts && now_ns() - t1 < 10000000000ull)
+        usleep(1000);
+    printf("late follower at ts=%" PRId64 " of %" PRId64 " %.1f ms after it started\n", fts,
+           global_commit_ts, (now_ns() - t1)/1e6);
+    if (fd >= 0) close(fd);
+    kill(lpid, SIGTERM);
+    waitpid(lpid, NULL, 0);
+    unlink(late+5);
+    printf("follower read throughput:\n");
+    for (int c=1;c<=16;c*=4) loadgen(faddr[0], PROTO_BINARY, 1, c, 1, 1.0);
+    loadgen(faddr[0], PROTO_BINARY, 1, 16, 8, 1.0);
+    for (int i=0;i<2;i++) {
+        kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+        unlink(faddr[i]+5);
+    }
+    unlink(primary+5);
+}
+
+typedef struct CdcReader {
+    CdcSub *sub;
+    atomic_int *stop;
+    long events, out_of_order;
+    int overrun;
+    int delay_us;              // per event, to play a slow consumer
+} CdcReader;
+
+static void* cdc_reader(void *arg) {
+    CdcReader *r = arg;
+    CdcEvent ev;
+    commit_ts_t last = 0;
+    for (;;) {
+        int rc = cdc_poll(r->sub, &ev);
+        if (rc > 0) {
+            if (ev.commit_ts < last) r->out_of_order++;
+            last = ev.commit_ts;
+            r->events++;
+            if (r->delay_us) usleep(r->delay_us);
+        } else if (rc < 0) {
+            r->overrun = 1;
+            break;
+        } else if (atomic_load(r->stop)) break;
+        else sched_yield();
+    }
+    return NULL;
+}
+
+// Resume from a timestamp inside the WAL, then commit throughput with 0, 1
+// and 4 subscribers draining small rings, and with one subscriber that
+// takes 20 us per event, which the commits have to slow down to.
+static void bench_cdc(void) {
+    char dir[64], key[MAX_KEYNAME], val[32];
+    CdcEvent ev;
+    trace = 0;
+    snprintf(dir, sizeof dir, "/tmp/mvcc-cdc-%d", getpid());
+    lsm_memtable_limit = 64L<<10;
+    if (lsm_open(dir) < 0) { printf("cannot open %s\n", dir); return; }
+    for (int i=0;i<6000;i++) {
+        Transaction *tx = tx_begin();
+        snprintf(key, sizeof key, "k%d", i % 500);
+        snprintf(val, sizeof val, "v%d", i);
+        tx_write(tx, key, val);
+        tx_commit(tx);
+    }
+    commit_ts_t from = global_commit_ts - 100;
+    CdcSub *old = cdc_subscribe(wal_base_ts > 0 ? wal_base_ts - 1 : 0, 64);
+    if (old) cdc_unsubscribe(old);
+    CdcSub *s = cdc_subscribe(from, 64);
+    long n = 0, bad = 0;
+    commit_ts_t expect = from;
+    if (s) {
+        for (int i=0;i<50;i++) {
+            Transaction *tx = tx_begin();
+            tx_write(tx, "live", "x");
+            tx_commit(tx);
+        }
+        while (cdc_poll(s, &ev) > 0) {
+            if (ev.commit_ts != ++expect) bad++;
+            n++;
+        }
+        cdc_unsubscribe(s);
+    }
+    printf("resume from ts %" PRId64 " (WAL starts after %" PRId64 "): %ld events, %ld gaps/reorders; "
+           "resume before the WAL %s\n", from, wal_base_ts, n, bad, old ? "accepted" : "rejected");
+    lsm_close();
+
+    int subs[] = {0, 1, 4, 1};
+    for (int r=0;r<4;r++) {
+        CdcReader rd[4];
+        pthread_t th[4];
+        atomic_int stop = 0;
+        int slow = r == 3, ntx = slow ? 20000 : 200000;
+        long stalls = cdc_stalls;
+        uint64_t stall_ns = cdc_stall_ns;
+        for (int i=0;i<subs[r];i++) {
+            rd[i] = (CdcReader){cdc_subscribe(global_commit_ts, 1024), &stop, 0, 0, 0, slow ? 20 : 0};
+            pthread_create(&th[i], NULL, cdc_reader, &rd[i]);
+        }
+        uint64_t t0 = now_ns();
+        for (int i=0;i<ntx;i++) {
+            Transaction *tx = tx_begin();
+            for (int j=0;j<2;j++) {
+                snprintf(key, sizeof key, "k%d", (i*2 + j) % 10000);
+                snprintf(val, sizeof val, "v%d", i);
+                tx_write(tx, key, val);
+            }
+            tx_commit(tx);
+            free(tx);
+        }
+        double secs = (now_ns() - t0)/1e9;
+        atomic_store(&stop, 1);
+        long events = 0, overrun = 0, reorder = 0;
+        for (int i=0;i<subs[r];i++) {
+            pthread_join(th[i], NULL);
+            events += rd[i].events;
+            overrun += rd[i].overrun;
+            reorder += rd[i].out_of_order;
+            cdc_unsubscribe(rd[i].sub);
+        }
+        stalls = cdc_stalls - stalls;
+        printf("%d %ssubscribers: %.0f commits/s", subs[r], slow ? "slow " : "", ntx/secs);
+        if (subs[r])
+            printf(", %.0f events/s per subscriber, %ld commits waited (%.1f us avg), %ld overrun, "
+                   "%ld reordered, %s", events/subs[r]/secs, stalls,
+                   stalls ? (cdc_stall_ns - stall_ns)/1e3/stalls : 0.0, overrun, reorder,
+                   events == (long)subs[r]*ntx*2 ? "none lost" :
+                   overrun ? "overrun ones stopped early" : "EVENTS LOST");
+        printf("\n");
+    }
+}
+
+typedef struct WatchArgs {
+    atomic_ullong stamp;       // commit start, set by the writer
+    atomic_int acked;
+    uint64_t lat[2000];
+    int n;
+} WatchArgs;
+
+static void* watch_thread(void *arg) {
+    WatchArgs *a = arg;
+    commit_ts_t since = global_commit_ts, ts;
+    while (a->n < 2000 && watch("hot", since, 1000, &ts) == 0) {
+        a->lat[a->n++] = now_ns() - atomic_load(&a->stamp);
+        since = ts;
+        atomic_store(&a->acked, 1);
+    }
+    return NULL;
+}
+
+static void watch_record(const char *key, commit_ts_t ts, void *arg) {
+    WatchArgs *a = arg;
+    (void)key; (void)ts;
+    a->lat[a->n++] = now_ns() - atomic_load(&a->stamp);
+}
+
+static void commit_one(const char *key, const char *val) {
+    Transaction *tx = tx_begin();
+    tx_write(tx, key, val);
+    tx_commit(tx);
+    free(tx);
+}
+
+static void print_lat(const char *what, uint64_t *lat, int n) {
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    printf("%s: %d wakeups, p50=%.1f us p99=%.1f us max=%.1f us\n", what, n,
+           n ? lat[n/2]/1e3 : 0, n ? lat[n*99/100]/1e3 : 0, n ? lat[n-1]/1e3 : 0);
+}
+
+// Commit-to-wakeup latency for a blocked watcher and for a callback, then
+// what waiters on other keys and pending waiters on the written keys cost
+// a commit.
+static void bench_watch(void) {
+    static WatchArgs a;
+    char key[MAX_KEYNAME];
+    trace = 0;
+    pthread_t th;
+    pthread_create(&th, NULL, watch_thread, &a);
+    for (int i=0;i<2000;i++) {
+        usleep(100);           // let the watcher block
+        atomic_store(&a.acked, 0);
+        atomic_store(&a.stamp, now_ns());
+        commit_one("hot", "x");
+        while (!atomic_load(&a.acked)) sched_yield();
+    }
+    pthread_join(th, NULL);
+    print_lat("blocking watch()", a.lat, a.n);
+
+    a.n = 0;
+    for (int i=0;i<2000;i++) {
+        watch_async("hot", global_commit_ts, watch_record, &a);
+        atomic_store(&a.stamp, now_ns());
+        commit_one("hot", "y");
+    }
+    print_lat("watch_async() callback", a.lat, a.n);
+
+    const int ntx = 200000;
+    Waiter *parked[1000];
+    for (int r=0;r<3;r++) {
+        if (r == 1)
+            for (int i=0;i<1000;i++) {
+                snprintf(key, sizeof key, "other%d", i);
+                parked[i] = watch_async(key, global_commit_ts, watch_record, &a);
+            }
+        if (r == 2)            // waiters on the written keys that never fire
+            for (int i=0;i<1000;i++) {
+                snprintf(key, sizeof key, "k%d", i);
+                watch_async(key, 1<<30, watch_record, &a);
+            }
+        uint64_t t0 = now_ns();
+        for (int i=0;i<ntx;i++) {
+            snprintf(key, sizeof key, "k%d", i % 1000);
+            commit_one(key, "v");
+        }
+        printf("%s: %.0f commits/s\n",
+               r == 0 ? "no waiters" : r == 1 ? "1000 waiters on other keys" :
+               "plus one pending waiter per written key", ntx/((now_ns()-t0)/1e9));
+    }
+    for (int i=0;i<1000;i++) {
+        snprintf(key, sizeof key, "other%d", i);
+        watch_cancel(key, parked[i]);
+    }
+}
+
+// Lazy expiry on reads, then 10M expiring versions over 50000 keys with the
+// reaper running: write throughput, reaper time per entry and longest lock
+// hold, and how long until every version is freed and every key removed.
+static void bench_ttl(void) {
+    char key[MAX_KEYNAME], val[32], out[128];
+    commit_ts_t ts;
+    trace = 0;
+    Transaction *tx = tx_begin();
+    tx_write_ttl(tx, "session", "alive", 50);
+    tx_commit(tx);
+    free(tx);
+    int before = mvcc_lookup("session", global_commit_ts, out, sizeof out, &ts);
+    usleep(60000);
+    int after = mvcc_lookup("session", global_commit_ts, out, sizeof out, &ts);
+    printf("lazy expiry: visible before=%d after=%d\n", before, after);
+
+    const int nkeys = 50000, nwrites = 10000000;
+    srand(3);
+    long peak = 0;
+    reaper_start();
+    uint64_t t0 = now_ns();
+    for (int i=0;i<nwrites/MAX_WRITESET;i++) {
+        tx = tx_begin();
+        for (int j=0;j<MAX_WRITESET;j++) {
+            snprintf(key, sizeof key, "k%d", rand() % nkeys);
+            snprintf(val, sizeof val, "v%d", i);
+            tx_write_ttl(tx, key, val, 100 + rand() % 1000);
+        }
+        tx_commit(tx);
+        free(tx);
+        if (memtable_bytes > peak) peak = memtable_bytes;
+    }
+    double secs = (now_ns() - t0)/1e9;
+    printf("%d expiring writes in %.2fs: %.0f writes/s, peak memtable %.1f MB\n",
+           nwrites, secs, nwrites/secs, peak/1048576.0);
+    while (wheel_entries || store_count - nfree) usleep(10000);
+    double drain = (now_ns() - t0)/1e9 - secs;
+    reaper_stop();
+    printf("all expired and freed %.2fs after the last write: memtable %ld bytes, %d live keys\n",
+           drain, memtable_bytes, store_count - nfree);
+    printf("reaper: %ld entries (%ld requeued), %ld versions freed, %ld keys removed\n",
+           reaper_stats.entries, reaper_stats.requeued,
+           reaper_stats.versions_freed, reaper_stats.keys_removed);
+    printf("reaper cost: %.2fs busy, %.0f ns/entry, longest lock hold %.2f ms\n",
+           reaper_stats.busy_ns/1e9, (double)reaper_stats.busy_ns/reaper_stats.entries,
+           reaper_stats.max_hold_ns/1e6);
+}
+
+// Values look like "c<city>|t<tag>,t<tag>".
+static int extract_city(const char *value, char out[][MAX_KEYNAME], int max) {
+    const char *bar = strchr(value, '|');
+    if (!bar || !max) return 0;
+    snprintf(out[0], MAX_KEYNAME, "%.*s", (int)(bar - value), value);
+    return 1;
+}
+
+static int extract_tags(const char *value, char out[][MAX_KEYNAME], int max) {
+    const char *p = strchr(value, '|');
+    int n = 0;
+    while (p && n < max) {
+        const char *end = strchr(++p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len) snprintf(out[n++], MAX_KEYNAME, "%.*s", (int)len, p);
+        p = end;
+    }
+    return n;
+}
+
+static void index_value(char *val, size_t n, unsigned *seed) {
+    snprintf(val, n, "c%d|t%d,t%d", rand_r(seed) % 1000, rand_r(seed) % 1000, rand_r(seed) % 1000);
+}
+
+// Update throughput with 0, 1 and 2 indexes (and with a snapshot pinning
+// old markers), backfill time, lookup throughput, and a check that lookups
+// at the pinned snapshot agree with base reads at that snapshot.
+static void bench_index(void) {
+    const int nkeys = 50000, ntx = 100000;
+    char key[MAX_KEYNAME], val[64], out[128], ikey[1][MAX_KEYNAME];
+    commit_ts_t ts;
+    unsigned seed = 5;
+    SecIndex *city = NULL;
+    trace = 0;
+    for (int i=0;i<nkeys;i+=MAX_WRITESET) {
+        Transaction *tx = tx_begin();
+        for (int j=0;j<MAX_WRITESET && i+j<nkeys;j++) {
+            snprintf(key, sizeof key, "k%d", i+j);
+            index_value(val, sizeof val, &seed);
+            tx_write(tx, key, val);
+        }
+        tx_commit(tx);
+        free(tx);
+    }
+    Transaction *old = NULL;
+    for (int r=0;r<4;r++) {
+        if (r == 1 || r == 2) {
+            uint64_t t0 = now_ns();
+            SecIndex *ix = index_create(r == 1 ? "city" : "tags", r == 1 ? extract_city : extract_tags);
+            printf("index %s: backfilled %ld entries in %.1f ms\n", ix->name, ix->entries,
+                   (now_ns() - t0)/1e6);
+            if (r == 1) city = ix;
+        }
+        if (r == 3) old = tx_begin();     // pins every marker it can see
+        uint64_t t0 = now_ns();
+        for (int i=0;i<ntx;i++) {
+            Transaction *tx = tx_begin();
+            for (int j=0;j<4;j++) {
+                snprintf(key, sizeof key, "k%d", rand_r(&seed) % nkeys);
+                index_value(val, sizeof val, &seed);
+                tx_write(tx, key, val);
+            }
+            tx_commit(tx);
+            free(tx);
+        }
+        double secs = (now_ns() - t0)/1e9;
+        printf("%d indexes%s: %.0f commits/s (%.2f us/commit)\n", r < 3 ? r : 2,
+               r < 3 ? "" : ", old snapshot pinned", ntx/secs, secs*1e6/ntx);
+    }
+
+    long hits = 0;
+    uint64_t t0 = now_ns();
+    for (int i=0;i<100000;i++) {
+        ScanResult sr;
+        snprintf(key, sizeof key, "c%d", rand_r(&seed) % 1000);
+        hits += index_lookup(city, key, global_commit_ts, &sr);
+        free(sr.hits);
+    }
+    double secs = (now_ns() - t0)/1e9;
+    printf("index lookups: %.0f/s, %.1f keys each\n", 100000/secs, hits/100000.0);
+
+    long total = 0, wrong = 0;
+    for (int c=0;c<1000;c++) {
+        ScanResult sr;
+        snprintf(key, sizeof key, "c%d", c);
+        total += index_lookup(city, key, old->start_ts, &sr);
+        for (int i=0;i<sr.n;i++) {
+            if (!mvcc_lookup(sr.hits[i].key, old->start_ts, out, sizeof out, &ts) ||
+                extract_city(out, ikey, 1) != 1 || strcmp(ikey[0], key) != 0)
+                wrong++;
+        }
+        free(sr.hits);
+    }
+    tx_commit(old);
+    free(old);
+    printf("old snapshot: %ld of %d keys indexed, %ld disagree with base reads\n", total, nkeys, wrong);
+}
+
+#define RANGES 256
+#define RANGE_CAP 50
+
+typedef struct RangeArgs {
+    char ns;                   // key namespace of this run
+    atomic_char *full;         // per range: seen at capacity
+    atomic_int *nfull;
+    unsigned seed;
+    long commits, aborts;
+} RangeArgs;
+
+// Scans a random range and inserts into it while it holds fewer than
+// RANGE_CAP keys, until every range is full.
+static void* range_worker(void *arg) {
+    RangeArgs *a = arg;
+    char prefix[8], key[MAX_KEYNAME];
+    while (atomic_load(a->nfull) < RANGES) {
+        int r = rand_r(&a->seed) % RANGES;
+        if (atomic_load(&a->full[r])) continue;
+        Transaction *tx = tx_begin();
+        snprintf(prefix, sizeof prefix, "%c%03d:", a->ns, r);
+        if (tx_scan(tx, prefix) >= RANGE_CAP) {
+            tx_abort(tx);
+            free(tx);
+            if (!atomic_exchange(&a->full[r], 1)) atomic_fetch_add(a->nfull, 1);
+            continue;
+        }
+        snprintf(key, sizeof key, "%s%u", prefix, rand_r(&a->seed));
+        tx_write(tx, key, "x");
+        sched_yield();          // widen the scan-to-commit window
+        if (tx_commit(tx) == 0) a->commits++;
+        else a->aborts++;
+        free(tx);
+    }
+    return NULL;
+}
+
+// Insert-heavy ranges with a size limit enforced by scan-then-insert, with
+// and without phantom validation: throughput, abort rate and overfilled
+// ranges.
+static void bench_phantom(void) {
+    trace = 0;
+    for (int v=1;v>=0;v--) {
+        RangeArgs args[4];
+        pthread_t th[4];
+        atomic_char full[RANGES] = {0};
+        atomic_int nfull = 0;
+        memtable_clear();      // scans walk the whole memtable
+        scan_validation = v;
+        phantom_aborts = 0;
+        uint64_t t0 = now_ns();
+        for (int i=0;i<4;i++) {
+            args[i] = (RangeArgs){v ? 'a' : 'b', full, &nfull, 17u*(i+1), 0, 0};
+            pthread_create(&th[i], NULL, range_worker, &args[i]);
+        }
+        long commits = 0, aborts = 0;
+        for (int i=0;i<4;i++) {
+            pthread_join(th[i], NULL);
+            commits += args[i].commits;
+            aborts += args[i].aborts;
+        }
+        double secs = (now_ns() - t0)/1e9;
+        int over = 0, extra = 0;
+        for (int i=0;i<RANGES;i++) {
+            ScanResult sr;
+            char prefix[MAX_KEYNAME];
+            snprintf(prefix, sizeof prefix, "%c%03d:", v ? 'a' : 'b', i);
+            int n = mvcc_scan(prefix, global_commit_ts, &sr);
+            free(sr.hits);
+            if (n > RANGE_CAP) { over++; extra += n - RANGE_CAP; }
+        }
+        printf("validation %s: %ld inserts in %.2fs (%.0f/s), %.1f%% aborted (%ld phantoms), "
+               "%d of %d ranges overfilled by %d keys\n", v ? "on " : "off", commits, secs,
+               commits/secs, 100.0*aborts/(commits+aborts ? commits+aborts : 1), phantom_aborts,
+               over, RANGES, extra);
+    }
+    scan_validation = 1;
+}
+
+typedef enum {CC_NONE, CC_OCC, CC_2PL} cc_mode_t;
+
+typedef struct CcArgs {
+    cc_mode_t mode;
+    deadlock_policy_t policy;
+    int hot;                   // keys the increments are spread over
+    uint64_t deadline;
+    unsigned seed;
+    long commits, aborts;
+} CcArgs;
+
+// Increments 4 random counters out of a->hot per transaction, retrying
+// until it commits.
+static void* cc_worker(void *arg) {
+    CcArgs *a = arg;
+    char key[4][MAX_KEYNAME], val[128];
+    while (now_ns() < a->deadline) {
+        for (int i=0;i<4;i++) snprintf(key[i], MAX_KEYNAME, "c%d", rand_r(&a->seed) % a->hot);
+        Transaction *prev = NULL;
+        for (;;) {
+            Transaction *tx = a->mode != CC_2PL ? tx_begin()
+                            : prev ? tx_restart_2pl(prev) : tx_begin_2pl(a->policy);
+            free(prev);
+            int ok = 1;
+            for (int i=0;i<4 && ok;i++) {
+                if (a->mode == CC_OCC && tx_watch(tx, key[i]) < 0) { ok = 0; break; }
+                int found = tx_get(tx, key[i], val, sizeof val);
+                if (found < 0) { ok = 0; break; }
+                snprintf(val, sizeof val, "%ld", (found ? atol(val) : 0) + 1);
+                if (tx_write(tx, key[i], val) < 0) ok = 0;
+            }
+            if (ok && tx_commit(tx) == 0) {
+                free(tx);
+                a->commits++;
+                break;
+            }
+            tx_abort(tx);
+            prev = tx;
+            a->aborts++;
+            sched_yield();         // let the winner finish before retrying
+        }
+    }
+    return NULL;
+}
+
+// Read-modify-write increments with no check (snapshot reads and no
+// write-write check, so updates can be lost), OCC (reads validated at commit) and strict 2PL with each
+// deadlock policy, from low to extreme contention. Committed increments
+// that do not show up in the counters were lost.
+static void bench_2pl(void) {
+    const char *names[] = {"no check", "OCC", "2PL wait-die", "2PL wound-wait", "2PL detect"};
+    int hots[] = {10000, 100, 8};
+    trace = 0;
+    for (int h=0;h<3;h++) {
+        printf("%d hot keys:\n", hots[h]);
+        for (int m=0;m<5;m++) {
+            CcArgs args[4];
+            pthread_t th[4];
+            memtable_clear();
+            lock_waits = deadlock_aborts = 0;
+            uint64_t t0 = now_ns();
+            for (int i=0;i<4;i++) {
+                args[i] = (CcArgs){m < 2 ? (cc_mode_t)m : CC_2PL, m < 2 ? DL_WAIT_DIE : m - 2, hots[h],
+                                   t0 + 500000000ull, 31u*(i+1), 0, 0};
+                pthread_create(&th[i], NULL, cc_worker, &args[i]);
+            }
+            long commits = 0, aborts = 0, sum = 0;
+            for (int i=0;i<4;i++) {
+                pthread_join(th[i], NULL);
+                commits += args[i].commits;
+                aborts += args[i].aborts;
+            }
+            double secs = (now_ns() - t0)/1e9;
+            for (int k=0;k<hots[h];k++) {
+                char key[MAX_KEYNAME], val[128];
+                commit_ts_t ts;
+                snprintf(key, sizeof key, "c%d", k);
+                if (mvcc_lookup(key, global_commit_ts, val, sizeof val, &ts)) sum += atol(val);
+            }
+            printf("  %-15s %8.0f tx/s, %5.1f%% aborted, %ld lock waits, %ld lost updates\n",
+                   names[m], commits/secs, 100.0*aborts/(commits+aborts ? commits+aborts : 1),
+                   lock_waits, commits*4 - sum);
+        }
+    }
+}
+
+typedef struct IsoArgs {
+    isolation_t level;
+    uint64_t deadline;
+    unsigned seed;
+    long commits, aborts;
+} IsoArgs;
+
+// Write skew: each of a pair of doctors goes off call only if both are on
+// call. Absent means on call. The workers move to a new pair every 100us so
+// they keep meeting on the same one.
+static void* skew_worker(void *arg) {
+    IsoArgs *a = arg;
+    char key[2][MAX_KEYNAME], val[128];
+    while (now_ns() < a->deadline) {
+        int pair = now_ns()/100000 % 1024, me = rand_r(&a->seed) % 2, on = 0;  // all on one pair
+        snprintf(key[0], MAX_KEYNAME, "doc%d_a", pair);
+        snprintf(key[1], MAX_KEYNAME, "doc%d_b", pair);
+        Transaction *tx = tx_begin_iso(a->level);
+        for (int i=0;i<2;i++) on += tx_get(tx, key[i], val, sizeof val) == 0 || strcmp(val, "0") != 0;
+        sched_yield();         // the other doctor decides meanwhile
+        if (on == 2) tx_write(tx, key[me], "0");
+        if (tx_commit(tx) == 0) a->commits++;
+        else a->aborts++;
+        free(tx);
+    }
+    return NULL;
+}
+
+static void* iso_writer(void *arg) {
+    IsoArgs *a = arg;
+    char key[MAX_KEYNAME], val[32];
+    while (now_ns() < a->deadline) {
+        Transaction *tx = tx_begin();
+        snprintf(key, sizeof key, "w%d", rand_r(&a->seed) % 100);
+        snprintf(val, sizeof val, "%ld", a->commits);
+        tx_write(tx, key, val);
+        if (tx_commit(tx) == 0) a->commits++;
+        free(tx);
+    }
+    return NULL;
+}
+
+// Per level: cost of the read path, versions a long reader pins while a
+// writer updates 100 keys, and write skew between concurrent transactions.
+static void bench_isolation(void) {
+    const char *names[] = {"snapshot", "read committed", "serializable"};
+    trace = 0;
+    for (int l=0;l<3;l++) {
+        char key[MAX_KEYNAME], val[128];
+        memtable_clear();
+        for (int i=0;i<1000;i++) {
+            snprintf(key, sizeof key, "r%d", i);
+            create_key(key, "v");
+        }
+        long reads = 0;
+        unsigned seed = 7;
+        uint64_t t0 = now_ns();
+        while (now_ns() - t0 < 300000000ull) {
+            Transaction *tx = tx_begin_iso(l);
+            for (int i=0;i<8;i++) {
+                snprintf(key, sizeof key, "r%d", rand_r(&seed) % 1000);
+                tx_get(tx, key, val, sizeof val);
+            }
+            tx_commit(tx);
+            free(tx);
+            reads += 8;
+        }
+        double rsecs = (now_ns() - t0)/1e9;
+
+        IsoArgs w = {ISO_SNAPSHOT, now_ns() + 300000000ull, 5, 0, 0};
+        pthread_t th[4];
+        Transaction *reader = tx_begin_iso(l);
+        pthread_create(&th[0], NULL, iso_writer, &w);
+        while (now_ns() < w.deadline) {
+            snprintf(key, sizeof key, "w%d", rand_r(&seed) % 100);
+            tx_get(reader, key, val, sizeof val);
+            usleep(1000);
+        }
+        pthread_join(th[0], NULL);
+        long retained = 0;
+        pthread_mutex_lock(&global_lock);
+        commit_ts_t wm = gc_watermark();
+        for (int i=0;i<store_count;i++) {
+            if (!store[i].name[0] || store[i].name[0] != 'w') continue;
+            key_gc(&store[i], wm, wall_ms(), 0);
+            for (Version *v = store[i].versions; v; v = v->next) retained++;
+        }
+        pthread_mutex_unlock(&global_lock);
+        tx_abort(reader);
+        free(reader);
+
+        IsoArgs args[4];
+        memtable_clear();
+        t0 = now_ns();
+        for (int i=0;i<4;i++) {
+            args[i] = (IsoArgs){l, t0 + 300000000ull, 17u*(i+1), 0, 0};
+            pthread_create(&th[i], NULL, skew_worker, &args[i]);
+        }
+        long commits = 0, aborts = 0, skewed = 0;
+        for (int i=0;i<4;i++) {
+            pthread_join(th[i], NULL);
+            commits += args[i].commits;
+            aborts += args[i].aborts;
+        }
+        for (int p=0;p<1024;p++) {
+            int off = 0;
+            commit_ts_t ts;
+            for (int s=0;s<2;s++) {
+                snprintf(key, sizeof key, "doc%d_%c", p, 'a' + s);
+                off += mvcc_lookup(key, global_commit_ts, val, sizeof val, &ts) && strcmp(val, "0") == 0;
+            }
+            skewed += off == 2;
+        }
+        printf("%-15s %8.0f reads/s, long reader pins %4ld versions of 100 keys (%ld writes), "
+               "write skew: %ld of 1024 pairs off call, %.1f%% aborted\n", names[l], reads/rsecs, retained,
+               w.commits, skewed, 100.0*aborts/(commits+aborts ? commits+aborts : 1));
+    }
+}
+
+typedef struct OracleArgs {
+    TsOracle *o;
+    long n;
+    commit_ts_t *out;          // optional: every timestamp drawn
+} OracleArgs;
+
+static void* oracle_worker(void *arg) {
+    OracleArgs *a = arg;
+    for (long i=0;i<a->n;i++) {
+        commit_ts_t ts = a->o->next(a->o, 0);
+        if (a->out) a->out[i] = ts;
+    }
+    return NULL;
+}
+
+static int cmp_ts(const void *a, const void *b) {
+    commit_ts_t x = *(const commit_ts_t*)a, y = *(const commit_ts_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Cost of a timestamp from each oracle, alone and from 4 threads, and
+// commit throughput with it on the commit path. The batched oracle leases
+// from a tso-server in a child process; two clients of it must never get
+// the same timestamp.
+static void bench_oracle(void) {
+    char addr[64];
+    pid_t pid;
+    trace = 0;
+    snprintf(addr, sizeof addr, "unix:/tmp/mvcc-tso-%d.sock", getpid());
+    if ((pid = fork()) == 0) {
+        tso_serve(addr, NULL);
+        _exit(0);
+    }
+    TsOracle *batched[2] = {NULL, NULL};
+    for (int i=0;i<100 && !batched[0];i++)
+        if (!(batched[0] = tso_connect(addr))) usleep(50000);
+    batched[1] = tso_connect(addr);
+    if (!batched[0] || !batched[1]) { printf("timestamp service did not start\n"); return; }
+    TsOracle *oracles[] = {&ts_counter, &ts_hlc, batched[0]};
+    for (int o=0;o<3;o++) {
+        TsOracle *to = oracles[o];
+        OracleArgs one = {to, 2000000, NULL}, four[4];
+        pthread_t th[4];
+        uint64_t t0 = now_ns();
+        oracle_worker(&one);
+        double single = (double)(now_ns() - t0)/one.n;
+        t0 = now_ns();
+        for (int i=0;i<4;i++) {
+            four[i] = (OracleArgs){to, 500000, NULL};
+            pthread_create(&th[i], NULL, oracle_worker, &four[i]);
+        }
+        for (int i=0;i<4;i++) pthread_join(th[i], NULL);
+        double shared = (double)(now_ns() - t0)/2000000;
+        memtable_clear();
+        ts_oracle_set(to);
+        long commits = 0;
+        t0 = now_ns();
+        for (int i=0;i<200000;i++) {
+            char key[MAX_KEYNAME];
+            Transaction *tx = tx_begin();
+            snprintf(key, sizeof key, "t%d", i % 1000);
+            tx_write(tx, key, "v");
+            commits += tx_commit(tx) == 0;
+            free(tx);
+        }
+        double secs = (now_ns() - t0)/1e9;
+        ts_oracle_set(&ts_counter);
+        printf("%-8s %6.1f ns/ts (1 thread), %6.1f ns/ts (4 threads), %8.0f commits/s, %ld leases\n",
+               to->name, single, shared, commits/secs, to->leases);
+    }
+    OracleArgs two[2];
+    pthread_t th[2];
+    long n = 200000, dups = 0;
+    commit_ts_t *all = malloc(2*n*sizeof(commit_ts_t));
+    for (int i=0;i<2;i++) {
+        two[i] = (OracleArgs){batched[i], n, all + i*n};
+        pthread_create(&th[i], NULL, oracle_worker, &two[i]);
+    }
+    for (int i=0;i<2;i++) pthread_join(th[i], NULL);
+    qsort(all, 2*n, sizeof(commit_ts_t), cmp_ts);
+    for (long i=1;i<2*n;i++) dups += all[i] == all[i-1];
+    printf("two batched clients: %ld timestamps, %ld duplicates\n", 2*n, dups);
+    free(all);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(addr+5);
+}
+
+// Commits straddling 2^32 with each oracle, flushed to SSTables while an
+// old snapshot pins every version: bytes the packed timestamps take, and
+// snapshot reads on both sides of the boundary.
+static void bench_ts(void) {
+    TsOracle *oracles[] = {&ts_counter, &ts_hlc};
+    char dir[64], key[MAX_KEYNAME], val[32], out[128];
+    trace = 0;
+    for (int o=0;o<2;o++) {
+        snprintf(dir, sizeof dir, "/tmp/mvcc-ts-%d-%d", getpid(), o);
+        if (lsm_open(dir) < 0) { printf("cannot open %s\n", dir); return; }
+        ts_oracle_set(oracles[o]);
+        global_commit_ts = global_tx_seq = (1LL<<32) - 100000;
+        Transaction *pin = tx_begin();
+        commit_ts_t mid = 0, ts;
+        for (int i=0;i<200000;i++) {
+            Transaction *tx = tx_begin();
+            snprintf(key, sizeof key, "k%d", i % 2000);
+            snprintf(val, sizeof val, "%d", i);
+            tx_write(tx, key, val);
+            tx_commit(tx);
+            if (i == 99999) mid = tx->commit_ts;
+            free(tx);
+        }
+        pthread_mutex_lock(&global_lock);
+        lsm_flush();
+        pthread_mutex_unlock(&global_lock);
+        long stale = 0, nv = 0, disk = 0;
+        for (int k=0;k<2000;k++) {
+            snprintf(key, sizeof key, "k%d", k);
+            int want_mid = 99999 - (99999 - k) % 2000, want_last = 199999 - (199999 - k) % 2000;
+            stale += !mvcc_lookup(key, mid, out, sizeof out, &ts) || atoi(out) != want_mid;
+            stale += !mvcc_lookup(key, global_commit_ts, out, sizeof out, &ts) || atoi(out) != want_last;
+        }
+        for (int l=0;l<LSM_MAX_LEVELS;l++)
+            for (int i=0;i<level_count[l];i++) disk += levels[l][i]->size, nv += levels[l][i]->nversions;
+        printf("%-8s ts %" PRId64 "..%" PRId64 ": %ld versions, %.1f bytes/version on disk, "
+               "timestamps %.2f bytes/version (8 unpacked), %ld wrong snapshot reads\n",
+               oracles[o]->name, pin->start_ts, global_commit_ts, nv, (double)disk/nv,
+               (double)lsm_stats.sst_ts_bytes/lsm_stats.sst_versions, stale);
+        tx_commit(pin);
+        free(pin);
+        lsm_close();
+        ts_oracle_set(&ts_counter);
+    }
+    printf("at 10M commits/s a 64-bit counter lasts %.0f years; hlc timestamps run out in %.0f\n",
+           INT64_MAX/1e7/(365.25*86400), 1970 + INT64_MAX/(double)(1LL<<HLC_LOGICAL_BITS)/1000/(365.25*86400));
+}
+
+typedef struct CoordArgs {
+    const char **addrs;
+    int id, cross;
+    uint64_t deadline;
+    unsigned seed;
+    uint64_t *lat;
+    long n, cap;
+    long commits, aborts;
+} CoordArgs;
+
+// 4 writes per transaction: all in one partition, or one in each of 4.
+static void* coord_worker(void *arg) {
+    CoordArgs *a = arg;
+    char log_path[64];
+    snprintf(log_path, sizeof log_path, "/tmp/mvcc-2pc-%d-%d.log", getpid(), a->id);
+    unlink(log_path);
+    Coordinator *c = coord_open(a->addrs, 4, log_path, a->id);
+    if (!c) return NULL;
+    KVPair w[4];
+    commit_ts_t ts;
+    while (now_ns() < a->deadline) {
+        int home = rand_r(&a->seed) % 4;
+        for (int i=0;i<4;i++) {
+            int want = a->cross ? i : home;
+            do snprintf(w[i].key, MAX_KEYNAME, "k%d", rand_r(&a->seed) % 100000);
+            while (coord_part(c, w[i].key) != want);
+            snprintf(w[i].value, sizeof w[i].value, "c%d-%ld", a->id, a->n);
+        }
+        uint64_t t0 = now_ns();
+        int rc = coord_commit(c, w, 4, &ts);
+        if (a->n < a->cap) a->lat[a->n++] = now_ns() - t0;
+        if (rc == 0) a->commits++;
+        else a->aborts++;
+    }
+    coord_close(c);
+    unlink(log_path);
+    return NULL;
+}
+
+// Four participant processes, each owning a hash partition. Throughput and
+// latency of single-partition transactions (one round trip) against
+// cross-partition ones (prepare round trip, synced decision, decide round
+// trip), then a check that cross-partition commits carry one timestamp on
+// every participant while single-partition commits keep the clocks moving.
+static void bench_2pc(void) {
+    char addr[4][64];
+    const char *addrs[4];
+    pid_t pids[4];
+    trace = 0;
+    for (int i=0;i<4;i++) {
+        snprintf(addr[i], sizeof addr[i], "unix:/tmp/mvcc-part-%d-%d.sock", getpid(), i);
+        addrs[i] = addr[i];
+        if ((pids[i] = fork()) == 0) {
+            int lfd = server_listen(addr[i]);
+            if (lfd >= 0) server_run(lfd, PROTO_BINARY);
+            _exit(0);
+        }
+    }
+    int up = 0;
+    for (int i=0;i<100 && !up;i++) {
+        up = 1;
+        for (int p=0;p<4;p++) {
+            int fd = client_connect(addrs[p]);
+            if (fd < 0) up = 0;
+            else close(fd);
+        }
+        if (!up) usleep(50000);
+    }
+    if (!up) { printf("participants did not start\n"); return; }
+    for (int cross=0;cross<2;cross++) {
+        for (int nt=1;nt<=4;nt*=4) {
+            CoordArgs args[4];
+            pthread_t th[4];
+            uint64_t t0 = now_ns();
+            for (int i=0;i<nt;i++) {
+                args[i] = (CoordArgs){addrs, i+1, cross, t0 + 1000000000ull, 11u*(i+1),
+                                      malloc(1000000*sizeof(uint64_t)), 0, 1000000, 0, 0};
+                pthread_create(&th[i], NULL, coord_worker, &args[i]);
+            }
+            long commits = 0, aborts = 0, n = 0;
+            for (int i=0;i<nt;i++) {
+                pthread_join(th[i], NULL);
+                commits += args[i].commits;
+                aborts += args[i].aborts;
+                n += args[i].n;
+            }
+            double secs = (now_ns() - t0)/1e9;
+            uint64_t *lat = malloc((n ? n : 1)*sizeof(uint64_t));
+            for (int i=0, k=0;i<nt;i++) {
+                memcpy(lat + k, args[i].lat, args[i].n*sizeof(uint64_t));
+                k += args[i].n;
+                free(args[i].lat);
+            }
+            qsort(lat, n, sizeof(uint64_t), cmp_u64);
+            printf("%-15s %d coordinators: %7.0f tx/s, p50=%6.1f us p99=%7.1f us, %ld aborted\n",
+                   cross ? "cross-partition" : "single-part", nt, commits/secs,
+                   n ? lat[n/2]/1e3 : 0, n ? lat[n*99/100]/1e3 : 0, aborts);
+            free(lat);
+        }
+    }
+    char log_path[64];
+    snprintf(log_path, sizeof log_path, "/tmp/mvcc-2pc-%d-check.log", getpid());
+    Coordinator *c = coord_open(addrs, 4, log_path, 9);
+    CoordArgs bg = {addrs, 2, 0, now_ns() + 500000000ull, 7, malloc(1000000*sizeof(uint64_t)), 0, 1000000, 0, 0};
+    pthread_t bg_th;
+    pthread_create(&bg_th, NULL, coord_worker, &bg);
+    KVPair w[4];
+    commit_ts_t ts, got[4];
+    int checked = 0, mismatched = 0;
+    for (int n=0;n<200;n++) {
+        for (int i=0;i<4;i++) {
+            int k = 0;
+            do snprintf(w[i].key, MAX_KEYNAME, "check%d-%d", n, k++);
+            while (coord_part(c, w[i].key) != i);
+            snprintf(w[i].value, sizeof w[i].value, "v%d", i);
+        }
+        if (coord_commit(c, w, 4, &ts) < 0) continue;   // a participant was busy
+        int same = 1;
+        for (int i=0;i<4;i++) {
+            char req[4 + 1 + sizeof ts + MAX_KEYNAME], resp[256];
+            commit_ts_t at = INT64_MAX;
+            uint32_t len = 1 + sizeof ts + strlen(w[i].key);
+            uint8_t st;
+            memcpy(req, &len, 4);
+            req[4] = OP_READ_AT;
+            memcpy(req + 5, &at, sizeof at);
+            memcpy(req + 5 + sizeof at, w[i].key, strlen(w[i].key));
+            if (write_full(c->fd[i], req, 4 + len) < 0 || frame_read(c->fd[i], &st, resp, sizeof resp) < 0 ||
+                st != ST_OK)
+                got[i] = -1;
+            else
+                memcpy(&got[i], resp, sizeof got[i]);
+            same &= got[i] == ts;
+        }
+        checked++;
+        mismatched += !same;
+    }
+    pthread_join(bg_th, NULL);
+    free(bg.lat);
+    printf("%d cross-partition commits among %ld single-partition ones: %d with different ts "
+           "on the participants\n", checked, bg.commits, mismatched);
+    coord_close(c);
+    unlink(log_path);
+    for (int i=0;i<4;i++) {
+        kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+        unlink(addr[i]+5);
+    }
+}
+
+// Order-independent digest of every chain: store slots differ between runs.
+static uint64_t memtable_digest(void) {
+    uint64_t d = 0;
+    for (int i=0;i<store_count;i++) {
+        uint64_t h = hash64(store[i].name, strlen(store[i].name));
+        for (Version *v = store[i].versions; v; v = v->next)
+            h = (h ^ (uint64_t)v->commit_ts ^ hash64(v->value, strlen(v->value))) * 0x100000001b3ull;
+        d += h;
+    }
+    return d;
+}
+
+// Digest of the loaded tables: versions, block index and filters.
+static uint64_t tables_digest(void) {
+    uint64_t d = 0;
+    for (int l=0;l<LSM_MAX_LEVELS;l++)
+        for (int i=0;i<level_count[l];i++) {
+            SSTable *t = levels[l][i];
+            d = d*31 + t->nversions + t->nblocks;
+            for (int b=0;b<t->nblocks;b++) d = d*31 + hash64(t->blocks[b].first, strlen(t->blocks[b].first));
+            if (t->filter.bits) d = d*31 + hash64((char*)t->filter.bits, (t->filter.nbits+7)/8);
+            if (t->prefix_filter.bits) d = d*31 + hash64((char*)t->prefix_filter.bits, (t->prefix_filter.nbits+7)/8);
+        }
+    return d;
+}
+
+// Restart time for a WAL of mb megabytes (4 writes of 32-byte values per
+// record, 50000 keys) with 1 to 32 replay threads. The log is written
+// directly rather than committed, and dropped from the page cache before
+// each open. Every run must rebuild the chains of the serial replay.
+// Then the same for tables: about mb/8 megabytes committed over 4M keys,
+// so compaction leaves one large table at the bottom, reopened with 1 to
+// 32 load threads. Every run must rebuild the same index and filters.
+static void bench_recovery(long mb) {
+    char dir[64], path[300], val[33];
+    trace = 0;
+    snprintf(dir, sizeof dir, "/tmp/mvcc-recovery-%d", getpid());
+    mkdir(dir, 0755);
+    snprintf(path, sizeof path, "%s/wal.log", dir);
+    FILE *f = fopen(path, "wb");
+    if (!f) { printf("cannot create %s\n", path); return; }
+    Transaction *tx = calloc(1, sizeof(Transaction));
+    char rec[WAL_MAX_RECORD];
+    unsigned seed = 1;
+    long size = 0, nrec = 0;
+    for (commit_ts_t ts = 2; size < mb<<20; ts++, nrec++) {
+        tx->write_count = 4;
+        for (int i=0;i<4;i++) {
+            snprintf(tx->write_set[i].key, MAX_KEYNAME, "r%05d", rand_r(&seed) % 50000);
+            snprintf(val, sizeof val, "%-32" PRId64, ts*4 + i);
+            strcpy(tx->write_set[i].value, val);
+        }
+        size_t n = wal_encode(tx, ts, rec);
+        fwrite(rec, 1, n, f);
+        size += n;
+    }
+    fclose(f);
+    free(tx);
+    printf("WAL: %ld MB, %ld records, %ld versions\n", size>>20, nrec, 4*nrec);
+
+    int threads[] = {1, 2, 4, 8, 16, 32};
+    uint64_t want = 0, base = 0;
+    for (int t=0;t<6;t++) {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) { fdatasync(fd); posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED); close(fd); }
+        lsm_recovery_threads = threads[t];
+        uint64_t t0 = now_ns();
+        if (lsm_open(dir) < 0) { printf("cannot open %s\n", dir); break; }
+        uint64_t ns = now_ns() - t0;
+        uint64_t d = memtable_digest();
+        if (t == 0) want = d, base = ns;
+        printf("%2d threads: restart %7.1f ms (read %.1f, decode %.1f, install %.1f), %ld records, "
+               "%.0f MB/s, speedup %.2fx, chains %s\n", threads[t], ns/1e6, lsm_stats.replay_ns[0]/1e6,
+               lsm_stats.replay_ns[1]/1e6, lsm_stats.replay_ns[2]/1e6, lsm_stats.replayed_records,
+               size/1e6/(ns/1e9), (double)base/ns, d == want ? "match serial replay" : "DIFFER");
+        lsm_close();
+    }
+
+    unlink(path);
+    lsm_recovery_threads = 1;
+    if (lsm_open(dir) < 0) { printf("cannot open %s\n", dir); return; }
+    int ids[LSM_MAX_LEVELS*LSM_MAX_L0], ntables = 0;
+    long disk = 0;
+    for (long i=0;disk < (mb<<20)/8;i++) {
+        tx = tx_begin();
+        for (int w=0;w<4;w++) {
+            char key[MAX_KEYNAME];
+            snprintf(key, sizeof key, "s%07d", rand_r(&seed) % 4000000);
+            snprintf(val, sizeof val, "%-32ld", i*4 + w);
+            tx_write(tx, key, val);
+        }
+        tx_commit(tx);
+        free(tx);
+        if (i % 1024) continue;
+        disk = 0;
+        for (int l=0;l<LSM_MAX_LEVELS;l++)
+            for (int j=0;j<level_count[l];j++) disk += levels[l][j]->size;
+    }
+    pthread_mutex_lock(&global_lock);
+    lsm_flush();
+    pthread_mutex_unlock(&global_lock);
+    disk = 0;
+    for (int l=0;l<LSM_MAX_LEVELS;l++)
+        for (int j=0;j<level_count[l];j++) disk += levels[l][j]->size, ids[ntables++] = levels[l][j]->id;
+    lsm_close();
+    printf("tables: %ld MB in %d tables\n", disk>>20, ntables);
+    for (int t=0;t<6;t++) {
+        for (int i=0;i<ntables;i++) {
+            sst_path(path, sizeof path, ids[i]);
+            int fd = open(path, O_RDONLY);
+            if (fd >= 0) { posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED); close(fd); }
+        }
+        lsm_recovery_threads = threads[t];
+        if (lsm_open(dir) < 0) { printf("cannot open %s\n", dir); break; }
+        uint64_t ns = lsm_stats.table_load_ns, d = tables_digest();
+        if (t == 0) want = d, base = ns;
+        printf("%2d threads: tables loaded in %7.1f ms, %.0f MB/s, speedup %.2fx, index and filters %s\n",
+               threads[t], ns/1e6, disk/1e6/(ns/1e9), (double)base/ns, d == want ? "match serial load" : "DIFFER");
+        lsm_close();
+    }
+    for (int i=0;i<ntables;i++) {
+        sst_path(path, sizeof path, ids[i]);
+        unlink(path);
+    }
+    lsm_recovery_threads = 1;
+    snprintf(path, sizeof path, "%s/wal.log", dir);
+    unlink(path);
+    snprintf(path, sizeof path, "%s/MANIFEST", dir);
+    unlink(path);
+    rmdir(dir);
+    printf("%d cpus online\n", (int)sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+// Read-only transactions of 8 point reads at snapshots 1..16, over 60000
+// keys with 16 versions each (about 60 MB of chains, beyond the caches).
+// Reads one at a time through tx_get are compared with tx_interleave at
+// growing group sizes. Every mode must return the same values.
+static void bench_interleave(void) {
+    enum {NKEYS = 60000, NVER = 16, BATCH = 64, NREAD = 8, ROUNDS = 3000};
+    char (*names)[MAX_KEYNAME] = malloc(NKEYS*MAX_KEYNAME);
+    char (*keys)[MAX_KEYNAME] = malloc(BATCH*NREAD*MAX_KEYNAME);
+    char (*vals)[128] = malloc(BATCH*NREAD*128);
+    int *perm = malloc(NKEYS*sizeof(int));
+    ILTask tasks[BATCH];
+    Transaction *txs[BATCH];
+    char val[32];
+    unsigned seed = 7;
+    trace = 0;
+    for (int i=0;i<NKEYS;i++) {
+        snprintf(names[i], MAX_KEYNAME, "il%05d", i);
+        perm[i] = i;
+    }
+    for (int i=NKEYS-1;i>0;i--) {
+        int j = rand_r(&seed) % (i+1), t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+    // Versions are allocated round by round in shuffled key order, so a
+    // chain's nodes are far apart in memory.
+    pthread_mutex_lock(&global_lock);
+    for (int i=0;i<NKEYS;i++) create_key(names[perm[i]], NULL);
+    for (int v=1;v<=NVER;v++)
+        for (int i=0;i<NKEYS;i++) {
+            snprintf(val, sizeof val, "%d.%d", perm[i], v);
+            add_version(get_key(names[perm[i]]), v, val, 0);
+        }
+    global_commit_ts = NVER + 1;
+    pthread_mutex_unlock(&global_lock);
+    for (int b=0;b<BATCH;b++) txs[b] = tx_begin();
+
+    int groups[] = {0, 1, 2, 4, 8, 16, 32, 64};
+    uint64_t want = 0, base = 0;
+    for (int g=0;g<8;g++) {
+        uint64_t ns = 0, sum = 0;
+        long found = 0;
+        seed = 42;
+        for (int r=0;r<ROUNDS;r++) {
+            for (int b=0;b<BATCH;b++) {
+                txs[b]->start_ts = 1 + rand_r(&seed) % NVER;
+                for (int j=0;j<NREAD;j++)
+                    strcpy(keys[b*NREAD+j], names[rand_r(&seed) % NKEYS]);
+                tasks[b] = (ILTask){.tx = txs[b], .keys = keys + b*NREAD, .nkeys = NREAD,
+                                    .vals = vals + b*NREAD};
+            }
+            uint64_t t0 = now_ns();
+            if (groups[g]) tx_interleave(tasks, BATCH, groups[g]);
+            else
+                for (int b=0;b<BATCH;b++)
+                    for (int j=0;j<NREAD;j++)
+                        tasks[b].found += tx_get(txs[b], keys[b*NREAD+j], vals[b*NREAD+j], 128) == 1;
+            ns += now_ns() - t0;
+            for (int b=0;b<BATCH;b++) found += tasks[b].found;
+            for (int i=0;i<BATCH*NREAD;i++) sum = sum*31 + hash64(vals[i], strlen(vals[i]));
+        }
+        long reads = (long)ROUNDS*BATCH*NREAD;
+        if (g == 0) want = sum, base = ns;
+        char label[32];
+        if (groups[g]) snprintf(label, sizeof label, "interleave %2d", groups[g]);
+        else snprintf(label, sizeof label, "one at a time");
+        printf("%-14s %6.2f M reads/s, %5.0f ns/read, %ld found, speedup %.2fx, results %s\n", label,
+               reads/(ns/1e3), (double)ns/reads, found, (double)base/ns, sum == want ? "match" : "DIFFER");
+    }
+    for (int b=0;b<BATCH;b++) {
+        tx_commit(txs[b]);
+        free(txs[b]);
+    }
+    pthread_mutex_lock(&global_lock);
+    memtable_clear();
+    pthread_mutex_unlock(&global_lock);
+    free(names);
+    free(keys);
+    free(vals);
+    free(perm);
+}
+
+typedef struct AsyncArgs {
+    int id, async, max_inflight;
+    uint64_t deadline;
+    unsigned seed;
+    pthread_mutex_t mu;
+    pthread_cond_t cond;
+    int inflight;
+    long commits, aborts;
+    uint64_t *lat;
+    long n, cap;
+} AsyncArgs;
+
+typedef struct AsyncCommit {
+    AsyncArgs *a;
+    uint64_t t0;
+} AsyncCommit;
+
+static void async_commit_done(Future *f, void *arg) {
+    AsyncCommit *c = arg;
+    AsyncArgs *a = c->a;
+    pthread_mutex_lock(&a->mu);
+    if (f->rc == 0) a->commits++;
+    else a->aborts++;
+    if (a->n < a->cap) a->lat[a->n++] = now_ns() - c->t0;
+    a->inflight--;
+    pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->mu);
+    free(c);
+    future_free(f);
+}
+
+// Two blind writes per transaction, committed durably: tx_commit, or
+// tx_commit_async with up to max_inflight commits awaiting their sync.
+static void* async_worker(void *arg) {
+    AsyncArgs *a = arg;
+    char key[MAX_KEYNAME], val[32];
+    for (long i=0; now_ns() < a->deadline; i++) {
+        Transaction *tx = tx_begin();
+        for (int j=0;j<2;j++) {
+            snprintf(key, sizeof key, "a%d", rand_r(&a->seed) % 100000);
+            snprintf(val, sizeof val, "%d-%ld", a->id, i);
+            tx_write(tx, key, val);
+        }
+        uint64_t t0 = now_ns();
+        if (!a->async) {
+            int rc = tx_commit(tx);
+            if (rc == 0) a->commits++;
+            else a->aborts++;
+            if (a->n < a->cap) a->lat[a->n++] = now_ns() - t0;
+        } else {
+            pthread_mutex_lock(&a->mu);
+            while (a->inflight >= a->max_inflight) pthread_cond_wait(&a->cond, &a->mu);
+            a->inflight++;
+            pthread_mutex_unlock(&a->mu);
+            AsyncCommit *c = malloc(sizeof(AsyncCommit));
+            *c = (AsyncCommit){a, t0};
+            tx_commit_async(tx, async_commit_done, c);
+        }
+        free(tx);
+    }
+    pthread_mutex_lock(&a->mu);
+    while (a->inflight) pthread_cond_wait(&a->cond, &a->mu);
+    pthread_mutex_unlock(&a->mu);
+    return NULL;
+}
+
+// Durable commits (lsm_sync) through the blocking API at 1, 4 and 16
+// threads against the async API at 1 and 4 threads keeping 1024 commits in
+// flight; then async reads of keys in the memtable, on disk and absent,
+// checked against tx_get.
+static void bench_async(void) {
+    struct { int async, threads; } cfg[] = {{0, 1}, {0, 4}, {0, 16}, {1, 1}, {1, 4}};
+    char dir[64];
+    trace = 0;
+    snprintf(dir, sizeof dir, "/tmp/mvcc-async-%d", getpid());
+    if (lsm_open(dir) < 0) { printf("cannot open %s\n", dir); return; }
+    lsm_sync = 1;
+    async_start(2);
+    for (int c=0;c<5;c++) {
+        int nt = cfg[c].threads;
+        AsyncArgs *args = calloc(nt, sizeof(AsyncArgs));
+        pthread_t th[16];
+        long syncs = async_syncs;
+        uint64_t t0 = now_ns();
+        for (int i=0;i<nt;i++) {
+            args[i] = (AsyncArgs){.id = i, .async = cfg[c].async, .max_inflight = 1024/nt,
+                                  .deadline = t0 + 2000000000ull, .seed = 17u*(i+1),
+                                  .lat = malloc(2000000*sizeof(uint64_t)), .cap = 2000000};
+            pthread_mutex_init(&args[i].mu, NULL);
+            pthread_cond_init(&args[i].cond, NULL);
+            pthread_create(&th[i], NULL, async_worker, &args[i]);
+        }
+        long commits = 0, aborts = 0, n = 0;
+        for (int i=0;i<nt;i++) {
+            pthread_join(th[i], NULL);
+            commits += args[i].commits;
+            aborts += args[i].aborts;
+            n += args[i].n;
+        }
+        double secs = (now_ns() - t0)/1e9;
+        uint64_t *lat = malloc((n ? n : 1)*sizeof(uint64_t));
+        for (int i=0, k=0;i<nt;i++) {
+            memcpy(lat + k, args[i].lat, args[i].n*sizeof(uint64_t));
+            k += args[i].n;
+            free(args[i].lat);
+        }
+        qsort(lat, n, sizeof(uint64_t), cmp_u64);
+        printf("%-8s %2d threads: %7.0f durable commits/s, p50 %6.2f ms, p99 %6.2f ms, %ld aborts",
+               cfg[c].async ? "async" : "blocking", nt, commits/secs, n ? lat[n/2]/1e6 : 0,
+               n ? lat[n*99/100]/1e6 : 0, aborts);
+        if (cfg[c].async) printf(", %.1f commits/sync", (double)commits/(async_syncs - syncs));
+        printf("\n");
+        free(lat);
+        free(args);
+    }
+
+    Transaction *tx = tx_begin();
+    Future *f[1000];
+    char key[MAX_KEYNAME], val[128];
+    int inline_done = 0, same = 0;
+    for (int i=0;i<1000;i++) {
+        snprintf(key, sizeof key, "a%d", i*113 % 110000);
+        f[i] = tx_get_async(tx, key, NULL, NULL);
+        pthread_mutex_lock(&async_lock);
+        inline_done += f[i]->done;
+        pthread_mutex_unlock(&async_lock);
+    }
+    for (int i=0;i<1000;i++) {
+        snprintf(key, sizeof key, "a%d", i*113 % 110000);
+        int rc = future_wait(f[i]);
+        same += tx_get(tx, key, val, sizeof val) == rc && (rc != 1 || strcmp(val, f[i]->value) == 0);
+        future_free(f[i]);
+    }
+    printf("async reads: %d answered inline, %d left to the pool, %d/1000 match tx_get\n",
+           inline_done, 1000 - inline_done, same);
+    tx_commit(tx);
+    free(tx);
+    async_stop();
+    lsm_sync = 0;
+    lsm_close();
+}
+
+typedef struct SchedOp {
+    char key[MAX_KEYNAME];
+    int heavy;                 // also reads 200 cold keys first
+    uint64_t t0;
+} SchedOp;
+
+uint64_t *sched_lat;
+atomic_long sched_nlat, sched_outstanding;
+
+// Increments a counter; the watch turns a concurrent increment into a
+// failed commit.
+static int sched_incr(Transaction *tx, void *arg) {
+    SchedOp *op = arg;
+    char key[MAX_KEYNAME], val[128];
+    for (int i=0;i<(op->heavy ? 200 : 0);i++) {
+        snprintf(key, sizeof key, "c%d", i*97 % 50000);
+        tx_get(tx, key, val, sizeof val);
+    }
+    tx_watch(tx, op->key);
+    int n = tx_get(tx, op->key, val, sizeof val) == 1 ? atoi(val) : 0;
+    snprintf(val, sizeof val, "%d", n + 1);
+    return tx_write(tx, op->key, val);
+}
+
+static void sched_op_done(int rc, commit_ts_t ts, int attempts, void *arg) {
+    SchedOp *op = arg;
+    (void)rc; (void)ts; (void)attempts;
+    sched_lat[atomic_fetch_add(&sched_nlat, 1)] = now_ns() - op->t0;
+    atomic_fetch_sub(&sched_outstanding, 1);
+    free(op);
+}
+
+// 200000 counter increments, 80% on 16 hot keys and 2% heavy, submitted
+// with up to 4096 outstanding to 4 workers: round-robin or by key, with
+// and without stealing. The counters must add up to the commits.
+static void bench_sched(void) {
+    enum {NOPS = 200000, WORKERS = 4, HOT = 16, COLD = 50000};
+    struct { int steal, by_key; } cfg[] = {{0, 0}, {1, 0}, {0, 1}, {1, 1}};
+    long total = 0;
+    trace = 0;
+    sched_lat = malloc(NOPS*sizeof(uint64_t));
+    for (int c=0;c<4;c++) {
+        Scheduler *s = sched_start(WORKERS, cfg[c].steal, cfg[c].by_key);
+        unsigned seed = 5;
+        atomic_store(&sched_nlat, 0);
+        uint64_t t0 = now_ns();
+        for (int i=0;i<NOPS;i++) {
+            while (atomic_load(&sched_outstanding) >= 4096) sched_yield();
+            SchedOp *op = malloc(sizeof(SchedOp));
+            if (rand_r(&seed) % 100 < 80) snprintf(op->key, sizeof op->key, "h%d", rand_r(&seed) % HOT);
+            else snprintf(op->key, sizeof op->key, "c%d", rand_r(&seed) % COLD);
+            op->heavy = rand_r(&seed) % 100 < 2;
+            op->t0 = now_ns();
+            atomic_fetch_add(&sched_outstanding, 1);
+            sched_submit(s, sched_incr, op, op->key, sched_op_done);
+        }
+        while (atomic_load(&sched_outstanding)) sched_yield();
+        double secs = (now_ns() - t0)/1e9;
+        long commits = atomic_load(&s->commits), retries = atomic_load(&s->retries);
+        long aborts = atomic_load(&s->aborts), steals = atomic_load(&s->steals);
+        sched_stop(s);
+        total += commits;
+
+        long sum = 0;
+        char key[MAX_KEYNAME], val[128];
+        commit_ts_t ts;
+        for (int i=0;i<HOT+COLD;i++) {
+            if (i < HOT) snprintf(key, sizeof key, "h%d", i);
+            else snprintf(key, sizeof key, "c%d", i - HOT);
+            if (mvcc_lookup(key, global_commit_ts, val, sizeof val, &ts)) sum += atoi(val);
+        }
+        long n = atomic_load(&sched_nlat);
+        qsort(sched_lat, n, sizeof(uint64_t), cmp_u64);
+        printf("%-11s %-13s %7.0f tx/s, p50 %6.2f ms, p99 %6.2f ms, %6ld retries, %ld failed, "
+               "%6ld steals, counters %s\n", cfg[c].by_key ? "by key," : "round-robin,",
+               cfg[c].steal ? "stealing" : "no stealing", commits/secs, sched_lat[n/2]/1e6,
+               sched_lat[n*99/100]/1e6, retries, aborts, steals, sum == total ? "ok" : "WRONG");
+    }
+    free(sched_lat);
+}
+
+typedef struct AdmitArgs {
+    uint64_t deadline;
+    unsigned seed;
+    long commits, aborts, shed;
+} AdmitArgs;
+
+// Read-modify-write of 2 of 64 hot counters with a 200 us pause and 100 us
+// of CPU in between, standing in for a client round trip and application
+// logic. A shed BEGIN backs off for 5 ms.
+static void* admit_worker(void *arg) {
+    AdmitArgs *a = arg;
+    char key[2][MAX_KEYNAME], val[128];
+    while (now_ns() < a->deadline) {
+        Transaction *tx = tx_begin();
+        if (!tx) {
+            a->shed++;
+            usleep(5000);
+            continue;
+        }
+        int n[2];
+        for (int i=0;i<2;i++) {
+            snprintf(key[i], MAX_KEYNAME, "hot%d", rand_r(&a->seed) % 64);
+            tx_watch(tx, key[i]);
+            n[i] = tx_get(tx, key[i], val, sizeof val) == 1 ? atoi(val) : 0;
+        }
+        usleep(200);
+        for (uint64_t t = now_ns(); now_ns() - t < 100000;) ;
+        for (int i=0;i<2;i++) {
+            snprintf(val, sizeof val, "%d", n[i] + 1);
+            tx_write(tx, key[i], val);
+        }
+        if (tx_commit(tx) == 0) a->commits++;
+        else a->aborts++;
+        free(tx);
+    }
+    return NULL;
+}
+
+// Goodput (commits/s) of 8 to 512 closed-loop clients with admission
+// control off and adaptive (waiting up to 100 ms), and the mean number of
+// transactions running.
+static void bench_admission(void) {
+    int clients[] = {8, 32, 128, 512};
+    trace = 0;
+    for (int adaptive=0;adaptive<2;adaptive++) {
+        for (int c=0;c<4;c++) {
+            int nt = clients[c];
+            AdmitArgs *args = calloc(nt, sizeof(AdmitArgs));
+            pthread_t *th = calloc(nt, sizeof(pthread_t));
+            admit_adaptive = adaptive;
+            admit_limit = adaptive ? 16 : 0;
+            admit_wait_ms = 100;
+            uint64_t t0 = now_ns();
+            for (int i=0;i<nt;i++) {
+                args[i] = (AdmitArgs){t0 + 2000000000ull, 31u*(i+1), 0, 0, 0};
+                pthread_create(&th[i], NULL, admit_worker, &args[i]);
+            }
+            long samples = 0, active = 0;
+            while (now_ns() < t0 + 2000000000ull) {
+                usleep(1000);
+                pthread_mutex_lock(&global_lock);
+                active += active_count;
+                pthread_mutex_unlock(&global_lock);
+                samples++;
+            }
+            long commits = 0, aborts = 0, shed = 0;
+            for (int i=0;i<nt;i++) {
+                pthread_join(th[i], NULL);
+                commits += args[i].commits;
+                aborts += args[i].aborts;
+                shed += args[i].shed;
+            }
+            double secs = (now_ns() - t0)/1e9;
+            printf("admission %-8s %3d clients: goodput %6.0f commits/s, %6.0f aborts/s, %6.0f shed/s, "
+                   "%5.1f running", adaptive ? "adaptive" : "off", nt, commits/secs, aborts/secs, shed/secs,
+                   (double)active/samples);
+            if (adaptive) printf(", limit %d", admit_limit);
+            printf("\n");
+            free(args);
+            free(th);
+        }
+    }
+    admit_adaptive = admit_limit = admit_wait_ms = 0;
+}
+
+typedef struct StragglerArgs {
+    atomic_int stop;
+    long commits;
+} StragglerArgs;
+
+static void* straggler_writer(void *arg) {
+    StragglerArgs *a = arg;
+    char key[MAX_KEYNAME], val[32];
+    unsigned seed = 3;
+    while (!atomic_load(&a->stop)) {
+        Transaction *tx = tx_begin();
+        snprintf(key, sizeof key, "s%d", rand_r(&seed) % 100);
+        snprintf(val, sizeof val, "%ld", a->commits);
+        tx_write(tx, key, val);
+        if (tx_commit(tx) == 0) a->commits++;
+        free(tx);
+        usleep(20);
+    }
+    return NULL;
+}
+
+// A writer commits to 100 keys for 15 rounds of 100 ms. Two transactions
+// are left open: a read-only one from the start, and one from round 7
+// that wrote. After each round the chains are GC'd against the watermark.
+// This runs with no age limit and then with a 200 ms limit under each
+// policy. It prints the longest chain and how many versions are retained,
+// what became of each straggler, and the pin report from round 13.
+static void bench_straggler(void) {
+    const char *mode[] = {"no limit", "abort", "downgrade"};
+    char val[128];
+    trace = 0;
+    for (int m=0;m<3;m++) {
+        snapshot_max_age_ms = m ? 200 : 0;
+        stale_policy = m == 2 ? STALE_DOWNGRADE : STALE_ABORT;
+        long aborts0 = stale_aborts, downgrades0 = stale_downgrades;
+        Transaction *reader = tx_begin(), *writer = NULL;
+        tx_get(reader, "s0", val, sizeof val);
+        StragglerArgs w = {0, 0};
+        pthread_t th;
+        pthread_create(&th, NULL, straggler_writer, &w);
+        long longest = 0, retained = 0;
+        for (int tick=0;tick<15;tick++) {
+            usleep(100000);
+            if (tick == 7) {
+                writer = tx_begin();
+                tx_write(writer, "s0", "straggler");
+            }
+            if (tick == 13) snapshot_report(2);
+            pthread_mutex_lock(&global_lock);
+            commit_ts_t wm = gc_watermark();
+            retained = 0;
+            for (int i=0;i<store_count;i++) {
+                if (store[i].name[0] != 's') continue;
+                key_gc(&store[i], wm, wall_ms(), 0);
+                long len = 0;
+                for (Version *v = store[i].versions; v; v = v->next) len++;
+                if (len > longest) longest = len;
+                retained += len;
+            }
+            pthread_mutex_unlock(&global_lock);
+        }
+        atomic_store(&w.stop, 1);
+        pthread_join(th, NULL);
+        int rd = tx_get(reader, "s0", val, sizeof val);
+        printf("%-9s %ld commits: longest chain %ld, %ld versions retained at the end, %ld aborted, "
+               "%ld downgraded; reader's last read %s, writer's commit %s\n", mode[m], w.commits, longest,
+               retained, stale_aborts - aborts0, stale_downgrades - downgrades0, rd < 0 ? "failed" : "ok",
+               tx_commit(writer) == 0 ? "ok" : "failed");
+        if (reader->state == TX_ACTIVE) tx_commit(reader);
+        free(reader);
+        free(writer);
+        pthread_mutex_lock(&global_lock);
+        memtable_clear();
+        pthread_mutex_unlock(&global_lock);
+    }
+    snapshot_max_age_ms = 0;
+    stale_policy = STALE_ABORT;
+}
+
+typedef struct InlineGcArgs {
+    atomic_int *stop;
+    int writer, vacuum;
+    unsigned seed;
+    long ops;
+    uint64_t hold_ns;          // vacuum only
+} InlineGcArgs;
+
+// Writers update two of 200 hot keys per transaction; readers read four in
+// a snapshot. The vacuum sweeps every key with key_gc, 64 per lock hold,
+// then sleeps 10 ms: the background-only baseline.
+static void* inline_gc_worker(void *arg) {
+    InlineGcArgs *a = arg;
+    char key[MAX_KEYNAME], val[128];
+    while (!atomic_load(a->stop)) {
+        if (a->vacuum) {
+            for (int i=0; i<store_count; i+=64) {
+                uint64_t t0 = now_ns();
+                pthread_mutex_lock(&global_lock);
+                commit_ts_t wm = gc_watermark();
+                for (int j=i; j<i+64 && j<store_count; j++)
+                    if (store[j].name[0] == 'g') key_gc(&store[j], wm, wall_ms(), 0);
+                pthread_mutex_unlock(&global_lock);
+                a->hold_ns += now_ns() - t0;
+            }
+            usleep(10000);
+            a->ops++;
+            continue;
+        }
+        Transaction *tx = tx_begin();
+        for (int i=0;i<(a->writer ? 2 : 4);i++) {
+            snprintf(key, sizeof key, "g%d", rand_r(&a->seed) % 200);
+            if (a->writer) {
+                snprintf(val, sizeof val, "%ld", a->ops);
+                tx_write(tx, key, val);
+            } else {
+                tx_get(tx, key, val, sizeof val);
+            }
+        }
+        if (tx_commit(tx) == 0) a->ops++;
+        free(tx);
+    }
+    return NULL;
+}
+
+// Runs two writers and two readers for 2 s with background GC only, inline
+// GC only, and both. Chains are sampled every 50 ms. Prints throughput, the
+// mean and longest chain, the memtable size, and who freed the versions.
+static void bench_inline_gc(void) {
+    const char *mode[] = {"background", "inline", "both"};
+    trace = 0;
+    for (int m=0;m<3;m++) {
+        inline_gc = m > 0;
+        long freed0 = inline_gc_freed, vacuumed0 = reaper_stats.versions_freed;
+        atomic_int stop = 0;
+        InlineGcArgs args[5];
+        pthread_t th[5];
+        int nt = m == 1 ? 4 : 5;
+        for (int i=0;i<nt;i++) {
+            args[i] = (InlineGcArgs){&stop, i < 2, i == 4, 7u*(i+1), 0, 0};
+            pthread_create(&th[i], NULL, inline_gc_worker, &args[i]);
+        }
+        uint64_t t0 = now_ns();
+        long samples = 0, total = 0, longest = 0, keys = 0;
+        long peak = 0;
+        while (now_ns() < t0 + 2000000000ull) {
+            usleep(50000);
+            pthread_mutex_lock(&global_lock);
+            for (int i=0;i<store_count;i++) {
+                if (store[i].name[0] != 'g') continue;
+                long len = 0;
+                for (Version *v = store[i].versions; v; v = v->next) len++;
+                if (len > longest) longest = len;
+                total += len;
+                keys++;
+            }
+            if (memtable_bytes > peak) peak = memtable_bytes;
+            pthread_mutex_unlock(&global_lock);
+            samples++;
+        }
+        atomic_store(&stop, 1);
+        long commits = 0, reads = 0;
+        for (int i=0;i<nt;i++) {
+            pthread_join(th[i], NULL);
+            if (i < 2) commits += args[i].ops;
+            else if (i < 4) reads += args[i].ops;
+        }
+        double secs = (now_ns() - t0)/1e9;
+        printf("gc %-10s %7.0f commits/s, %7.0f reads/s: chain mean %5.1f longest %4ld, peak memtable %5ld KB, "
+               "freed %ld inline %ld background", mode[m], commits/secs, reads/secs, keys ? (double)total/keys : 0,
+               longest, peak/1024, inline_gc_freed - freed0, reaper_stats.versions_freed - vacuumed0);
+        if (nt == 5) printf(", vacuum held the lock %.1f ms", args[4].hold_ns/1e6);
+        printf("\n");
+        pthread_mutex_lock(&global_lock);
+        memtable_clear();
+        pthread_mutex_unlock(&global_lock);
+    }
+    inline_gc = 0;
+}
+
+// One load of n keys, by create_key (threads == 0) or bulk_load. Sets the
+// elapsed and lock hold times, checks the result, and clears the store.
+// Returns 0 if the load was right.
+static int bulk_bench_load(char **keys, char **vals, int n, int threads, double *secs, double *held_ms) {
+    uint64_t t0 = now_ns(), held = 0;
+    int bad = 0;
+    if (!threads) {
+        for (int i=0;i<n;i++) {
+            pthread_mutex_lock(&global_lock);
+            uint64_t t1 = now_ns();
+            create_key(keys[i], vals[i]);
+            held += now_ns() - t1;
+            pthread_mutex_unlock(&global_lock);
+        }
+    } else {
+        uint64_t locked0 = bulk_stats.locked_ns;
+        bad = bulk_load(keys, vals, n, threads) < 0;
+        held = bulk_stats.locked_ns - locked0;
+    }
+    *secs = (now_ns() - t0)/1e9;
+    *held_ms = held/1e6;
+    char val[128];
+    commit_ts_t ts;
+    for (int i=0;i<n && !bad;i+=997)
+        bad = !mvcc_lookup(keys[i], 1, val, sizeof val, &ts) || strcmp(val, vals[i]) != 0 || ts != 0;
+    int count = store_count;
+    if (bulk_load(keys + n/2, vals + n/2, 100, 2) == 0 || errno != EEXIST || store_count != count) bad = 1;
+    Transaction *tx = tx_begin();
+    tx_write(tx, keys[0], "overwritten");
+    if (tx_commit(tx) < 0) bad = 1;
+    free(tx);
+    pthread_mutex_lock(&global_lock);
+    key_gc(get_key(keys[0]), gc_watermark(), wall_ms(), 0);
+    if (!get_key(keys[0]) || get_key(keys[0])->versions->next) bad = 1;
+    memtable_clear();
+    pthread_mutex_unlock(&global_lock);
+    return bad;
+}
+
+// Loads 60000 keys in key order and shuffled, first through create_key
+// one lock at a time, then with bulk_load on 1 to 8 threads. Prints the
+// best of 5 loads and the shortest total time global_lock was held. Each
+// load is checked by reading back every 997th key, loading 100 of the keys
+// again (must fail with EEXIST), and overwriting a key so GC drops an
+// arena version.
+static void bench_bulk(void) {
+    enum {N = 60000};
+    char **keys = malloc(N*sizeof(char*)), **vals = malloc(N*sizeof(char*));
+    int threads[] = {0, 1, 2, 4, 8};
+    unsigned seed = 11;
+    trace = 0;
+    for (int i=0;i<N;i++) {
+        keys[i] = malloc(MAX_KEYNAME);
+        vals[i] = malloc(40);
+        snprintf(keys[i], MAX_KEYNAME, "b%07d", i);
+        snprintf(vals[i], 40, "value-%07d-xxxxxxxxxxxxxxxx", i);
+    }
+    for (int shuffled=0;shuffled<2;shuffled++) {
+        for (int i=N-1;shuffled && i>0;i--) {
+            int j = rand_r(&seed) % (i+1);
+            char *k = keys[i], *v = vals[i];
+            keys[i] = keys[j], vals[i] = vals[j];
+            keys[j] = k, vals[j] = v;
+        }
+        for (int c=0;c<5;c++) {
+            double best = 1e9, locked = 1e9, secs, held;
+            int bad = 0;
+            for (int rep=0;rep<5;rep++) {
+                bad |= bulk_bench_load(keys, vals, N, threads[c], &secs, &held);
+                if (secs < best) best = secs;
+                if (held < locked) locked = held;
+            }
+            if (threads[c]) printf("bulk_load  %d threads", threads[c]);
+            else printf("create_key one by one");
+            printf(", %-8s: %9.0f keys/s, lock held %5.2f ms%s\n", shuffled ? "shuffled" : "sorted", N/best,
+                   locked, bad ? ", WRONG" : "");
+        }
+    }
+    for (int i=0;i<N;i++) free(keys[i]), free(vals[i]);
+    free(keys);
+    free(vals);
+}
+
+static int server_cores;       // --cores
+
+// Applies the --name value options of server, resp-server and follower and
+// drops them from argv, leaving the positional arguments. Returns -1 after
+// printing what was wrong.
+static int server_options(int *argc, char **argv) {
+    int n = 2;
+    for (int i=2;i<*argc;i++) {
+        if (strncmp(argv[i], "--", 2) != 0) { argv[n++] = argv[i]; continue; }
+        const char *opt = argv[i], *val = i+1 < *argc ? argv[++i] : NULL;
+        if (!val) { printf("%s needs a value\n", opt); return -1; }
+        if (strcmp(opt, "--oracle") == 0) {
+            TsOracle *o = strcmp(val, "counter") == 0 ? &ts_counter : strcmp(val, "hlc") == 0 ? &ts_hlc :
+                          strncmp(val, "tso:", 4) == 0 ? tso_connect(val + 4) : NULL;
+            if (!o) { printf("bad oracle %s (counter, hlc or tso:<addr> of a running tso-server)\n", val); return -1; }
+            ts_oracle_set(o);
+        } else if (strcmp(opt, "--admit") == 0) {
+            admit_adaptive = strcmp(val, "auto") == 0;
+            admit_limit = admit_adaptive ? 16 : atoi(val);
+            if (admit_limit < 1) {
+                printf("--admit takes a limit or auto\n");
+                return -1;
+            }
+        } else if (strcmp(opt, "--cores") == 0 && strcmp(argv[1], "server") == 0) {
+            server_cores = atoi(val);
+            if (server_cores < 1 || server_cores > TPC_MAX_CORES) {
+                printf("--cores takes 1..%d\n", TPC_MAX_CORES);
+                return -1;
+            }
+        } else {
+            printf("unknown option %s\n", opt);
+            return -1;
+        }
+    }
+    argv[n] = NULL;
+    *argc = n;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);  // a peer that went away is an EPIPE, not an exit
+    if (argc > 1) {
+        if (strcmp(argv[1], "bench-lsm") == 0) bench_lsm();
+        else if (strcmp(argv[1], "bench-filter") == 0) bench_filter();
+        else if (strcmp(argv[1], "bench-cache") == 0) bench_cache();
+        else if (strcmp(argv[1], "bench-server") == 0) bench_server();
+        else if (strcmp(argv[1], "bench-resp") == 0) bench_resp();
+        else if (strcmp(argv[1], "bench-tpc") == 0) bench_tpc();
+        else if (strcmp(argv[1], "bench-repl") == 0) bench_repl();
+        else if (strcmp(argv[1], "bench-cdc") == 0) bench_cdc();
+        else if (strcmp(argv[1], "bench-watch") == 0) bench_watch();
+        else if (strcmp(argv[1], "bench-ttl") == 0) bench_ttl();
+        else if (strcmp(argv[1], "bench-index") == 0) bench_index();
+        else if (strcmp(argv[1], "bench-phantom") == 0) bench_phantom();
+        else if (strcmp(argv[1], "bench-2pl") == 0) bench_2pl();
+        else if (strcmp(argv[1], "bench-isolation") == 0) bench_isolation();
+        else if (strcmp(argv[1], "bench-oracle") == 0) bench_oracle();
+        else if (strcmp(argv[1], "bench-ts") == 0) bench_ts();
+        else if (strcmp(argv[1], "bench-2pc") == 0) bench_2pc();
+        else if (strcmp(argv[1], "bench-interleave") == 0) bench_interleave();
+        else if (strcmp(argv[1], "bench-async") == 0) bench_async();
+        else if (strcmp(argv[1], "bench-sched") == 0) bench_sched();
+        else if (strcmp(argv[1], "bench-admission") == 0) bench_admission();
+        else if (strcmp(argv[1], "bench-straggler") == 0) bench_straggler();
+        else if (strcmp(argv[1], "bench-inline-gc") == 0) bench_inline_gc();
+        else if (strcmp(argv[1], "bench-bulk") == 0) bench_bulk();
+        else if (strcmp(argv[1], "bench-recovery") == 0) bench_recovery(argc > 2 ? atol(argv[2]) : 256);
+        else if (strcmp(argv[1], "tso-server") == 0 && argc > 2) {
+            // tso-server <addr> [state file]
+            printf("serving timestamps on %s\n", argv[2]);
+            fflush(stdout);
+            if (tso_serve(argv[2], argc > 3 ? argv[3] : NULL) < 0) { printf("cannot listen on %s\n", argv[2]); return 1; }
+        }
+        else if ((strcmp(argv[1], "follower") == 0 || strcmp(argv[1], "server") == 0 ||
+                  strcmp(argv[1], "resp-server") == 0) && server_options(&argc, argv) < 0)
+            return 1;
+        else if (strcmp(argv[1], "follower") == 0 && argc > 3) {
+            // follower <primary repl addr> <serve addr> [lsm dir]
+            trace = 0;
+            if (argc > 4 && lsm_open(argv[4]) < 0) { printf("cannot open %s\n", argv[4]); return 1; }
+            reaper_start();
+            if (follower_run(argv[2], argv[3]) < 0) { printf("cannot start follower\n"); return 1; }
+        }
+        else if ((strcmp(argv[1], "server") == 0 || strcmp(argv[1], "resp-server") == 0) && argc > 2) {
+            // [resp-]server <addr> [lsm dir or -] [replication addr]
+            trace = 0;
+            if (server_cores && (argc > 4 || (argc > 3 && strcmp(argv[3], "-") != 0))) {
+                printf("--cores keeps its data in memory and cannot replicate\n");
+                return 1;
+            }
+            if (server_cores) {
+                if (tpc_start(server_cores, argv[2]) < 0) { printf("cannot listen on %s\n", argv[2]); return 1; }
+                printf("serving on %s with %d cores\n", argv[2], server_cores);
+                fflush(stdout);
+                while (!server_stop) usleep(100000);
+                tpc_stop();
+                return 0;
+            }
+            if (argc > 3 && strcmp(argv[3], "-") != 0 && lsm_open(argv[3]) < 0) { printf("cannot open %s\n", argv[3]); return 1; }
+            int lfd = server_listen(argv[2]);
+            if (lfd < 0) { printf("cannot listen on %s\n", argv[2]); return 1; }
+            if (argc > 4 && repl_start(argv[4]) < 0) { printf("cannot listen on %s\n", argv[4]); return 1; }
+            printf("serving on %s\n", argv[2]);
+            reaper_start();
+            server_run(lfd, strcmp(argv[1], "resp-server") == 0 ? PROTO_RESP : PROTO_BINARY);
+        }
+        else if ((strcmp(argv[1], "loadgen") == 0 || strcmp(argv[1], "resp-loadgen") == 0) && argc > 3)
+            // [resp-]loadgen <addr> <conns> [depth] [seconds]
+            loadgen(argv[2], argv[1][0] == 'r' ? PROTO_RESP : PROTO_BINARY, 0, atoi(argv[3]),
+                    argc > 4 ? atoi(argv[4]) : 1, argc > 5 ? atof(argv[5]) : 5);
+        else printf("usage: %s [bench-lsm|bench-filter|bench-cache|bench-server|bench-resp|\n"
+                    "    bench-tpc|bench-repl|bench-cdc|bench-watch|bench-ttl|bench-index|\n"
+                    "    bench-phantom|bench-2pl|bench-isolation|bench-oracle|bench-ts|bench-2pc|\n"
+                    "    bench-recovery [MB]|bench-interleave|bench-async|bench-sched|\n"
+                    "    bench-admission|bench-straggler|bench-inline-gc|bench-bulk|\n"
+                    "    tso-server <addr> [file]|[resp-]server <addr> [dir|-] [repl addr] [options]|\n"
+                    "    follower <repl addr> <addr> [dir] [options]|\n"
+                    "    [resp-]loadgen <addr> <conns> [depth] [secs]]\n"
+                    "server and follower options:\n"
+                    "    --oracle counter|hlc|tso:<addr>   where commit timestamps come from\n"
+                    "    --admit N|auto                    shed transactions (BUSY) beyond N running,\n"
+                    "                                      or a limit tuned on goodput\n"
+                    "    --cores N                         server: N thread-per-core shards, each with\n"
+                    "                                      its own listener and event loop\n"
+                    "                                      (in memory, writes not validated)\n",
+                    argv[0]);
+        return 0;
+    }
+
+
     create_key("A","initA");
     create_key("B","initB");
 